@@ -1,10 +1,17 @@
 #version 330 core
 
+// One program per texMode, specialized by the defines the renderer prepends (Renderer::meshDefines):
+// TEX_MODE n picks the texturing path (the texture itself is the material's layer); LIGHTING, NORMAL_MAP, ENV_MAP, ALPHA_TEST, FOG and TINT
+// turn on only the work that path needs
+
 in Data {
 	vec3 normal;
 	vec3 position;
 	vec2 texCoord;
+#ifdef NORMAL_MAP
 	mat3 m_tbn;
+#endif
+	vec4 tint;
 } DataIn;
 
 out vec4 colorOut;
@@ -39,47 +46,77 @@ struct SpotLight
     float cutoff;
 };
 
-struct Materials {
+// one slot per material in a uniform buffer, bound by offset before each draw
+layout (std140) uniform Material {
 	vec4 diffuse;
 	vec4 ambient;
 	vec4 specular;
 	vec4 emissive;
 	float shininess;
-};
-
-uniform Materials mat;
-uniform int texMode;
-
-uniform sampler2D texmap_stone;
-uniform sampler2D texmap_grass;
-uniform sampler2D texmap_window;
-uniform sampler2D texmap_bbgrass;
-uniform sampler2D texmap_bbtree;
-uniform sampler2D texmap_lightwood;
-uniform sampler2D texmap_particle;
-uniform sampler2D texmap_crcl;
-uniform sampler2D texmap_flar;
-uniform sampler2D texmap_hxgn;
-uniform sampler2D texmap_ring;
-uniform sampler2D texmap_sun;
-
+	int texLayer;
+	int normalLayer;
+} mat;
+
+// textures are layers of three arrays (Renderer TexArray); the layer comes with the material,
+// so a new texture needs neither a shader edit nor a texture unit
+#if TEX_MODE == 1 || TEX_MODE == 2 || TEX_MODE == 3 || TEX_MODE == 6
+uniform sampler2DArray surfaceTextures;
+#elif TEX_MODE == 4 || TEX_MODE == 5 || TEX_MODE == 14 || TEX_MODE == 17
+uniform sampler2DArray billboardTextures;
+#elif TEX_MODE >= 7 && TEX_MODE <= 12
+uniform sampler2DArray spriteTextures;
+#elif TEX_MODE == 13
 uniform samplerCube skybox;
-uniform int hasNormalMap;
-uniform sampler2D texmap_normal;
-
-const int MAX_POINT_LIGHTS = 10;
-const int MAX_SPOT_LIGHTS = 4;
+#elif TEX_MODE == 15
+// the rear view, rendered off screen (Renderer::beginMirror)
+uniform sampler2D mirrorTexture;
+#elif TEX_MODE == 16
+// distant groups of billboards baked one per layer (Renderer::beginImpostors)
+uniform sampler2DArray impostorTextures;
+#endif
+
+#ifdef LIGHTING
+// the directional light of the current view, in view space, uploaded once per view (LightsBlock in renderer.h)
+layout (std140) uniform Lights {
+	DirectionalLight directionalLight;
+	int directionalLightToggle;
+};
 
-uniform DirectionalLight directionalLight;
-uniform int directionalLightToggle;
-uniform PointLight pointLightArray[MAX_POINT_LIGHTS];
-uniform int pointLightNum;
-uniform SpotLight spotLightArray[MAX_SPOT_LIGHTS];
-uniform int spotLightNum;
+// point and spot lights, binned per cluster on the CPU (Renderer::binLights).
+// Must match CLUSTER_X, CLUSTER_Y and CLUSTER_Z in renderer.h
+const int CLUSTER_X = 16;
+const int CLUSTER_Y = 9;
+const int CLUSTER_Z = 24;
+uniform samplerBuffer lightData;     // 5 texels per light
+uniform usamplerBuffer clusterData;  // (first index, count) per cluster
+uniform usamplerBuffer lightIndices;
+uniform vec4 clusterViewport;        // x, y, width, height
+uniform vec4 clusterDepth;           // slice scale, slice bias, 1 for logarithmic slices
+
+// cascaded shadow maps of the directional light (Renderer::fitShadowCascades). Must match SHADOW_CASCADES
+const int SHADOW_CASCADES = 3;
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[SHADOW_CASCADES]; // view space -> shadow map coordinates and depth, in [0, 1]
+uniform int shadowsOn;
+
+// spot light shadows, one tile of the atlas per shadowed spot. Must match MAX_SPOT_SHADOWS
+const int MAX_SPOT_SHADOWS = 8;
+uniform sampler2DShadow spotShadowAtlas;
+uniform mat4 spotShadowMatrices[MAX_SPOT_SHADOWS]; // view space -> atlas coordinates and depth, projective
+uniform vec4 spotShadowTiles[MAX_SPOT_SHADOWS]; // atlas rectangle of each tile, min xy and max xy, half a texel in
+#endif
+
+#ifdef REFLECTION
+// the scene mirrored in the floor, rendered off screen (Renderer::beginReflection) and addressed by window position
+uniform sampler2D reflectionTexture;
+uniform vec4 reflectionViewport; // x, y, width, height; width 0 without a reflection
+#endif
 
 uniform vec4 fogColor = vec4(0.f);
 
-vec4 CalcLight(Light light, vec3 lightDirection, vec3 normal)
+#ifdef LIGHTING
+// visibility scales the diffuse and specular terms: the share of the light reaching the fragment
+vec4 CalcLight(Light light, vec3 lightDirection, vec3 normal, float visibility)
 {
     vec4 ambient  = light.color * light.ambientIntensity * mat.ambient;
     vec4 diffuse  = vec4(0);
@@ -97,35 +134,70 @@ vec4 CalcLight(Light light, vec3 lightDirection, vec3 normal)
         }
     }
 
-    return ambient + diffuse + specular;
+    return ambient + (diffuse + specular) * visibility;
+}
+
+// lit fraction of the fragment: the first (finest) cascade covering it, 3x3 PCF
+float CalcShadow()
+{
+    if (shadowsOn == 0)
+        return 1.f;
+
+    // pushed along the geometric normal, against acne on surfaces grazing the light
+    vec4 position = vec4(DataIn.position + normalize(DataIn.normal) * 0.05f, 1.f);
+    for (int c = 0; c < SHADOW_CASCADES; c++) {
+        vec3 coord = (shadowMatrices[c] * position).xyz;
+        if (all(greaterThan(coord, vec3(0.f))) && all(lessThan(coord, vec3(1.f)))) {
+            vec2 texel = 1.f / vec2(textureSize(shadowMap, 0).xy);
+            float lit = 0.f;
+            for (int x = -1; x <= 1; x++)
+                for (int y = -1; y <= 1; y++)
+                    lit += texture(shadowMap, vec4(coord.xy + vec2(x, y) * texel, c, coord.z));
+            return lit / 9.f;
+        }
+    }
+    return 1.f;
+}
+
+// lit fraction of the fragment for the spot light of the given atlas tile, 3x3 PCF
+float CalcSpotShadow(int tile)
+{
+    vec4 coord = spotShadowMatrices[tile] * vec4(DataIn.position + normalize(DataIn.normal) * 0.02f, 1.f);
+    coord.xyz /= coord.w;
+    vec2 texel = 1.f / vec2(textureSize(spotShadowAtlas, 0));
+    float lit = 0.f;
+    for (int x = -1; x <= 1; x++)
+        for (int y = -1; y <= 1; y++)
+            lit += texture(spotShadowAtlas, vec3(clamp(coord.xy + vec2(x, y) * texel, spotShadowTiles[tile].xy, spotShadowTiles[tile].zw), coord.z));
+    return lit / 9.f;
 }
 
 vec4 CalcDirectionalLight(vec3 normal)
 {
     vec3 direction = vec3(normalize(directionalLight.direction));
-    return CalcLight(directionalLight.base, direction, normal);
+    return CalcLight(directionalLight.base, direction, normal, CalcShadow());
 }
 
-vec4 CalcPointLight(PointLight light, vec3 normal)
+vec4 CalcPointLight(PointLight light, vec3 normal, float visibility)
 {
     vec3 lightDirection = DataIn.position - vec3(light.position);
     float distance = length(lightDirection);
     lightDirection = normalize(lightDirection);
 
-    vec4 color = CalcLight(light.base, lightDirection, normal);
+    vec4 color = CalcLight(light.base, lightDirection, normal, visibility);
     float attenuation = light.constant + light.linear * distance + light.exponential * distance * distance;
 
     return color / attenuation;
 }
 
-vec4 CalcSpotLight(SpotLight light, vec3 normal)
+vec4 CalcSpotLight(SpotLight light, vec3 normal, int shadow)
 {
     vec3 direction = vec3(normalize(light.direction));
     vec3 lightDirection = normalize(DataIn.position - vec3(light.base.position));
     float spotlightAngle = dot(lightDirection, direction);
 
     if (spotlightAngle > light.cutoff) {
-        vec4 color = CalcPointLight(light.base, normal);
+        vec4 color = CalcPointLight(light.base, normal, shadow >= 0 ? CalcSpotShadow(shadow) : 1.f);
         float intensitySpotlight = 1.f - ((1.f - spotlightAngle) / (1.f - light.cutoff));
         return color * intensitySpotlight;
     }
@@ -133,6 +205,38 @@ vec4 CalcSpotLight(SpotLight light, vec3 normal)
     return vec4(0);
 }
 
+// shades the point and spot lights listed in the fragment's cluster
+vec4 CalcClusterLights(vec3 normal)
+{
+    vec2 tile = (gl_FragCoord.xy - clusterViewport.xy) / clusterViewport.zw * vec2(CLUSTER_X, CLUSTER_Y);
+    float depth = -DataIn.position.z;
+    float slice = clusterDepth.z > 0.5f ? log(max(depth, 1e-4f)) * clusterDepth.x + clusterDepth.y
+                                        : depth * clusterDepth.x + clusterDepth.y;
+    ivec3 cell = clamp(ivec3(tile, slice), ivec3(0), ivec3(CLUSTER_X - 1, CLUSTER_Y - 1, CLUSTER_Z - 1));
+    uvec2 range = texelFetch(clusterData, (cell.z * CLUSTER_Y + cell.y) * CLUSTER_X + cell.x).xy;
+
+    vec4 total = vec4(0);
+    for (uint i = 0u; i < range.y; i++) {
+        int index = int(texelFetch(lightIndices, int(range.x + i)).x) * 5;
+        vec4 t0 = texelFetch(lightData, index);     // color.rgb, ambient
+        vec4 t1 = texelFetch(lightData, index + 1); // position.xyz, diffuse
+        vec4 t2 = texelFetch(lightData, index + 2); // constant, linear, exponential, cutoff
+        vec4 t3 = texelFetch(lightData, index + 3); // direction.xyz, color.a
+
+        PointLight point = PointLight(Light(vec4(t0.rgb, t3.w), t0.a, t1.a), vec4(t1.xyz, 1.f), t2.x, t2.y, t2.z);
+        // point lights carry a cutoff of -2
+        if (t2.w > -1.5f) {
+            int shadow = int(texelFetch(lightData, index + 4).x); // -1 without a tile
+            total += CalcSpotLight(SpotLight(point, vec4(t3.xyz, 0.f), t2.w), normal, shadow);
+        }
+        else
+            total += CalcPointLight(point, normal, 1.f);
+    }
+    return total;
+}
+
+#endif
+
 float CalcFogFactor()
 {
     float fogEnd = 500.f;
@@ -145,101 +249,79 @@ float CalcFogFactor()
 
 void main()
 {
+#ifdef LIGHTING
     vec3 normal = normalize(DataIn.normal);
+#ifdef NORMAL_MAP
+    normal = normalize(DataIn.m_tbn * (texture(surfaceTextures, vec3(DataIn.texCoord, mat.normalLayer)) * 2.0 - 1.0).xyz);
+#endif
     vec4 lightTotal = mat.emissive;
-
-    if (texMode == 2) {
-        normal = normalize(DataIn.m_tbn * (texture(texmap_normal, DataIn.texCoord) * 2.0 - 1.0).xyz);
-    }
-
     lightTotal += directionalLightToggle * CalcDirectionalLight(normal);
-
-    for (int i = 0; i < pointLightNum; i++) {
-        lightTotal += CalcPointLight(pointLightArray[i], normal);
-    }
-
-    for (int i = 0; i < spotLightNum; i++) {
-        lightTotal += CalcSpotLight(spotLightArray[i], normal);
-    }
-
-    if (texMode == 0) {
-        // no texture
-		colorOut = vec4(vec3(0.0), 0.5);
-    } else if (texMode == 1) {
-        // tiled grass
-        float tilingFactor1 = 11.f;
-        float tilingFactor2 = 23.f;
-
-        vec4 texel1 = texture(texmap_grass, DataIn.texCoord * tilingFactor1);
-        vec4 texel2 = texture(texmap_grass, DataIn.texCoord * tilingFactor2);
-        colorOut = mix(texel1, texel2, 0.5f) * vec4(lightTotal.rgb, 0.9);//lightTotal;
-    } else if (texMode == 2) {
-        // texel only, use stone.tga
-        colorOut = texture(texmap_stone, DataIn.texCoord) * lightTotal;
-    } else if (texMode == 3) {
-        // window texture
-        colorOut = texture(texmap_window, DataIn.texCoord) * vec4(lightTotal.xyz, 1.f);
-    } else if (texMode == 4) {
-        // billboard grass texture
-        vec4 texel = texture(texmap_bbgrass, DataIn.texCoord);
-        if (texel.a < 0.1f) discard;
-        colorOut = vec4(texel.rgb, 1.f) * lightTotal;
-    }else if (texMode == 5) {
-        // billboard tree texture
-        vec4 texel = texture(texmap_bbtree, DataIn.texCoord);
-        if (texel.a < 0.1f) discard;
-        colorOut = vec4(texel.rgb / texel.a, 1.f) * lightTotal;
-    }  
-    else if (texMode == 6) {
-        // lightwood texture
-        colorOut = texture(texmap_lightwood, DataIn.texCoord) * lightTotal;
-    }  else if (texMode == 7) {
-        // particle texture
-        vec4 texel = texture(texmap_particle, DataIn.texCoord);
-        if (texel.a < 0.1f) discard; 
-        colorOut = texel;           
-    }
-    else if (texMode == 8) {
-        // crcl texture (flare - additive, no lighting)
-        vec4 texel = texture(texmap_crcl, DataIn.texCoord);
-        if (texel.a < 0.1f) discard;
-        colorOut = vec4(texel.rgb, texel.a);
-    }
-    else if (texMode == 9) {
-        // flar texture (flare - additive, no lighting)
-        vec4 texel = texture(texmap_flar, DataIn.texCoord);
-        if (texel.a < 0.1f) discard;
-        colorOut = vec4(texel.rgb, texel.a);
-    }
-    else if (texMode == 10) {
-        // hxgn texture (flare - additive, no lighting)
-        vec4 texel = texture(texmap_hxgn, DataIn.texCoord);
-        if (texel.a < 0.1f) discard;
-        colorOut = vec4(texel.rgb, texel.a);
-    }
-    else if (texMode == 11) {
-        // ring texture (flare - additive, no lighting)
-        vec4 texel = texture(texmap_ring, DataIn.texCoord);
-        if (texel.a < 0.1f) discard;
-        colorOut = vec4(texel.rgb, texel.a);
+    lightTotal += CalcClusterLights(normal);
+#endif
+
+#if TEX_MODE == 0
+    // no texture
+    colorOut = vec4(vec3(0.0), 0.5);
+#elif TEX_MODE == 1
+    // tiled grass
+    float tilingFactor1 = 11.f;
+    float tilingFactor2 = 23.f;
+
+    vec4 texel1 = texture(surfaceTextures, vec3(DataIn.texCoord * tilingFactor1, mat.texLayer));
+    vec4 texel2 = texture(surfaceTextures, vec3(DataIn.texCoord * tilingFactor2, mat.texLayer));
+    colorOut = mix(texel1, texel2, 0.5f) * vec4(lightTotal.rgb, 0.9);
+#ifdef REFLECTION
+    // the floor lets 10% of the reflection through, as when it was blended over the mirrored scene
+    if (reflectionViewport.z > 0.f) {
+        vec3 reflected = texture(reflectionTexture, (gl_FragCoord.xy - reflectionViewport.xy) / reflectionViewport.zw).rgb;
+        colorOut = vec4(mix(reflected, colorOut.rgb, colorOut.a), 1.f);
     }
-    else if (texMode == 12) {
-        // sun texture (flare - additive, no lighting)
-        vec4 texel = texture(texmap_sun, DataIn.texCoord);
-        if (texel.a < 0.1f) discard;
-        colorOut = vec4(texel.rgb, texel.a);
-    }
-    else if (texMode == 13) {
-        vec3 reflected = reflect(normalize(DataIn.position), normalize(normal));
-        colorOut = texture(skybox, reflected);
-    }
-    else if (texMode == 14) {
-        vec4 texel = texture(texmap_bbtree, DataIn.texCoord);
-        if (texel.a < 0.1f) discard;
-		colorOut = vec4(vec3(0.0), 0.5);
-    }
-
-    if (fogColor != vec4(0) && texMode != 0 && texMode < 8) {
+#endif
+#elif TEX_MODE == 2 || TEX_MODE == 6
+    // modulated texel (stone, lightwood)
+    colorOut = texture(surfaceTextures, vec3(DataIn.texCoord, mat.texLayer)) * lightTotal;
+#elif TEX_MODE == 3
+    // window texture
+    colorOut = texture(surfaceTextures, vec3(DataIn.texCoord, mat.texLayer)) * vec4(lightTotal.xyz, 1.f);
+#elif TEX_MODE == 4 || TEX_MODE == 5 || TEX_MODE == 14 || TEX_MODE == 17
+    // billboard grass / tree texture (14: its shadow, 17: baked into an impostor)
+    vec4 texel = texture(billboardTextures, vec3(DataIn.texCoord, mat.texLayer));
+#elif TEX_MODE == 16
+    vec4 texel = texture(impostorTextures, vec3(DataIn.texCoord, mat.texLayer));
+#elif TEX_MODE >= 7 && TEX_MODE <= 12
+    // particle and flare pieces: additive, no lighting
+    vec4 texel = texture(spriteTextures, vec3(DataIn.texCoord, mat.texLayer));
+#elif TEX_MODE == 13
+    vec3 reflected = reflect(normalize(DataIn.position), normalize(DataIn.normal));
+    colorOut = texture(skybox, reflected);
+#elif TEX_MODE == 15
+    colorOut = vec4(texture(mirrorTexture, DataIn.texCoord).rgb, 1.f);
+#endif
+
+#ifdef ALPHA_TEST
+    if (texel.a < 0.1f) discard;
+#endif
+
+#if TEX_MODE == 4
+    colorOut = vec4(texel.rgb, 1.f) * lightTotal;
+#elif TEX_MODE == 5 || TEX_MODE == 16
+    colorOut = vec4(texel.rgb / texel.a, 1.f) * lightTotal;
+#elif TEX_MODE == 17
+    colorOut = vec4(texel.rgb / texel.a, 1.f);
+#elif TEX_MODE >= 7 && TEX_MODE <= 12
+    colorOut = texel;
+#elif TEX_MODE == 14
+    colorOut = vec4(vec3(0.0), 0.5);
+#endif
+
+    // shadows (0, 14) stay black
+#ifdef TINT
+    colorOut *= DataIn.tint;
+#endif
+
+#ifdef FOG
+    if (fogColor != vec4(0)) {
         colorOut = mix(fogColor, colorOut, CalcFogFactor());
     }
+#endif
 }
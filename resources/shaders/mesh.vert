@@ -1,33 +1,84 @@
 #version 330 core
 
-uniform mat4 m_pvm;
-uniform mat4 m_viewModel;
-uniform mat3 m_normal;
+// compiled once per feature set: the renderer prepends LIGHTING, NORMAL_MAP, ENV_MAP... (see Renderer::meshDefines)
 
-in vec4 position;
-in vec4 normal;
-in vec4 texCoord;
-in vec4 tangent;
+uniform mat4 m_projection;
+
+// compact vertex: float3 position, 10:10:10:2 normal and tangent, half float uv
+in vec3 position;
+in vec3 normal;
+in vec2 texCoord;
+in vec3 tangent;
+
+// per instance: the renderer batches identical meshes into one instanced draw
+in mat4 instanceViewModel;
+in vec4 instanceTint;
 
 out Data {
 	vec3 normal;
 	vec3 position;
 	vec2 texCoord;
+#ifdef NORMAL_MAP
 	mat3 m_tbn;
+#endif
+	vec4 tint;
 } DataOut;
 
+// must match the depth pre-pass (shadow.vert) bit for bit
+invariant gl_Position;
+
+// a billboard instance (Renderer::submitBillboard) comes as scale, view space up axis, (0, 0, 0, mode) and
+// view space position: the basis facing the camera, at the origin of view space, is built here. The basis is
+// orthonormal, so its normal matrix is the same axes divided by the scale
+mat4 billboardViewModel(mat4 packed, out mat3 normalMatrix)
+{
+	vec3 center = packed[3].xyz;
+	vec3 up = normalize(packed[1].xyz);
+	vec3 z = -center;
+	if (packed[2].w < 1.5)
+		z -= dot(z, up) * up; // cylindrical: turned about the up axis only
+	z = dot(z, z) > 1e-12 ? normalize(z) : vec3(0.0, 0.0, 1.0);
+	vec3 x = normalize(cross(up, z));
+	vec3 y = cross(z, x);
+	normalMatrix = mat3(x / packed[0].x, y / packed[0].y, z / packed[0].z);
+	return mat4(vec4(x * packed[0].x, 0.0), vec4(y * packed[0].y, 0.0), vec4(z * packed[0].z, 0.0), vec4(center, 1.0));
+}
+
 void main ()
 {
-	DataOut.normal = normalize(m_normal * normal.xyz);
-	DataOut.position = vec3(m_viewModel * position);
-	DataOut.texCoord = texCoord.st;
-	
-	vec3 n = normalize(m_normal * normal.xyz);
-	vec3 t = normalize(m_normal * tangent.xyz);
+	// normal matrix, the inverse transpose of the upper 3x3 of the view model, up to a positive factor: normalized below
+	mat3 m_normal;
+	mat4 viewModel;
+	if (instanceViewModel[2].w > 0.0)
+		viewModel = billboardViewModel(instanceViewModel, m_normal);
+	else
+	{
+		// the cofactor matrix is the inverse transpose times the determinant: no inverse() per vertex, and the
+		// determinant's sign, negative for mirrored instances, is put back
+		viewModel = instanceViewModel;
+		mat3 m = mat3(viewModel);
+		m_normal = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));
+		if (dot(m[0], m_normal[0]) < 0.0)
+			m_normal = -m_normal;
+	}
+	vec4 viewPos = viewModel * vec4(position, 1.0);
+
+	DataOut.position = vec3(viewPos);
+	DataOut.texCoord = texCoord;
+	DataOut.tint = instanceTint;
+
+#if defined(LIGHTING) || defined(ENV_MAP)
+	vec3 n = normalize(m_normal * normal);
+	DataOut.normal = n;
+
+#ifdef NORMAL_MAP
+	vec3 t = normalize(m_normal * tangent);
 	// Gram-Schmidt process
     t = normalize(t - dot(t, n) * n);
     vec3 b = cross(n, t);
     DataOut.m_tbn = mat3(t, b, n);
+#endif
+#endif
 
-	gl_Position = m_pvm * position;	
+	gl_Position = m_projection * viewPos;
 }
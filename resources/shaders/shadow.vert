@@ -0,0 +1,31 @@
+#version 330 core
+
+// depth only passes (shadow maps, depth pre-pass): position and the per instance view model, nothing else
+uniform mat4 m_projection;
+
+in vec3 position;
+in mat4 instanceViewModel;
+
+// the depth pre-pass is depth tested GL_EQUAL against mesh.vert: same expression, invariant
+invariant gl_Position;
+
+// billboard instances (Renderer::submitBillboard), turned to the camera here as in mesh.vert
+mat4 billboardViewModel(mat4 packed)
+{
+	vec3 center = packed[3].xyz;
+	vec3 up = normalize(packed[1].xyz);
+	vec3 z = -center;
+	if (packed[2].w < 1.5)
+		z -= dot(z, up) * up; // cylindrical: turned about the up axis only
+	z = dot(z, z) > 1e-12 ? normalize(z) : vec3(0.0, 0.0, 1.0);
+	vec3 x = normalize(cross(up, z));
+	vec3 y = cross(z, x);
+	return mat4(vec4(x * packed[0].x, 0.0), vec4(y * packed[0].y, 0.0), vec4(z * packed[0].z, 0.0), vec4(center, 1.0));
+}
+
+void main()
+{
+	mat4 viewModel = instanceViewModel[2].w > 0.0 ? billboardViewModel(instanceViewModel) : instanceViewModel;
+	vec4 viewPos = viewModel * vec4(position, 1.0);
+	gl_Position = m_projection * viewPos;
+}
@@ -1,12 +1,16 @@
 #version 330 core
 
 in vec2 TexCoords;
+in vec4 TextColor;
+flat in float Page;
 out vec4 color;
 
-uniform sampler2D fontAtlasTexture;
-uniform vec4 textColor;
+uniform sampler2DArray fontAtlasTexture; // signed distance field, 0.5 on the glyph outline; a layer per page
 void main()
 {
-    vec4 sampled = vec4(1.0, 1.0, 1.0, texture(fontAtlasTexture, TexCoords).r);
-    color = textColor * sampled;
+    float distance = texture(fontAtlasTexture, vec3(TexCoords, Page)).r;
+    // antialias over about one screen pixel, whatever the text scale
+    float width = max(fwidth(distance), 1e-4);
+    float alpha = smoothstep(0.5 - width, 0.5 + width, distance);
+    color = TextColor * vec4(1.0, 1.0, 1.0, alpha);
 }
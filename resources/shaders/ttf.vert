@@ -1,11 +1,17 @@
 #version 330 core
 
 layout (location = 0) in vec4 vertex;
+layout (location = 1) in vec4 color;
+layout (location = 2) in float page;
 out vec2 TexCoords;
+out vec4 TextColor;
+flat out float Page;
 
 uniform mat4 pvm;
 void main()
 {
     gl_Position = pvm * vec4(vertex.xy, 0.0, 1.0);
     TexCoords = vertex.zw;
+    TextColor = color;
+    Page = page;
 }
@@ -62,6 +62,9 @@ void CollisionSystem::checkCollisions()
 
 void CollisionSystem::showDebug(Renderer &renderer, gmu &mu)
 {
+	// Enable wireframe
+	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+
 	for (Collider *c : colliders)
 	{
 		const auto &box = c->getBox();
@@ -81,24 +84,21 @@ void CollisionSystem::showDebug(Renderer &renderer, gmu &mu)
 					 centerZ - scaleZ * 0.5f);
 		mu.scale(gmu::MODEL, scaleX, scaleY, scaleZ); // Scale to box size only
 
-		mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
-		mu.computeNormalMatrix3x3();
-
-		// Enable wireframe
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		mu.computeDerivedMatrix(gmu::VIEW_MODEL);
 
 		dataMesh data;
 		data.meshID = debugCubeMeshID;
 		data.texMode = 1;
 		data.vm = mu.get(gmu::VIEW_MODEL);
-		data.pvm = mu.get(gmu::PROJ_VIEW_MODEL);
-		data.normal = mu.getNormalMatrix();
+		data.proj = mu.get(gmu::PROJECTION);
 
-		renderer.renderMesh(data);
-
-		// Restore fill mode
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		renderer.submit(data);
 
 		mu.popMatrix(gmu::MODEL);
 	}
+	// all the boxes share one mesh: a single sorted flush draws them back to back
+	renderer.flush();
+
+	// Restore fill mode
+	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 }
@@ -0,0 +1,188 @@
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include "geometryPool.h"
+#include "shader.h"
+
+#define POOL_INITIAL_VERTICES (64 * 1024)
+#define POOL_INITIAL_INDICES (256 * 1024)
+
+static_assert(sizeof(GeometryPool::Vertex) == 24, "the pool vertex must stay tightly packed");
+
+// packs a direction in [-1, 1] into signed normalized 10:10:10:2 (w is -1, 0 or 1)
+static uint32_t packSnorm1010102(const float *v)
+{
+	auto pack = [](float x, float scale, uint32_t mask)
+	{
+		x = std::min(1.0f, std::max(-1.0f, x));
+		return (uint32_t)(int32_t)std::lround(x * scale) & mask;
+	};
+	return pack(v[0], 511.0f, 0x3FF) | (pack(v[1], 511.0f, 0x3FF) << 10) |
+		   (pack(v[2], 511.0f, 0x3FF) << 20) | (pack(v[3], 1.0f, 0x3) << 30);
+}
+
+// IEEE 754 binary16, round to nearest; texture coordinates never need denormals or NaN
+static uint16_t floatToHalf(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+
+	uint32_t sign = (bits >> 16) & 0x8000;
+	int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+	uint32_t mantissa = bits & 0x7FFFFF;
+
+	if (exponent <= 0)
+		return (uint16_t)sign; // too small: signed zero
+	if (exponent >= 31)
+		return (uint16_t)(sign | 0x7BFF); // too large: clamp to the largest finite half
+
+	uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000) // round the dropped bits
+		half++;
+	return (uint16_t)half;
+}
+
+GeometryPool &GeometryPool::getInstance()
+{
+	static GeometryPool instance;
+	return instance;
+}
+
+void GeometryPool::init()
+{
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferData(GL_ARRAY_BUFFER, POOL_INITIAL_VERTICES * sizeof(Vertex), nullptr, GL_STATIC_DRAW);
+	vertexCapacity = POOL_INITIAL_VERTICES;
+	setVertexAttribs();
+
+	glGenBuffers(1, &ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, POOL_INITIAL_INDICES * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+	indexCapacity = POOL_INITIAL_INDICES;
+}
+
+void GeometryPool::setVertexAttribs()
+{
+	glEnableVertexAttribArray(Shader::VERTEX_COORD_ATTRIB);
+	glVertexAttribPointer(Shader::VERTEX_COORD_ATTRIB, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, position));
+	glEnableVertexAttribArray(Shader::NORMAL_ATTRIB);
+	glVertexAttribPointer(Shader::NORMAL_ATTRIB, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(Vertex), (void *)offsetof(Vertex, normal));
+	glEnableVertexAttribArray(Shader::TEXTURE_COORD_ATTRIB);
+	glVertexAttribPointer(Shader::TEXTURE_COORD_ATTRIB, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, texCoord));
+	glEnableVertexAttribArray(Shader::TANGENT_ATTRIB);
+	glVertexAttribPointer(Shader::TANGENT_ATTRIB, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(Vertex), (void *)offsetof(Vertex, tangent));
+}
+
+// Reallocates buffer with at least `needed` elements, keeping its contents. Expects the pool VAO bound.
+void GeometryPool::grow(GLuint &buffer, GLenum target, size_t &capacity, size_t elemSize, size_t needed)
+{
+	size_t newCapacity = std::max(needed, capacity * 2);
+
+	GLuint newBuffer;
+	glGenBuffers(1, &newBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, newCapacity * elemSize, nullptr, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, capacity * elemSize);
+	glDeleteBuffers(1, &buffer);
+
+	buffer = newBuffer;
+	capacity = newCapacity;
+
+	// point the VAO at the new storage
+	glBindBuffer(target, buffer);
+	if (target == GL_ARRAY_BUFFER)
+		setVertexAttribs();
+}
+
+GeometryPool::Range GeometryPool::add(int numVertices, const float *position, const float *normal, const float *texCoord,
+									  const float *tangent, int numIndices, const GLuint *indices)
+{
+	if (vao == 0)
+		init();
+
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+
+	if (vertexCount + numVertices > vertexCapacity)
+		grow(vbo, GL_ARRAY_BUFFER, vertexCapacity, sizeof(Vertex), vertexCount + numVertices);
+	if (indexCount + numIndices > indexCapacity)
+		grow(ibo, GL_ELEMENT_ARRAY_BUFFER, indexCapacity, sizeof(GLuint), indexCount + numIndices);
+
+	// interleave and pack the separate vec4 streams of the mesh builders. Position w is always 1
+	// and the shader gets it back as the default 4th component
+	static const float zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	std::vector<Vertex> vertices(numVertices);
+	for (int i = 0; i < numVertices; i++)
+	{
+		Vertex &v = vertices[i];
+		memcpy(v.position, position + i * 4, sizeof(v.position));
+		v.normal = packSnorm1010102(normal ? normal + i * 4 : zero);
+		v.tangent = packSnorm1010102(tangent ? tangent + i * 4 : zero);
+		v.texCoord[0] = floatToHalf(texCoord ? texCoord[i * 4] : 0.0f);
+		v.texCoord[1] = floatToHalf(texCoord ? texCoord[i * 4 + 1] : 0.0f);
+	}
+
+	Range range;
+	range.baseVertex = (GLint)vertexCount;
+	range.firstIndex = (GLuint)indexCount;
+
+	// bounding sphere around the center of the bounding box, for culling
+	float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+	for (int i = 0; i < numVertices; i++)
+		for (int k = 0; k < 3; k++)
+		{
+			lo[k] = std::min(lo[k], position[i * 4 + k]);
+			hi[k] = std::max(hi[k], position[i * 4 + k]);
+		}
+	float radius2 = 0.0f;
+	for (int k = 0; k < 3; k++)
+		range.bounds[k] = numVertices > 0 ? (lo[k] + hi[k]) * 0.5f : 0.0f;
+	for (int i = 0; i < numVertices; i++)
+	{
+		float dx = position[i * 4] - range.bounds[0], dy = position[i * 4 + 1] - range.bounds[1], dz = position[i * 4 + 2] - range.bounds[2];
+		radius2 = std::max(radius2, dx * dx + dy * dy + dz * dz);
+	}
+	range.bounds[3] = std::sqrt(radius2);
+
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferSubData(GL_ARRAY_BUFFER, vertexCount * sizeof(Vertex), numVertices * sizeof(Vertex), vertices.data());
+	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(GLuint), numIndices * sizeof(GLuint), indices);
+	vertexCount += numVertices;
+	indexCount += numIndices;
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+	return range;
+}
+
+GLuint GeometryPool::addIndices(int numIndices, const GLuint *indices)
+{
+	if (vao == 0)
+		init();
+
+	glBindVertexArray(vao);
+	if (indexCount + numIndices > indexCapacity)
+		grow(ibo, GL_ELEMENT_ARRAY_BUFFER, indexCapacity, sizeof(GLuint), indexCount + numIndices);
+
+	GLuint firstIndex = (GLuint)indexCount;
+	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(GLuint), numIndices * sizeof(GLuint), indices);
+	indexCount += numIndices;
+
+	glBindVertexArray(0);
+	return firstIndex;
+}
+
+void GeometryPool::release()
+{
+	glDeleteVertexArrays(1, &vao);
+	glDeleteBuffers(1, &vbo);
+	glDeleteBuffers(1, &ibo);
+	vao = vbo = ibo = 0;
+	vertexCount = vertexCapacity = indexCount = indexCapacity = 0;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstddef>
+#include <cstdint>
+
+// Every mesh's vertices and indices are suballocated from one vertex buffer and one
+// index buffer, described by a single VAO. Meshes are drawn with a base vertex and
+// first index into the shared buffers, so switching mesh never switches VAO.
+class GeometryPool
+{
+public:
+	// shared vertex format, 24 bytes: normal and tangent are GL_INT_2_10_10_10_REV, texCoord is half float
+	struct Vertex
+	{
+		float position[3];
+		uint32_t normal;
+		uint32_t tangent;
+		uint16_t texCoord[2];
+	};
+
+	// where a mesh landed in the pool
+	struct Range
+	{
+		GLint baseVertex;
+		GLuint firstIndex; // in indices, not bytes
+		float bounds[4];   // object space bounding sphere: center xyz, radius
+	};
+
+	static GeometryPool &getInstance();
+
+	// attribute arrays hold 4 floats per vertex, as the mesh builders produce them; they are packed on upload.
+	// normal, texCoord and tangent may be null (zero filled)
+	Range add(int numVertices, const float *position, const float *normal, const float *texCoord,
+			  const float *tangent, int numIndices, const GLuint *indices);
+	// more indices into vertices already added (e.g. a coarser level of detail), relative to the same base
+	// vertex; returns their first index
+	GLuint addIndices(int numIndices, const GLuint *indices);
+
+	GLuint getVAO() const { return vao; }
+	size_t getVertexCount() const { return vertexCount; }
+	size_t getIndexCount() const { return indexCount; }
+	void release();
+
+private:
+	GeometryPool() = default;
+
+	GLuint vao = 0, vbo = 0, ibo = 0;
+	size_t vertexCount = 0, vertexCapacity = 0;
+	size_t indexCount = 0, indexCapacity = 0;
+
+	void init();
+	void grow(GLuint &buffer, GLenum target, size_t &capacity, size_t elemSize, size_t needed);
+	void setVertexAttribs();
+};
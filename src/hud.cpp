@@ -0,0 +1,88 @@
+#include <cstdio>
+#include <cstring>
+#include "hud.h"
+
+Hud::Element Hud::add(float x, float y, float size, const float *color)
+{
+	Item item;
+	item.text.position[0] = x;
+	item.text.position[1] = y;
+	item.text.size = size;
+	memcpy(item.text.color, color, sizeof(item.text.color));
+	items.push_back(item);
+	dirty = true;
+	return (Element)items.size() - 1;
+}
+
+void Hud::changed(Item &item)
+{
+	item.dirty = true;
+	dirty = true;
+}
+
+void Hud::setText(Element element, const char *text)
+{
+	Item &item = items[element];
+	item.hasValue = false;
+	if (item.text.str == text)
+		return;
+	item.text.str = text; // reuses the string's storage when it fits
+	changed(item);
+}
+
+void Hud::setNumber(Element element, const char *format, int value)
+{
+	Item &item = items[element];
+	if (item.hasValue && item.value == value)
+		return;
+	item.value = value;
+	item.hasValue = true;
+
+	char buffer[128];
+	snprintf(buffer, sizeof(buffer), format, value);
+	item.text.str = buffer;
+	changed(item);
+}
+
+void Hud::setPosition(Element element, float x, float y)
+{
+	Item &item = items[element];
+	if (item.text.position[0] == x && item.text.position[1] == y)
+		return;
+	item.text.position[0] = x;
+	item.text.position[1] = y;
+	changed(item);
+}
+
+void Hud::setVisible(Element element, bool visible)
+{
+	Item &item = items[element];
+	if (item.visible == visible)
+		return;
+	item.visible = visible;
+	dirty = true; // its glyphs are kept, only the combined quads change
+}
+
+void Hud::render(Renderer &renderer, const float *pvm)
+{
+	if (dirty)
+	{
+		// both vectors keep their capacity, so once the HUD has grown to its largest, rebuilding is only copies
+		vertices.clear();
+		for (auto &item : items)
+		{
+			if (!item.visible)
+				continue;
+			if (item.dirty)
+			{
+				item.vertices.clear();
+				renderer.layoutText(item.text, item.vertices);
+				item.dirty = false;
+			}
+			vertices.insert(vertices.end(), item.vertices.begin(), item.vertices.end());
+		}
+		dirty = false;
+	}
+	if (!vertices.empty())
+		renderer.renderText(vertices, pvm);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "renderer.h"
+
+// Retained screen text: elements are created once and keep their glyph quads. Setting the text, position or
+// visibility of an element only marks it dirty when it actually changes; render lays out the dirty elements again
+// and queues everything in one renderText call, so a frame where nothing changed does no layout nor allocation.
+class Hud
+{
+public:
+	typedef int Element;
+
+	Element add(float x, float y, float size, const float *color);
+
+	void setText(Element element, const char *text);
+	// formats value (a printf format taking one int) only when it differs from the last value set
+	void setNumber(Element element, const char *format, int value);
+	void setPosition(Element element, float x, float y);
+	void setVisible(Element element, bool visible);
+
+	// queues the visible elements; the caller flushes the renderer's text
+	void render(Renderer &renderer, const float *pvm);
+
+private:
+	struct Item
+	{
+		TextCommand text;
+		std::vector<float> vertices; // glyph quads, from Renderer::layoutText
+		int value = 0;
+		bool hasValue = false;
+		bool visible = true;
+		bool dirty = true;
+	};
+
+	std::vector<Item> items;
+	std::vector<float> vertices; // of all the visible items, in order
+	bool dirty = true;
+
+	void changed(Item &item);
+};
@@ -83,6 +83,7 @@ public:
     Light& createObject(Renderer &renderer, std::vector<SceneObject*>& scene) {
         if (type == LightType::POINTLIGHT) {
             MyMesh sphere = createSphere(0.1f, 20);
+            sphere.lods = {createSphere(0.1f, 10), createSphere(0.1f, 6)};
             for (int i = 0; i < 4; i++) {
                 sphere.mat.ambient[i] = 0.f;
                 sphere.mat.diffuse[i] = 0.f;
@@ -97,6 +98,7 @@ public:
 
         if (type == LightType::SPOTLIGHT) {
             MyMesh cone = createCone(0.2f, 0.1f, 20);
+            cone.lods = {createCone(0.2f, 0.1f, 10), createCone(0.2f, 0.1f, 6)};
             for (int i = 0; i < 4; i++) {
                 cone.mat.ambient[i] = 0.f;
                 cone.mat.diffuse[i] = 0.f;
@@ -117,13 +119,12 @@ public:
         return *this;
     }
 
-    void setup(Renderer &renderer, gmu &mu)
+    // hands the light to the renderer in world space; Renderer::setLightView moves all of them to view space at once
+    void setup(Renderer &renderer)
     {
         if (!active || debug) return;
 
         float pos[4], dir[4];
-        float localPosition[4];
-        float localDirection[4];
         for (int i = 0; i < 4; i++) {
             pos[i] = position[i];
             dir[i] = direction[i];
@@ -139,31 +140,22 @@ public:
 
         if (type == LightType::DIRECTIONAL)
         {
-            mu.multMatrixPoint(gmu::VIEW, dir, localDirection);
-            renderer.setDirectionalLight(color, ambient, diffuse, localDirection);
+            renderer.setDirectionalLight(color, ambient, diffuse, dir);
         }
         if (type == LightType::POINTLIGHT)
         {
-            mu.multMatrixPoint(gmu::VIEW, pos, localPosition);
-            renderer.setPointLight(color, ambient, diffuse, localPosition,
+            renderer.setPointLight(color, ambient, diffuse, pos,
                                    attConstant, attLinear, attExp);
         }
         else if (type == LightType::SPOTLIGHT)
         {
-            mu.multMatrixPoint(gmu::VIEW, pos, localPosition);
-            mu.multMatrixPoint(gmu::VIEW, dir, localDirection);
-            renderer.setSpotLight(color, ambient, diffuse, localDirection, cutoff, localPosition,
+            renderer.setSpotLight(color, ambient, diffuse, dir, cutoff, pos,
                                   attConstant, attLinear, attExp);
         }
     }
 
     SceneObject* getObject() { return object; }
 
-    void invertY() {
-        position[1] = -1 * position[1];
-        direction[1] = -1 * direction[1];
-    }
-
     Light& setDebug() { debug = !debug; return *this; }
     bool isDebug() { return debug; }
     bool isType(LightType t) { return (type == t) && !debug ; }
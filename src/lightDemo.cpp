@@ -23,6 +23,7 @@
 #include <array>
 #include <random>
 #include <iomanip>
+#include <map>
 
 // include GLEW to access OpenGL 3.3 functions
 #include <GL/glew.h>
@@ -36,6 +37,7 @@
 #include "shader.h"
 #include "mathUtility.h"
 #include "model.h"
+#include "geometryPool.h"
 #include "texture.h"
 #include "sceneObject.h"
 #include "light.h"
@@ -44,6 +46,8 @@
 #include "package.h"
 #include "camera.h"
 #include "collision.h"
+#include "softwareOcclusion.h"
+#include "hud.h"
 #include "flare.h"
 #include "particle.cpp"
 
@@ -102,6 +106,8 @@ struct
 	const char *Font_Frag = SHADER_FOLDER "ttf.frag";
 	const char *Post_Vert = SHADER_FOLDER "skybox.vert";
 	const char *Post_Frag = SHADER_FOLDER "skybox.frag";
+	const char *Shadow_Vert = SHADER_FOLDER "shadow.vert";
+	const char *Shadow_Frag = SHADER_FOLDER "shadow.frag";
 } FILEPATH;
 
 struct
@@ -125,8 +131,15 @@ struct
 	bool showDebug = false;
 	bool showKeybinds = false;
 	bool fireworksOn = false;
+	bool planarShadows = false; // the old stencil shadows flattened on the floor instead of the shadow maps
+	int reflectionScale = 2;	// floor reflection at 1/scale of the window resolution, 0 for none
+	int mirrorScale = 1;		// rear view mirror at 1/scale of its size on screen
+	int mirrorInterval = 2;		// the rear view is redrawn every mirrorInterval frames
+	bool impostors = true;
+	float impostorDistance = 120.f; // billboard clusters farther than this draw their impostor card
 	unsigned int cubemap_dayID = 0;
 	unsigned int cubemap_nightID = 0;
+	unsigned int texArrayIDs[(int)TexArray::Count] = {}; // texture objects of the mesh texture arrays
 	bool paused = false;
 } GLOBAL;
 
@@ -139,9 +152,17 @@ std::vector<Light> sceneLights;
 std::vector<SceneObject *> sceneObjects;
 std::vector<SceneObject *> transparentObjects;
 CollisionSystem collisionSystem;
+SoftwareOcclusion softwareOcclusion;
 Package *package = nullptr;
 SceneObject *destination = nullptr;
 std::vector<SceneObject *> billboardObjects;
+// the billboards by cell of a grid; each cluster has an impostor card, its billboards baked together (bakeImpostors)
+struct BillboardCluster
+{
+	std::vector<SceneObject *> billboards;
+	SceneObject *card = nullptr;
+};
+std::vector<BillboardCluster> billboardClusters;
 std::vector<Particle *> particle_vector;
 // Store building quadrants for package delivery
 std::vector<std::vector<SceneObject *>> cityQuadrants;
@@ -154,13 +175,91 @@ FLARE_DEF lensFlare;
 GLuint FlareTextureArray[5];
 float lightPos[4] = {1000.0f, 1000.0f, 0.0f, 1.0f}; // position of point light in World coordinates
 int flareQuadID;
-int offsetId = 0;
 
 Camera *cams[3];
 int activeCam = 0;
 SceneObject *stencilQuad = nullptr;
 int stencilQuadID = -1;
 
+// the screen text, created once by buildHud; updateHud only changes what the game state changed
+Hud hud;
+struct
+{
+	Hud::Element battery, score, paused, gameOver, gameOverReset, showKeybinds;
+	std::vector<Hud::Element> keybinds; // one line per key, shown with 'i'
+} HUD;
+const int KEYBIND_LINES = 15, MIRROR_KEYBIND = 6; // the mirror line has a number in it
+
+// HUD elements, their text set by updateHud
+void buildHud(void)
+{
+	float size = 0.3f, Yoff = 80.f;
+	float white[4] = {.9f, 0.9f, 0.9f, 1.f}, yellow[4] = {0.9f, 0.9f, 0.0f, 1.0f}, cyan[4] = {0.0f, 0.9f, 0.9f, 1.0f}, red[4] = {0.9f, 0.1f, 0.1f, 1.0f};
+	HUD.battery = hud.add(720.f, 0.f, size, yellow);
+	HUD.score = hud.add(720.f, Yoff, size, cyan); // below battery
+	HUD.paused = hud.add(0.f, 0.f, 1.f, red);
+	hud.setText(HUD.paused, "PAUSED");
+	HUD.gameOver = hud.add(0.f, 0.f, 1.f, red);
+	hud.setText(HUD.gameOver, "Game Over! No battery!");
+	HUD.gameOverReset = hud.add(0.f, 0.f, 0.5f, red);
+	hud.setText(HUD.gameOverReset, "Click 'R' to reset.");
+	HUD.showKeybinds = hud.add(0.f, 0.f, size, white);
+	hud.setText(HUD.showKeybinds, "Press 'i' to show keybinds");
+	for (int i = 0; i < KEYBIND_LINES; i++)
+		HUD.keybinds.push_back(hud.add(0.f, i * Yoff, size, white));
+}
+
+void updateHud(void)
+{
+	hud.setNumber(HUD.battery, "Battery: %d%%", (int)drone->getBatteryLevel());
+	hud.setNumber(HUD.score, "Score: %d", (int)drone->getScore());
+
+	hud.setVisible(HUD.paused, GLOBAL.paused);
+	hud.setPosition(HUD.paused, GLOBAL.WinX / 2.0f - 140.f, GLOBAL.WinY / 2.0f);
+	bool gameOver = !GLOBAL.paused && drone->isDisabled();
+	hud.setVisible(HUD.gameOver, gameOver);
+	hud.setPosition(HUD.gameOver, GLOBAL.WinX / 2.0f - 360.f, GLOBAL.WinY / 2.0f);
+	hud.setVisible(HUD.gameOverReset, gameOver);
+	hud.setPosition(HUD.gameOverReset, GLOBAL.WinX / 2.0f - 100.f, GLOBAL.WinY / 2.0f);
+
+	hud.setVisible(HUD.showKeybinds, !GLOBAL.showKeybinds);
+	static const char *reflectionKeybinds[] = {
+		"Press 'l' for reflection resolution (off)",
+		"Press 'l' for reflection resolution (full)",
+		"Press 'l' for reflection resolution (half)",
+		"",
+		"Press 'l' for reflection resolution (quarter)"};
+	static const char *mirrorKeybinds[] = {
+		"",
+		"Press 'u' for mirror resolution (full)",
+		"Press 'u' for mirror resolution (half)",
+		"",
+		"Press 'u' for mirror resolution (quarter)"};
+	const char *keybinds[KEYBIND_LINES] = {
+		"Press 'i' to hide keybinds",
+		GLOBAL.showFog ? "Press 'f' to hide fog" : "Press 'f' to show fog",
+		GLOBAL.showDebug ? "Press 'k' to hide debug" : "Press 'k' to show debug",
+		GLOBAL.daytime ? "Press 'n' to hide directional lights" : "Press 'n' to show directional lights",
+		GLOBAL.planarShadows ? "Press 'm' to use shadow maps" : "Press 'm' to use planar shadows",
+		reflectionKeybinds[GLOBAL.reflectionScale],
+		nullptr, // MIRROR_KEYBIND
+		mirrorKeybinds[GLOBAL.mirrorScale],
+		renderer.depthPrepass ? "Press 'z' to disable the depth pre-pass" : "Press 'z' to enable the depth pre-pass",
+		renderer.occlusionCulling ? "Press 'o' to disable occlusion culling" : "Press 'o' to enable occlusion culling",
+		softwareOcclusion.enabled ? "Press 'x' to disable software occlusion" : "Press 'x' to enable software occlusion",
+		renderer.levelOfDetail ? "Press 'g' to disable level of detail" : "Press 'g' to enable level of detail",
+		GLOBAL.impostors ? "Press 'b' to disable billboard impostors" : "Press 'b' to enable billboard impostors",
+		GLOBAL.showPointlights ? "Press 'c' to hide pointlights" : "Press 'c' to show pointlights",
+		GLOBAL.showSpotlights ? "Press 'h' to hide spotlights" : "Press 'h' to show spotlights"};
+	for (int i = 0; i < KEYBIND_LINES; i++)
+	{
+		hud.setVisible(HUD.keybinds[i], GLOBAL.showKeybinds);
+		if (keybinds[i])
+			hud.setText(HUD.keybinds[i], keybinds[i]);
+	}
+	hud.setNumber(HUD.keybinds[MIRROR_KEYBIND], "Press 'v' for mirror update rate (every %d frames)", GLOBAL.mirrorInterval);
+}
+
 /// ::::::::::::::::::::::: CALLBACK FUNCTIONS ::::::::::::::::::::::: ///
 
 void timer(int value)
@@ -169,6 +268,50 @@ void timer(int value)
 
 	std::ostringstream oss;
 	oss << GLOBAL.WinTitle << ": " << GLOBAL.FrameCount << " FPS @ (" << GLOBAL.WinX << "x" << GLOBAL.WinY << ")";
+	if (GLOBAL.FrameCount > 0)
+	{
+		// per frame averages of the GL work issued by the renderer, sorted/unsorted
+		RenderStats total = renderer.getTotalStats();
+		oss << " | " << total.draws / GLOBAL.FrameCount << " draws for " << total.instances / GLOBAL.FrameCount << " meshes, "
+			<< total.programBinds / GLOBAL.FrameCount << "/" << total.unsortedProgramBinds / GLOBAL.FrameCount << " programs, "
+			<< total.vaoBinds / GLOBAL.FrameCount << "/" << total.unsortedVaoBinds / GLOBAL.FrameCount << " VAOs, "
+			<< total.textureBinds / GLOBAL.FrameCount << "/" << total.unsortedTextureBinds / GLOBAL.FrameCount << " textures, "
+			<< total.uniformUploads / GLOBAL.FrameCount << "/" << total.unsortedUniformUploads / GLOBAL.FrameCount << " uniforms";
+
+		if (GLOBAL.showDebug)
+		{
+			printf("lights: %u UBO uploads, %u bytes per frame (%u glUniform calls per frame with per field setup), "
+				   "%u cluster binnings with %u light indices per frame\n",
+				   total.lightUploads / GLOBAL.FrameCount, total.lightBytes / GLOBAL.FrameCount,
+				   total.unsortedLightUniforms / GLOBAL.FrameCount,
+				   total.lightBins / GLOBAL.FrameCount, total.lightIndices / GLOBAL.FrameCount);
+			printf("shadows: %u casters culled, %u of %u spot shadow tiles redrawn per frame\n",
+				   total.culled / GLOBAL.FrameCount, total.spotTilesDrawn / GLOBAL.FrameCount, total.spotTiles / GLOBAL.FrameCount);
+			printf("depth pre-pass: %s, %u depth only draws per frame\n",
+				   renderer.depthPrepass ? "on" : "off", total.prepassDraws / GLOBAL.FrameCount);
+			printf("occlusion: %u queries, %u objects skipped per frame\n",
+				   total.occlusionQueries / GLOBAL.FrameCount, total.occluded / GLOBAL.FrameCount);
+			const SoftwareOcclusion::Stats &so = softwareOcclusion.stats;
+			printf("software occlusion: %s, %u objects tested, %u outside the frustum, %u occluded, %u occluder triangles per frame\n",
+				   softwareOcclusion.enabled ? "on" : "off", so.tested / GLOBAL.FrameCount, so.outsideFrustum / GLOBAL.FrameCount,
+				   so.occluded / GLOBAL.FrameCount, so.occluderTriangles / GLOBAL.FrameCount);
+			printf("level of detail: %s, %u meshes drawn coarser per frame\n",
+				   renderer.levelOfDetail ? "on" : "off", total.lodReduced / GLOBAL.FrameCount);
+			printf("%-13s %6s %8s %12s %12s %12s %12s\n", "pass", "draws", "meshes", "programs", "VAOs", "textures", "uniforms");
+			for (int i = 0; i < (int)RenderPass::Count; i++)
+			{
+				const RenderStats &st = renderer.passStats[i];
+				printf("%-13s %6d %8d %5d/%-6d %5d/%-6d %5d/%-6d %5d/%-6d\n", renderPassNames[i],
+					   st.draws / GLOBAL.FrameCount, st.instances / GLOBAL.FrameCount,
+					   st.programBinds / GLOBAL.FrameCount, st.unsortedProgramBinds / GLOBAL.FrameCount,
+					   st.vaoBinds / GLOBAL.FrameCount, st.unsortedVaoBinds / GLOBAL.FrameCount,
+					   st.textureBinds / GLOBAL.FrameCount, st.unsortedTextureBinds / GLOBAL.FrameCount,
+					   st.uniformUploads / GLOBAL.FrameCount, st.unsortedUniformUploads / GLOBAL.FrameCount);
+			}
+		}
+	}
+	renderer.resetStats();
+	softwareOcclusion.stats = {};
 	std::string s = oss.str();
 
 	glutSetWindow(GLOBAL.WindowHandle);
@@ -199,15 +342,15 @@ void gameloop(void)
 
 	if (GLOBAL.fireworksOn)
 	{
-		glEnable(GL_BLEND);
+		renderer.setBlend(true);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		glDisable(GL_CULL_FACE);
-		glDepthMask(GL_FALSE);
+		renderer.setCullFace(false);
+		renderer.setDepthWrite(false);
 		for (auto &particle : particle_vector)
 			particle->update(deltaTime);
-		glDepthMask(GL_TRUE);
-		glEnable(GL_CULL_FACE);
-		glDisable(GL_BLEND);
+		renderer.setDepthWrite(true);
+		renderer.setCullFace(true);
+		renderer.setBlend(false);
 	}
 
 	glutPostRedisplay();
@@ -292,25 +435,57 @@ void reset_particles(void)
 // Render stufff
 //
 
-void drawObjects(void)
+// billboards seen from the camera at (camX, camZ), which the vertex shader turns them to; a cluster farther than
+// GLOBAL.impostorDistance draws its card instead, which planar shadows (renderShadow) skip
+template <typename Culled>
+void drawBillboards(float camX, float camZ, Culled culled)
 {
-	for (auto &obj : sceneObjects)
-		obj->render(renderer, mu);
-
-	for (auto &obj : billboardObjects)
+	for (BillboardCluster &cluster : billboardClusters)
 	{
-		float dirX = cams[activeCam]->getX() - obj->pos[0];
-		float dirZ = cams[activeCam]->getZ() - obj->pos[2];
-		float yaw = atan2(dirX, dirZ) * (180.0f / PI_F) + 180.f;
-		obj->setRotation(yaw, 0.f, 0.f);
-		obj->render(renderer, mu);
+		SceneObject *card = cluster.card;
+		float dx = camX - card->pos[0], dz = camZ - card->pos[2];
+		if (GLOBAL.impostors && dx * dx + dz * dz > GLOBAL.impostorDistance * GLOBAL.impostorDistance)
+		{
+			if (!renderer.renderShadow() && !culled(card))
+				card->render(renderer, mu);
+			continue;
+		}
+		for (SceneObject *obj : cluster.billboards)
+			if (!culled(obj))
+				obj->render(renderer, mu);
 	}
+}
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+// mainView: the main camera's pass, where objects are first culled on the CPU (view frustum and software
+// occlusion), and the occlusion groups are tested once the opaque meshes are in the depth buffer
+void drawObjects(bool mainView = false)
+{
+	if (mainView)
+		softwareOcclusion.render(mu.get(gmu::VIEW), mu.get(gmu::PROJECTION));
+	auto culled = [&](SceneObject *obj)
+	{
+		if (!mainView || !softwareOcclusion.enabled)
+			return false;
+		float center[3], radius;
+		obj->getBoundingSphere(renderer, center, radius);
+		return softwareOcclusion.test(center, radius) != SoftwareOcclusion::Visible;
+	};
+
+	for (auto &obj : sceneObjects)
+		if (!culled(obj))
+			obj->render(renderer, mu);
+
+	drawBillboards(cams[activeCam]->getX(), cams[activeCam]->getZ(), culled);
+
+	if (mainView)
+		renderer.testOcclusionGroups(mu.get(gmu::VIEW), mu.get(gmu::PROJECTION));
+
+	// transparent objects are flagged as blended: the flush draws them last, in submission order
 	for (auto obj : transparentObjects)
-		obj->render(renderer, mu);
-	glDisable(GL_BLEND);
+		if (!culled(obj))
+			obj->render(renderer, mu);
+
+	renderer.flush();
 }
 
 void renderFlare(FLARE_DEF *flare, int lx, int ly, int *m_viewport, int flareQuadID)
@@ -319,9 +494,9 @@ void renderFlare(FLARE_DEF *flare, int lx, int ly, int *m_viewport, int flareQua
 	float maxflaredist, flaredist, flaremaxsize, flarescale, scaleDistance;
 	int width, height;
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
-	glEnable(GL_BLEND);
+	renderer.setDepthTest(false);
+	renderer.setCullFace(false);
+	renderer.setBlend(true);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
 
 	int screenMaxCoordX = m_viewport[0] + m_viewport[2] - 1;
@@ -369,211 +544,303 @@ void renderFlare(FLARE_DEF *flare, int lx, int ly, int *m_viewport, int flareQua
 			mu.scale(gmu::MODEL, (float)width, (float)height, 1.0f);
 
 			// Create and render flare quad
-			SceneObject flareObj({flareQuadID}, flare->element[i].textureId + offsetId);
+			SceneObject flareObj({flareQuadID}, TexMode::TEXTURE_FLARE);
+			flareObj.texLayer = LAYER_CRCL + flare->element[i].textureId;
 			flareObj.setPosition(0, 0, 0); // Position is handled by MODEL matrix
 			flareObj.setScale(1, 1, 1);	   // Scale is handled by MODEL matrix
+			memcpy(flareObj.tint, diffuse, sizeof(diffuse));
 			flareObj.render(renderer, mu);
 
 			mu.popMatrix(gmu::MODEL);
 		}
 	}
+	renderer.flush();
 
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
-	glDisable(GL_BLEND);
+	renderer.setDepthTest(true);
+	renderer.setCullFace(true);
+	renderer.setBlend(false);
 }
 
-void renderSim(void)
+// projection of the active camera, into the mu PROJECTION matrix
+void loadCameraProjection(void)
 {
-	GLOBAL.FrameCount++;
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	mu.loadIdentity(gmu::PROJECTION);
 
-	// ===== STEP 1: CREATE STENCIL MASK =====
-	if (stencilQuad && activeCam == 2)
+	if (cams[activeCam]->getProjectionType() == ProjectionType::Orthographic)
 	{
-		mu.pushMatrix(gmu::PROJECTION);
-		mu.loadIdentity(gmu::PROJECTION);
+		mu.ortho(-30.0f, 30.0f, -30.0f, 30.0f, -100.0f, 100.0f);
+	}
+	else
+	{
+		float ratio = (1.0f * GLOBAL.WinX) / GLOBAL.WinY;
+		mu.perspective(53.13f, ratio, 0.1f, 800.0f);
+	}
+}
 
-		// Pixel-perfect ortho
-		mu.ortho(0.0f, (float)GLOBAL.WinX, 0.0f, (float)GLOBAL.WinY, -10.0f, 10.0f);
+// depth of the opaque scene objects seen from the lights: the sun cascades fit to the main camera, then
+// the spot lights' tiles of the shadow atlas. Billboards and transparent objects do not cast
+void renderShadowMaps(void)
+{
+	mu.loadIdentity(gmu::VIEW);
+	mu.loadIdentity(gmu::MODEL);
+	mu.lookAt(cams[activeCam]->getX(), cams[activeCam]->getY(), cams[activeCam]->getZ(),
+			  cams[activeCam]->getTargetX(), cams[activeCam]->getTargetY(), cams[activeCam]->getTargetZ(),
+			  cams[activeCam]->getUpX(), cams[activeCam]->getUpY(), cams[activeCam]->getUpZ());
+	loadCameraProjection();
 
-		mu.loadIdentity(gmu::VIEW);
-		mu.loadIdentity(gmu::MODEL);
+	// beyond 150 units the fog hides the shadows anyway
+	bool sun = false;
+	if (GLOBAL.planarShadows)
+		renderer.disableSunShadows();
+	else
+		sun = renderer.fitShadowCascades(mu.get(gmu::VIEW), mu.get(gmu::PROJECTION), 150.f);
+	int spots = renderer.allocateSpotShadows(mu.get(gmu::VIEW), mu.get(gmu::PROJECTION));
 
-		glStencilFunc(GL_NEVER, 0x2, 0x3);
-		glStencilOp(GL_REPLACE, GL_KEEP, GL_KEEP);
-		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-		glDepthMask(GL_FALSE);
+	renderer.beginShadowMaps();
+	if (sun)
+	{
+		renderer.beginPass(RenderPass::ShadowMap);
+		for (int c = 0; c < SHADOW_CASCADES; c++)
+		{
+			renderer.beginShadowCascade(c);
+			mu.loadMatrix(gmu::VIEW, renderer.getShadowView());
+			mu.loadMatrix(gmu::PROJECTION, renderer.getShadowProjection(c));
+			for (auto &obj : sceneObjects)
+				obj->render(renderer, mu);
+			renderer.flush();
+		}
+	}
 
-		renderer.activateRenderMeshesShaderProg();
-		stencilQuad->render(renderer, mu);
+	// the casters are submitted every frame; a tile whose casters did not move keeps its depth
+	renderer.beginPass(RenderPass::SpotShadow);
+	for (int i = 0; i < spots; i++)
+	{
+		renderer.beginSpotShadow(i);
+		mu.loadMatrix(gmu::VIEW, renderer.getSpotShadowView(i));
+		mu.loadMatrix(gmu::PROJECTION, renderer.getSpotShadowProjection(i));
+		for (auto &obj : sceneObjects)
+			obj->render(renderer, mu);
+		renderer.endSpotShadow();
+	}
+	renderer.endShadowMaps();
+}
 
-		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-		glDepthMask(GL_TRUE);
+// the scene mirrored in the floor plane, into the renderer's reflection target. Expects the main camera's
+// VIEW and PROJECTION loaded
+void renderReflection(float *fogColor)
+{
+	mu.pushMatrix(gmu::PROJECTION);
+	// what is under the floor would come out above it: the near plane becomes the floor (keeping y <= 0)
+	float floorPlane[4] = {0.f, -1.f, 0.f, 0.f};
+	Renderer::clipProjectionToPlane(mu.get(gmu::PROJECTION), mu.get(gmu::VIEW), floorPlane);
 
-		mu.popMatrix(gmu::PROJECTION);
-	}
+	renderer.beginReflection(GLOBAL.reflectionScale);
+	renderer.beginPass(RenderPass::Reflection);
+	renderer.invert = true;
+	renderer.setLightView(mu.get(gmu::VIEW), true);
 
-	// ===== STEP 2: RENDER REAR VIEW (where stencil == 1) =====
-	if (stencilQuad && activeCam == 2)
-	{
-		glStencilFunc(GL_EQUAL, 0x2, 0x3);
-		glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+	// mirroring flips the winding
+	glCullFace(GL_FRONT);
 
-		// Convert quad position/scale from pixels to viewport
-		int vpX = (int)(stencilQuad->pos[0] - stencilQuad->scale[0] / 2.0f);
-		int vpY = (int)(stencilQuad->pos[1] - stencilQuad->scale[1] / 2.0f);
-		int vpWidth = (int)stencilQuad->scale[0];
-		int vpHeight = (int)stencilQuad->scale[1];
+	// culled against the clipped frustum, and small meshes (e.g. grass billboards) skipped
+	drawObjects();
+	renderer.flush();
 
-		glViewport(vpX, vpY, vpWidth, vpHeight);
+	// the sky last, where the reflected scene left the far depth
+	mu.pushMatrix(gmu::MODEL);
+	mu.scale(gmu::MODEL, 1.f, -1.f, 1.f);
+	mu.translate(gmu::MODEL, cams[activeCam]->getX(), -cams[activeCam]->getY(), cams[activeCam]->getZ());
+	mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
+	renderer.drawSkybox(mu.get(gmu::PROJ_VIEW_MODEL), fogColor);
+	mu.popMatrix(gmu::MODEL);
+	renderer.activateRenderMeshesShaderProg();
+	glCullFace(GL_BACK);
 
-		// Setup rear-view camera (better third-person behind-drone camera)
-		mu.loadIdentity(gmu::VIEW);
-		mu.loadIdentity(gmu::MODEL);
+	renderer.invert = false;
+	renderer.endReflection();
+	mu.popMatrix(gmu::PROJECTION);
+}
 
-		// convert yaw and build forward vector
-		float yawRad = drone->yaw * PI_F / 180.0f + PI_F;
-		float fx = sinf(yawRad);
-		float fz = cosf(yawRad);
+// the mirror quad in window coordinates, showing the last rear view
+void renderMirrorQuad(void)
+{
+	mu.pushMatrix(gmu::PROJECTION);
+	mu.loadIdentity(gmu::PROJECTION);
+	mu.ortho(0.0f, (float)GLOBAL.WinX, 0.0f, (float)GLOBAL.WinY, -10.0f, 10.0f);
+	mu.pushMatrix(gmu::VIEW);
+	mu.loadIdentity(gmu::VIEW);
+	mu.loadIdentity(gmu::MODEL);
 
-		// choose sensible distances for a mirror view
-		float distanceBehind = 8.0f; // camera sits 8 units behind drone
-		float lookBehind = 12.0f;	 // how far the camera looks behind the drone
-		float heightOffset = 0.0f;	 // lift camera above drone
+	renderer.beginPass(RenderPass::Overlay);
+	renderer.activateRenderMeshesShaderProg();
+	stencilQuad->render(renderer, mu);
+	renderer.flush();
 
-		// camera position: behind and up
-		float camX = drone->pos[0] - fx * distanceBehind;
-		float camY = drone->pos[1] + heightOffset;
-		float camZ = drone->pos[2] - fz * distanceBehind;
+	mu.popMatrix(gmu::VIEW);
+	mu.popMatrix(gmu::PROJECTION);
+}
 
-		// camera target: a point behind the drone (so mirror looks backward)
-		float targetX = drone->pos[0] - fx * (distanceBehind + lookBehind);
-		float targetY = drone->pos[1];
-		float targetZ = drone->pos[2] - fz * (distanceBehind + lookBehind);
+// the view behind the drone, into the renderer's mirror target. Culled with a coarser size threshold than the
+// main view (Renderer::minProjectedSize), as the mirror is small
+void renderRearView(void)
+{
+	// the floor reflection is rendered for the main camera only
+	renderer.disableReflection();
 
-		mu.lookAt(camX, camY, camZ, targetX, targetY, targetZ, 0.0f, 1.0f, 0.0f);
+	// the mirror's own target, at 1/mirrorScale of its size on screen
+	int vpWidth = (int)stencilQuad->scale[0] / GLOBAL.mirrorScale;
+	int vpHeight = (int)stencilQuad->scale[1] / GLOBAL.mirrorScale;
+	renderer.beginMirror(vpWidth, vpHeight);
+	renderer.beginPass(RenderPass::RearView);
 
-		// perspective — use small near plane and moderate far plane
-		mu.loadIdentity(gmu::PROJECTION);
-		float ratio = (float)vpWidth / (float)vpHeight;
-		mu.perspective(53.13f, ratio, 0.1f, 1000.0f);
+	// Setup rear-view camera (better third-person behind-drone camera)
+	mu.loadIdentity(gmu::VIEW);
+	mu.loadIdentity(gmu::MODEL);
 
-		// Set fog for rear-view
-		float fogColor[] = {0.f, 0.f, 0.f, 0.f};
-		if (GLOBAL.showFog)
-		{
-			float lightgray[] = {.75f, 0.85f, 0.75f, 1.f};
-			float darkgray[] = {0.15f, 0.15f, 0.15f, 1.f};
-			if (GLOBAL.daytime)
-			{
-				for (int i = 0; i < 4; i++)
-					fogColor[i] = lightgray[i];
-			}
-			else
-			{
-				for (int i = 0; i < 4; i++)
-					fogColor[i] = darkgray[i];
-			}
-		}
-		renderer.setFogColor(fogColor);
+	// convert yaw and build forward vector
+	float yawRad = drone->yaw * PI_F / 180.0f + PI_F;
+	float fx = sinf(yawRad);
+	float fz = cosf(yawRad);
 
-		// Render scene in rear-view mirror
-		renderer.activateRenderMeshesShaderProg();
-		renderer.resetLights();
+	// choose sensible distances for a mirror view
+	float distanceBehind = 8.0f; // camera sits 8 units behind drone
+	float lookBehind = 12.0f;	 // how far the camera looks behind the drone
+	float heightOffset = 0.0f;	 // lift camera above drone
 
-		// Setup lights
-		for (auto &light : sceneLights)
-			light.setup(renderer, mu);
+	// camera position: behind and up
+	float camX = drone->pos[0] - fx * distanceBehind;
+	float camY = drone->pos[1] + heightOffset;
+	float camZ = drone->pos[2] - fz * distanceBehind;
 
-		// Render opaque objects
-		for (auto &obj : sceneObjects)
-			obj->render(renderer, mu);
+	// camera target: a point behind the drone (so mirror looks backward)
+	float targetX = drone->pos[0] - fx * (distanceBehind + lookBehind);
+	float targetY = drone->pos[1];
+	float targetZ = drone->pos[2] - fz * (distanceBehind + lookBehind);
 
-		// Render billboard objects (grass, trees) oriented to rear camera
-		for (auto &obj : billboardObjects)
-		{
-			float dirX = camX - obj->pos[0];
-			float dirZ = camZ - obj->pos[2];
-			float yaw = atan2(dirX, dirZ) * (180.0f / PI_F) + 180.f;
-			obj->setRotation(yaw, 0.f, 0.f);
-			obj->render(renderer, mu);
-		}
+	mu.lookAt(camX, camY, camZ, targetX, targetY, targetZ, 0.0f, 1.0f, 0.0f);
 
-		floorObject->render(renderer, mu);
+	// perspective — use small near plane and moderate far plane
+	mu.loadIdentity(gmu::PROJECTION);
+	float ratio = (float)vpWidth / (float)vpHeight;
+	mu.perspective(53.13f, ratio, 0.1f, 1000.0f);
 
-		// Render skybox centered on rear camera
-		mu.pushMatrix(gmu::MODEL);
-		mu.translate(gmu::MODEL, camX, camY, camZ);
-		mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
-		float *m_VP = mu.get(gmu::PROJ_VIEW_MODEL);
+	// Set fog for rear-view
+	float fogColor[] = {0.f, 0.f, 0.f, 0.f};
+	if (GLOBAL.showFog)
+	{
+		float lightgray[] = {.75f, 0.85f, 0.75f, 1.f};
+		float darkgray[] = {0.15f, 0.15f, 0.15f, 1.f};
 		if (GLOBAL.daytime)
 		{
-			unsigned int id = renderer.TexObjArray.getTextureId(GLOBAL.cubemap_dayID);
-			renderer.activateSkyboxShaderProg(m_VP, id, fogColor);
+			for (int i = 0; i < 4; i++)
+				fogColor[i] = lightgray[i];
 		}
 		else
 		{
-			unsigned int id = renderer.TexObjArray.getTextureId(GLOBAL.cubemap_nightID);
-			renderer.activateSkyboxShaderProg(m_VP, id, fogColor);
+			for (int i = 0; i < 4; i++)
+				fogColor[i] = darkgray[i];
 		}
-		mu.popMatrix(gmu::MODEL);
+	}
+	renderer.setFogColor(fogColor);
 
-		// Re-activate mesh shader for transparent objects
-		renderer.activateRenderMeshesShaderProg();
+	// Render scene in rear-view mirror
+	renderer.activateRenderMeshesShaderProg();
+	renderer.setLightView(mu.get(gmu::VIEW));
 
-		// Render transparent objects (windows) - sorted from rear camera position
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	// Render opaque objects
+	for (auto &obj : sceneObjects)
+		obj->render(renderer, mu);
 
-		auto rearCmp = [&](SceneObject *a, SceneObject *b)
-		{
-			float lenA_X = (a->pos[0] - camX);
-			float lenA_Y = (a->pos[1] - camY);
-			float lenA_Z = (a->pos[2] - camZ);
-			float lenA = (lenA_X * lenA_X) + (lenA_Y * lenA_Y) + (lenA_Z * lenA_Z);
-
-			float lenB_X = (b->pos[0] - camX);
-			float lenB_Y = (b->pos[1] - camY);
-			float lenB_Z = (b->pos[2] - camZ);
-			float lenB = (lenB_X * lenB_X) + (lenB_Y * lenB_Y) + (lenB_Z * lenB_Z);
-
-			return (lenA > lenB);
-		};
-
-		std::vector<SceneObject *> rearTransparentObjects = transparentObjects; // Copy to avoid modifying main list
-		std::sort(rearTransparentObjects.begin(), rearTransparentObjects.end(), rearCmp);
-		for (auto obj : rearTransparentObjects)
-			obj->render(renderer, mu);
+	// Render billboard objects (grass, trees) oriented to rear camera
+	drawBillboards(camX, camZ, [](SceneObject *)
+				   { return false; });
+
+	floorObject->render(renderer, mu);
+	renderer.flush();
+
+	// Render skybox centered on rear camera, after the opaque objects: only where they left the far depth
+	mu.pushMatrix(gmu::MODEL);
+	mu.translate(gmu::MODEL, camX, camY, camZ);
+	mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
+	renderer.drawSkybox(mu.get(gmu::PROJ_VIEW_MODEL), fogColor);
+	mu.popMatrix(gmu::MODEL);
+
+	// Re-activate mesh shader for transparent objects
+	renderer.activateRenderMeshesShaderProg();
+
+	// Render transparent objects (windows) - sorted from rear camera position
+	renderer.setBlend(true);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	auto rearCmp = [&](SceneObject *a, SceneObject *b)
+	{
+		float lenA_X = (a->pos[0] - camX);
+		float lenA_Y = (a->pos[1] - camY);
+		float lenA_Z = (a->pos[2] - camZ);
+		float lenA = (lenA_X * lenA_X) + (lenA_Y * lenA_Y) + (lenA_Z * lenA_Z);
+
+		float lenB_X = (b->pos[0] - camX);
+		float lenB_Y = (b->pos[1] - camY);
+		float lenB_Z = (b->pos[2] - camZ);
+		float lenB = (lenB_X * lenB_X) + (lenB_Y * lenB_Y) + (lenB_Z * lenB_Z);
+
+		return (lenA > lenB);
+	};
+
+	std::vector<SceneObject *> rearTransparentObjects = transparentObjects; // Copy to avoid modifying main list
+	std::sort(rearTransparentObjects.begin(), rearTransparentObjects.end(), rearCmp);
+	for (auto obj : rearTransparentObjects)
+		obj->render(renderer, mu);
+	renderer.flush();
+
+	renderer.setBlend(false);
+
+	renderer.endMirror();
+}
+
+void renderSim(void)
+{
+	GLOBAL.FrameCount++;
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+	// collect the lights once, in world space; each view below transforms them with setLightView
+	renderer.resetLights();
+	for (auto &light : sceneLights)
+		light.setup(renderer);
+	// the sky of the time of day, for the skyboxes and the env mapped meshes of all the views
+	renderer.setSkybox(renderer.TexObjArray.getTextureId(GLOBAL.daytime ? GLOBAL.cubemap_dayID : GLOBAL.cubemap_nightID));
 
-		glDisable(GL_BLEND);
+	// ===== STEP 0: SHADOW MAPS =====
+	renderShadowMaps();
 
-		// Restore full viewport for main rendering
-		glViewport(0, 0, GLOBAL.WinX, GLOBAL.WinY);
+	// ===== STEP 1: STENCIL MASK, the main view skips the pixels under the mirror =====
+	if (stencilQuad && activeCam == 2)
+	{
+		glStencilFunc(GL_NEVER, 0x2, 0x3);
+		glStencilOp(GL_REPLACE, GL_KEEP, GL_KEEP);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		renderer.setDepthWrite(false);
+		renderMirrorQuad();
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		renderer.setDepthWrite(true);
 	}
 
+	// ===== STEP 2: REAR VIEW, off screen, every GLOBAL.mirrorInterval frames =====
+	static unsigned int mirrorFrame = 0;
+	if (stencilQuad && activeCam == 2 && (mirrorFrame++ % GLOBAL.mirrorInterval == 0 || !renderer.hasMirror()))
+		renderRearView();
+
 	// ===== STEP 3: RENDER MAIN VIEW (where stencil != 1) =====
 	glStencilFunc(GL_NOTEQUAL, 0x2, 0x3);
 	glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
 
 	// use the required GLSL program to draw the meshes with illumination
+	renderer.beginPass(RenderPass::Main);
 	renderer.activateRenderMeshesShaderProg();
-	renderer.resetLights();
 
-	// Associar os Texture Units aos Objects Texture
-	renderer.setTexUnit(0, 0);	 // Stone
-	renderer.setTexUnit(1, 1);	 // Floor grass
-	renderer.setTexUnit(2, 2);	 // Window
-	renderer.setTexUnit(3, 3);	 // Billboard grass
-	renderer.setTexUnit(4, 4);	 // Billboard tree
-	renderer.setTexUnit(5, 5);	 // Lightwood
-	renderer.setTexUnit(6, 6);	 // Particle
-	renderer.setTexUnit(7, 7);	 // Normalmap
-	renderer.setTexUnit(8, 8);	 // Crcl
-	renderer.setTexUnit(9, 9);	 // Flar
-	renderer.setTexUnit(10, 10); // hxgn
-	renderer.setTexUnit(11, 11); // ring
-	renderer.setTexUnit(12, 12); // sun
+	// Associar os Texture Units aos Objects Texture: one texture array per unit, the layer comes with each draw
+	for (int i = 0; i < (int)TexArray::Count; i++)
+		renderer.setTextureArray((TexArray)i, GLOBAL.texArrayIDs[i]);
 
 	// load identity matrices
 	mu.loadIdentity(gmu::VIEW);
@@ -583,18 +850,9 @@ void renderSim(void)
 	mu.lookAt(cams[activeCam]->getX(), cams[activeCam]->getY(), cams[activeCam]->getZ(),
 			  cams[activeCam]->getTargetX(), cams[activeCam]->getTargetY(), cams[activeCam]->getTargetZ(),
 			  cams[activeCam]->getUpX(), cams[activeCam]->getUpY(), cams[activeCam]->getUpZ());
+	renderer.setLightView(mu.get(gmu::VIEW));
 
-	mu.loadIdentity(gmu::PROJECTION);
-
-	if (cams[activeCam]->getProjectionType() == ProjectionType::Orthographic)
-	{
-		mu.ortho(-30.0f, 30.0f, -30.0f, 30.0f, -100.0f, 100.0f);
-	}
-	else
-	{
-		float ratio = (1.0f * GLOBAL.WinX) / GLOBAL.WinY;
-		mu.perspective(53.13f, ratio, 0.1f, 800.0f);
-	}
+	loadCameraProjection();
 
 	float fogColor[] = {0.f, 0.f, 0.f, 0.f};
 	if (GLOBAL.showFog)
@@ -636,105 +894,78 @@ void renderSim(void)
 	std::sort(transparentObjects.begin(), transparentObjects.end(), cmp);
 
 	/*  RENDER QUEUE
-	  0) render skybox
 	  1) setup the lights
-	  2) render opaque objects
-	  2) render billboard objects
-	  3) render floor
-	  4) render particles (if any)
-	  5) render transparent objects
+	  2) render floor
+	  3) render opaque objects
+	  3) render billboard objects
+	  4) render skybox, where nothing opaque is
+	  5) render particles (if any)
+	  6) render transparent objects
 	*/
 
-	// Render skybox
-	mu.pushMatrix(gmu::MODEL);
-	mu.translate(gmu::MODEL, cams[activeCam]->getX(), cams[activeCam]->getY(), cams[activeCam]->getZ());
-	mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
-	float *m_VP = mu.get(gmu::PROJ_VIEW_MODEL);
-	if (GLOBAL.daytime)
-	{
-		unsigned int id = renderer.TexObjArray.getTextureId(GLOBAL.cubemap_dayID);
-		renderer.activateSkyboxShaderProg(m_VP, id, fogColor);
-	}
+	// reflection of the scene in the floor: mirrored, off screen at reduced resolution, sampled by the floor
+	if (GLOBAL.reflectionScale > 0)
+		renderReflection(fogColor);
 	else
-	{
-		unsigned int id = renderer.TexObjArray.getTextureId(GLOBAL.cubemap_nightID);
-		renderer.activateSkyboxShaderProg(m_VP, id, fogColor);
-	}
-	mu.popMatrix(gmu::MODEL);
-	renderer.activateRenderMeshesShaderProg();
+		renderer.disableReflection();
+	renderer.setLightView(mu.get(gmu::VIEW));
 
+	// the floor marks itself (stencil bit 1) for the planar shadows
 	glEnable(GL_STENCIL_TEST);
-	glStencilFunc(GL_NOTEQUAL, 0x2, 0x2);
-	glStencilOp(GL_REPLACE, GL_KEEP, GL_KEEP);
+	glStencilFunc(GL_EQUAL, 0x1, 0x2);
+	glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+	renderer.setDepthTest(true);
 
-	if (!(stencilQuad))
-	{
-		floorObject->render(renderer, mu);
-	}
-
-	glStencilFunc(GL_EQUAL, 0x1, 0x3);
+	renderer.beginPass(RenderPass::Main);
+	floorObject->render(renderer, mu);
+	renderer.flush();
 	glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
-	glEnable(GL_DEPTH_TEST);
 
-	renderer.invert = true;
-	for (auto &light : sceneLights)
+	if (GLOBAL.planarShadows)
 	{
-		light.invertY();
-		light.setup(renderer, mu);
-	}
-
-	glCullFace(GL_FRONT);
-	// render reflections
-	drawObjects();
-	glCullFace(GL_BACK);
+		renderer.setBlend(true);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	renderer.invert = false;
-	renderer.resetLights();
-	for (auto &light : sceneLights)
-	{
-		light.invertY();
-		light.setup(renderer, mu);
+		// Dark the color stored in color buffer
+		glStencilFunc(GL_EQUAL, 0x1, 0x3);
+		renderer.setDepthTest(false);
+		glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+
+		// render shadows
+		renderer.beginPass(RenderPass::Shadow);
+		renderer.shadow = true;
+		drawObjects();
+		renderer.shadow = false;
+		renderer.setDepthTest(true);
+		renderer.setBlend(false);
 	}
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-	if (stencilQuad)
-	{
-		glStencilFunc(GL_NOTEQUAL, 0x2, 0x3);
-	}
-
-	floorObject->render(renderer, mu);
-
-	// Dark the color stored in color buffer
-	glDisable(GL_DEPTH_TEST);
-	glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
-
-	// render shadows
-	renderer.shadow = true;
-	drawObjects();
-	renderer.shadow = false;
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
-
 	glStencilFunc(GL_GREATER, 0x2, 0x3);
 	glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
 
 	// render real objects
-	drawObjects();
+	renderer.beginPass(RenderPass::Main);
+	drawObjects(true);
+	renderer.flush();
+
+	// Render skybox, behind the opaque objects (same stencil: not under the mirror)
+	mu.pushMatrix(gmu::MODEL);
+	mu.translate(gmu::MODEL, cams[activeCam]->getX(), cams[activeCam]->getY(), cams[activeCam]->getZ());
+	mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
+	renderer.drawSkybox(mu.get(gmu::PROJ_VIEW_MODEL), fogColor);
+	mu.popMatrix(gmu::MODEL);
+	renderer.activateRenderMeshesShaderProg();
 
-	glEnable(GL_BLEND);
+	renderer.setBlend(true);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 	if (GLOBAL.fireworksOn)
 	{
-		glDisable(GL_CULL_FACE); // see both sides of the quad
+		renderer.setCullFace(false); // see both sides of the quad
 		for (auto &particle : particle_vector)
-		{
-			particle->setCameraPos(cams[activeCam]->getX(), cams[activeCam]->getY(), cams[activeCam]->getZ());
 			particle->render(renderer, mu);
-		}
-		glEnable(GL_CULL_FACE);
+		renderer.flush();
+		renderer.setCullFace(true);
 
 		int dead_num_particles = 0;
 		for (int i = 0; i < MAX_PARTICLES; i++)
@@ -774,7 +1005,9 @@ void renderSim(void)
 		mu.loadIdentity(gmu::VIEW);
 		mu.ortho(m_viewport[0], m_viewport[0] + m_viewport[2] - 1, m_viewport[1], m_viewport[1] + m_viewport[3] - 1, -1, 1);
 
+		renderer.beginPass(RenderPass::Overlay);
 		renderFlare(&lensFlare, flarePos[0], flarePos[1], m_viewport, flareQuadID);
+		renderer.beginPass(RenderPass::Main);
 
 		mu.popMatrix(gmu::PROJECTION);
 		mu.popMatrix(gmu::VIEW);
@@ -782,12 +1015,25 @@ void renderSim(void)
 
 	for (auto obj : transparentObjects)
 		obj->render(renderer, mu);
-	glDisable(GL_BLEND);
+	renderer.flush();
+	renderer.setBlend(false);
+
+	// ===== STEP 4: THE MIRROR, composited where the main view left its pixels =====
+	if (stencilQuad && activeCam == 2)
+	{
+		glStencilFunc(GL_EQUAL, 0x2, 0x3);
+		renderer.setDepthTest(false);
+		renderMirrorQuad();
+		renderer.setDepthTest(true);
+		glStencilFunc(GL_GREATER, 0x2, 0x3);
+		renderer.beginPass(RenderPass::Main);
+	}
 
 	// Check collisions
 	collisionSystem.checkCollisions();
 
 	// Render debug information
+	renderer.beginPass(RenderPass::Overlay);
 	if (GLOBAL.showDebug)
 		collisionSystem.showDebug(renderer, mu);
 
@@ -796,166 +1042,12 @@ void renderSim(void)
 	// text to be rendered in last place to be in front of everything
 	if (GLOBAL.fontLoaded)
 	{
-		glDisable(GL_DEPTH_TEST);
-
-		std::vector<TextCommand> texts;
-		float size = 0.3f;
-		float Ypos = 0.f, Yoff = 80.f;
-
-		// --- HUD: battery and score ---
-		texts.push_back(TextCommand{
-			("Battery: " + std::to_string((int)drone->getBatteryLevel()) + "%").c_str(),
-			{720.f, 0.0f}, // screen coords (pixels)
-			size,
-			{0.9f, 0.9f, 0.0f, 1.0f} // yellow
-		});
-
-		texts.push_back(TextCommand{
-			("Score: " + std::to_string((int)drone->getScore())).c_str(),
-			{720.f, Yoff}, // below battery
-			size,
-			{0.0f, 0.9f, 0.9f, 1.0f} // cyan
-		});
-
-		if (GLOBAL.paused)
-		{
-			texts.push_back(TextCommand{
-				"PAUSED",
-				{GLOBAL.WinX / 2.0f - 140.f, GLOBAL.WinY / 2.0f},
-				1.0f,
-				{0.9f, 0.1f, 0.1f, 1.0f} // red
-			});
-		}
+		renderer.setDepthTest(false);
 
-		if (GLOBAL.paused == false)
-		{
-			if (drone->isDisabled())
-			{
-				texts.push_back(TextCommand{
-					"Game Over! No battery!",
-					{GLOBAL.WinX / 2.0f - 360.f, GLOBAL.WinY / 2.0f},
-					1.0f,
-					{0.9f, 0.1f, 0.1f, 1.0f} // red
-				});
-				texts.push_back(TextCommand{
-					"Click 'R' to reset.",
-					{(GLOBAL.WinX / 2.0f) - 100.f, (GLOBAL.WinY / 2.0f)},
-					0.5f,
-					{0.9f, 0.1f, 0.1f, 1.0f} // red
-				});
-			}
-		}
-
-		if (GLOBAL.showKeybinds)
-		{
-			// push_back the keybind gui
-			texts.push_back(TextCommand{
-				"Press 'i' to hide keybinds",
-				{0.f, Ypos},
-				size,
-				{.9f, 0.9f, 0.9f, 1.f}});
-
-			Ypos += Yoff;
-			if (GLOBAL.showFog)
-			{
-				texts.push_back(TextCommand{
-					"Press 'f' to hide fog",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-			else
-			{
-				texts.push_back(TextCommand{
-					"Press 'f' to show fog",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-
-			Ypos += Yoff;
-			if (GLOBAL.showDebug)
-			{
-				texts.push_back(TextCommand{
-					"Press 'k' to hide debug",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-			else
-			{
-				texts.push_back(TextCommand{
-					"Press 'k' to show debug",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-
-			Ypos += Yoff;
-			if (GLOBAL.daytime)
-			{
-				texts.push_back(TextCommand{
-					"Press 'n' to hide directional lights",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-			else
-			{
-				texts.push_back(TextCommand{
-					"Press 'n' to show directional lights",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-
-			Ypos += Yoff;
-			if (GLOBAL.showPointlights)
-			{
-				texts.push_back(TextCommand{
-					"Press 'c' to hide pointlights",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-			else
-			{
-				texts.push_back(TextCommand{
-					"Press 'c' to show pointlights",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-
-			Ypos += Yoff;
-			if (GLOBAL.showSpotlights)
-			{
-				texts.push_back(TextCommand{
-					"Press 'h' to hide spotlights",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-			else
-			{
-				texts.push_back(TextCommand{
-					"Press 'h' to show spotlights",
-					{0.f, Ypos},
-					size,
-					{.9f, 0.9f, 0.9f, 1.f}});
-			}
-		}
-		else
-		{
-			texts.push_back(TextCommand{
-				"Press 'i' to show keybinds",
-				{0.f, 0.f},
-				size,
-				{.9f, 0.9f, 0.9f, 1.f}});
-		}
+		updateHud();
 
 		// the glyph contains transparent background colors and non-transparent for the actual character pixels. So we use the blending
-		glEnable(GL_BLEND);
+		renderer.setBlend(true);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
 		// viewer at origin looking down at  negative z direction
@@ -969,16 +1061,14 @@ void renderSim(void)
 		mu.ortho(m_viewport[0], m_viewport[0] + m_viewport[2] - 1, m_viewport[1], m_viewport[1] + m_viewport[3] - 1, -1, 1);
 		mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
 
-		for (auto text : texts)
-		{
-			text.pvm = mu.get(gmu::PROJ_VIEW_MODEL);
-			renderer.renderText(text);
-		}
+		hud.render(renderer, mu.get(gmu::PROJ_VIEW_MODEL));
+		renderer.flushText();
 		mu.popMatrix(gmu::PROJECTION);
-		glDisable(GL_BLEND);
-		glEnable(GL_DEPTH_TEST);
+		renderer.setBlend(false);
+		renderer.setDepthTest(true);
 	}
 
+	renderer.endFrame();
 	glutSwapBuffers();
 }
 
@@ -1147,6 +1237,42 @@ void processKeys(unsigned char key, int xx, int yy)
 				light.toggleLight();
 		break;
 
+	case 'm': // toggle shadow maps / planar shadows
+		GLOBAL.planarShadows = !GLOBAL.planarShadows;
+		break;
+
+	case 'l': // floor reflection resolution: full, half, quarter, none
+		GLOBAL.reflectionScale = GLOBAL.reflectionScale == 0 ? 1 : (GLOBAL.reflectionScale == 4 ? 0 : GLOBAL.reflectionScale * 2);
+		break;
+
+	case 'z': // depth pre-pass on / off
+		renderer.depthPrepass = !renderer.depthPrepass;
+		break;
+
+	case 'o': // occlusion culling on / off
+		renderer.occlusionCulling = !renderer.occlusionCulling;
+		break;
+
+	case 'x': // software occlusion culling on / off
+		softwareOcclusion.enabled = !softwareOcclusion.enabled;
+		break;
+
+	case 'g': // level of detail on / off
+		renderer.levelOfDetail = !renderer.levelOfDetail;
+		break;
+
+	case 'b': // distant billboard clusters as impostor cards on / off
+		GLOBAL.impostors = !GLOBAL.impostors;
+		break;
+
+	case 'v': // rear view mirror update rate: every 1, 2 or 4 frames
+		GLOBAL.mirrorInterval = GLOBAL.mirrorInterval == 4 ? 1 : GLOBAL.mirrorInterval * 2;
+		break;
+
+	case 'u': // rear view mirror resolution: full, half, quarter
+		GLOBAL.mirrorScale = GLOBAL.mirrorScale == 4 ? 1 : GLOBAL.mirrorScale * 2;
+		break;
+
 	case 'c': // toggle point lights
 		GLOBAL.showPointlights = !GLOBAL.showPointlights;
 		for (auto &light : sceneLights)
@@ -1330,6 +1456,13 @@ void buildCityWithPackages(
 		collisionSystem.addCollider(obj->getCollider());
 	};
 
+	// software occlusion occluders (SoftwareOcclusion) must fit inside their building
+	auto addOccluder = [&](float minX, float minY, float minZ, float maxX, float maxY, float maxZ)
+	{
+		float lo[3] = {minX, minY, minZ}, hi[3] = {maxX, maxY, maxZ};
+		softwareOcclusion.addOccluder(lo, hi);
+	};
+
 	// --------------------------------------------------------------------
 	// Floor
 	floorObject = new SceneObject(std::vector<int>{quadID}, TexMode::TEXTURE_FLOOR);
@@ -1390,6 +1523,7 @@ void buildCityWithPackages(
 		tower->setPosition(x, 0.0f, z);
 		sceneObjects.push_back(tower);
 		addBox(tower, x, 0.0f, z, x + 2.0f, 6.0f + (i % 5), z + 2.0f);
+		addOccluder(x + 0.05f, 0.0f, z + 0.05f, x + 1.95f, 5.95f + (i % 5), z + 1.95f);
 		return tower;
 	};
 
@@ -1400,6 +1534,8 @@ void buildCityWithPackages(
 		pyramid->setPosition(x, 0.0f, z);
 		sceneObjects.push_back(pyramid);
 		addBox(pyramid, x - 1.25f, 0.0f, z - 1.25f, x + 1.25f, 5.0f + (i % 3), z + 1.25f);
+		// the square inside the pentagonal cone at a third of its height
+		addOccluder(x - 0.9f, 0.0f, z - 0.9f, x + 0.9f, (5.0f + (i % 3)) / 3.0f, z + 0.9f);
 		return pyramid;
 	};
 
@@ -1411,6 +1547,9 @@ void buildCityWithPackages(
 		cyl->setPosition(x, scale[1] * 0.5f, z);
 		sceneObjects.push_back(cyl);
 		addBox(cyl, x - 1.5f, 0.0f, z - 1.5f, x + 1.5f, scale[1], z + 1.5f);
+		// inside the coarsest level of detail too: the hexagon's apothem is 1.5 * cos(30) = 1.299, more than the
+		// square's half diagonal, 0.9 * sqrt(2) = 1.273, whichever way the hexagon is turned
+		addOccluder(x - 0.9f, 0.0f, z - 0.9f, x + 0.9f, scale[1] - 0.05f, z + 0.9f);
 		return cyl;
 	};
 
@@ -1419,6 +1558,7 @@ void buildCityWithPackages(
 		SceneObject *window = new SceneObject(std::vector<int>{cubeID}, TexMode::TEXTURE_WINDOW);
 		window->setScale(3.0f, 10.0f + (i % 3), 3.0f);
 		window->setPosition(x, 0.0f, z);
+		window->transparent = true;
 		transparentObjects.push_back(window);
 		addBox(window, x, 0.0f, z, x + 3.0f, 10.0f + (i % 3), z + 3.0f);
 		return window;
@@ -1460,7 +1600,7 @@ void buildCityWithPackages(
 
 	// --------------------------------------------------------------------
 	// Grass outside the torus ring
-	const int grassCount = 1000; // 500;
+	const int grassCount = 10000; // 1000 before instancing
 	std::uniform_real_distribution<float> pos{-5.f, 5.0f};
 	std::uniform_real_distribution<float> col{-2.f, 2.0f};
 	for (int i = 0; i < grassCount; ++i)
@@ -1482,12 +1622,13 @@ void buildCityWithPackages(
 		float randZ = pos(gen);
 
 		grass->setPosition(std::cos(angle) * radius + randX, 0.0f, std::sin(angle) * radius + randZ);
-		grass->setScale(4.f, 10.f, 4.f);
+		grass->setScale(-4.f, 10.f, -4.f); // the quad faces -z: mirrored in x and z, it faces the camera
+		grass->billboard = Billboard::Cylindrical;
 		billboardObjects.push_back(grass);
 	}
 
 	// tree billboards
-	const int treeCount = 0; // 2000;
+	const int treeCount = 2000;
 	const float maxRadius = 300.f;
 	const float minRadius = 200.f;
 	const float goldRatio = PI_F * (3 - std::sqrt(5));
@@ -1510,9 +1651,116 @@ void buildCityWithPackages(
 		float randZ = pos(gen);
 
 		tree->setPosition(std::cos(angle) * radius + randX, 0.f, 30 + std::sin(angle) * radius + randZ);
-		tree->setScale(4.f, 10.f, 4.f);
+		tree->setScale(-4.f, 10.f, -4.f);
+		tree->billboard = Billboard::Cylindrical;
 		billboardObjects.push_back(tree);
 	}
+
+	// --------------------------------------------------------------------
+	// Occlusion groups (Renderer::addOcclusionGroup): one per building, and one per cell of a grid over the
+	// billboards, so a single query covers a whole patch of them. The cells are also the impostor clusters
+	for (auto &quadrant : cityQuadrants)
+		for (SceneObject *building : quadrant)
+		{
+			const Collider::AABB &box = building->getCollider()->getBox();
+			float lo[3], hi[3];
+			for (int k = 0; k < 3; k++)
+			{
+				lo[k] = box.min[k] - 0.1f;
+				hi[k] = box.max[k] + 0.1f;
+			}
+			building->occlusionGroup = renderer.addOcclusionGroup(lo, hi);
+		}
+
+	const float cellSize = 40.f;
+	std::map<std::pair<int, int>, std::vector<SceneObject *>> cells;
+	for (SceneObject *obj : billboardObjects)
+		cells[{(int)std::floor(obj->pos[0] / cellSize), (int)std::floor(obj->pos[2] / cellSize)}].push_back(obj);
+	for (auto &cell : cells)
+	{
+		float lo[3] = {INFINITY, INFINITY, INFINITY}, hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+		for (SceneObject *obj : cell.second)
+		{
+			float center[3], r;
+			obj->getBoundingSphere(renderer, center, r);
+			for (int k = 0; k < 3; k++)
+			{
+				lo[k] = std::min(lo[k], center[k] - r);
+				hi[k] = std::max(hi[k], center[k] + r);
+			}
+		}
+		int group = renderer.addOcclusionGroup(lo, hi);
+		for (SceneObject *obj : cell.second)
+			obj->occlusionGroup = group;
+
+		BillboardCluster cluster;
+		cluster.billboards = cell.second;
+		cluster.card = new SceneObject(treeMeshID1, TexMode::TEXTURE_IMPOSTOR);
+		cluster.card->texLayer = (int)billboardClusters.size();
+		cluster.card->occlusionGroup = group;
+		cluster.card->billboard = Billboard::Cylindrical;
+		billboardClusters.push_back(cluster);
+	}
+}
+
+// Bakes each billboard cluster into its layer of the impostor array, seen from +z with an orthographic view,
+// unlit; its card then spans the same extent, with the billboard quad (x in [-1, 1], y in [0, 2]), mirrored and
+// turned to the camera as the billboards are. The projection is mirrored in x as well, to match. The billboards
+// are turned on the CPU here, as the vertex shader would turn them to the eye point, not to a parallel view
+void bakeImpostors()
+{
+	renderer.beginImpostors((int)billboardClusters.size());
+	renderer.beginPass(RenderPass::Overlay);
+	renderer.activateRenderMeshesShaderProg();
+	renderer.setTextureArray(TexArray::Billboard, GLOBAL.texArrayIDs[(int)TexArray::Billboard]);
+	bool cullFace = renderer.culling();
+	bool blend = renderer.blending();
+	renderer.setCullFace(false);
+	renderer.setBlend(false);
+	renderer.setDepthTest(true);
+
+	for (size_t i = 0; i < billboardClusters.size(); i++)
+	{
+		BillboardCluster &cluster = billboardClusters[i];
+		float lo[3] = {INFINITY, 0.f, INFINITY}, hi[3] = {-INFINITY, 0.f, -INFINITY};
+		for (SceneObject *obj : cluster.billboards)
+		{
+			lo[0] = std::min(lo[0], obj->pos[0] - std::fabs(obj->scale[0]));
+			hi[0] = std::max(hi[0], obj->pos[0] + std::fabs(obj->scale[0]));
+			hi[1] = std::max(hi[1], obj->pos[1] + 2.f * obj->scale[1]);
+			lo[2] = std::min(lo[2], obj->pos[2] - std::fabs(obj->scale[2]));
+			hi[2] = std::max(hi[2], obj->pos[2] + std::fabs(obj->scale[2]));
+		}
+		float centerX = (lo[0] + hi[0]) * 0.5f, centerZ = (lo[2] + hi[2]) * 0.5f;
+		float halfWidth = (hi[0] - lo[0]) * 0.5f;
+
+		renderer.beginImpostor((int)i);
+		mu.loadIdentity(gmu::VIEW);
+		mu.loadIdentity(gmu::MODEL);
+		mu.lookAt(centerX, 0.f, hi[2] + 1.f, centerX, 0.f, lo[2], 0.f, 1.f, 0.f);
+		mu.loadIdentity(gmu::PROJECTION);
+		mu.ortho(halfWidth, -halfWidth, 0.f, hi[1], 0.f, hi[2] - lo[2] + 2.f);
+		for (SceneObject *obj : cluster.billboards)
+		{
+			int texMode = obj->texMode;
+			Billboard billboard = obj->billboard;
+			obj->texMode = TexMode::TEXTURE_IMPOSTOR_BAKE;
+			obj->billboard = Billboard::None;
+			obj->setRotation(0.f, 0.f, 0.f); // facing +z, as towards a camera there
+			obj->render(renderer, mu);
+			obj->texMode = texMode;
+			obj->billboard = billboard;
+		}
+
+		cluster.card->setPosition(centerX, 0.f, centerZ);
+		cluster.card->setScale(-halfWidth, hi[1] * 0.5f, -1.f);
+	}
+
+	renderer.endImpostors();
+	if (cullFace)
+		renderer.setCullFace(true);
+	if (blend)
+		renderer.setBlend(true);
 }
 
 void buildScene()
@@ -1537,23 +1785,15 @@ void buildScene()
 	cams[2]->setUp(0.0f, 1.0f, 0.0f);
 	cams[2]->setProjectionType(ProjectionType::Perspective);
 
-	// Texture Object definition
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.Stone_Tex);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.Floor_Tex);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.Window_Tex);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.BBGrass_Tex, false);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.BBTree_Tex, false);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.Lightwood_Tex);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.Particle_Tex);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.Normalmap_Tex);
-
-	// Flare
-	offsetId = renderer.TexObjArray.getNumTextureObjects();
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.CRLC_Tex, false);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.FLAR_Tex, false);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.HXGN_Tex, false);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.RING_Tex, false);
-	renderer.TexObjArray.texture2D_Loader(FILEPATH.SUN_Tex, false);
+	// Texture Object definition: texture arrays, layers in the order of the SurfaceLayer, BillboardLayer
+	// and SpriteLayer enums (sceneObject.h)
+	GLOBAL.texArrayIDs[(int)TexArray::Surface] = renderer.TexObjArray.texture2DArray_Loader(
+		{FILEPATH.Stone_Tex, FILEPATH.Floor_Tex, FILEPATH.Window_Tex, FILEPATH.Lightwood_Tex, FILEPATH.Normalmap_Tex}, 512);
+	GLOBAL.texArrayIDs[(int)TexArray::Billboard] = renderer.TexObjArray.texture2DArray_Loader(
+		{FILEPATH.BBGrass_Tex, FILEPATH.BBTree_Tex}, 512, false);
+	// Particle and flare pieces
+	GLOBAL.texArrayIDs[(int)TexArray::Sprite] = renderer.TexObjArray.texture2DArray_Loader(
+		{FILEPATH.Particle_Tex, FILEPATH.CRLC_Tex, FILEPATH.FLAR_Tex, FILEPATH.HXGN_Tex, FILEPATH.RING_Tex, FILEPATH.SUN_Tex}, 256, false);
 	loadFlareFile(&lensFlare, FILEPATH.Flare_Tex);
 
 	GLOBAL.cubemap_dayID = renderer.TexObjArray.getNumTextureObjects();
@@ -1615,6 +1855,7 @@ void buildScene()
 
 	// create geometry and VAO of the cylinder
 	amesh = createCylinder(1.0f, 1.0f, 20);
+	amesh.lods = {createCylinder(1.0f, 1.0f, 10), createCylinder(1.0f, 1.0f, 6)};
 	memcpy(amesh.mat.ambient, amb1, 4 * sizeof(float));
 	memcpy(amesh.mat.diffuse, diff1, 4 * sizeof(float));
 	memcpy(amesh.mat.specular, spec1, 4 * sizeof(float));
@@ -1624,6 +1865,7 @@ void buildScene()
 	int cylinderID = renderer.addMesh(amesh);
 
 	amesh = createTorus(1.f, 2.0f, 40, 20);
+	amesh.lods = {createTorus(1.f, 2.0f, 20, 10), createTorus(1.f, 2.0f, 10, 6)};
 	memcpy(amesh.mat.ambient, amb1, 4 * sizeof(float));
 	memcpy(amesh.mat.diffuse, diff1, 4 * sizeof(float));
 	memcpy(amesh.mat.specular, spec1, 4 * sizeof(float));
@@ -1653,7 +1895,7 @@ void buildScene()
 	int PackageId = renderer.addMesh(amesh);
 
 	// Load drone model from file
-	std::vector<MyMesh> droneMeshs = createFromFile(FILEPATH.Drone_OBJ);
+	std::vector<MyMesh> droneMeshs = createFromFile(FILEPATH.Drone_OBJ, 2);
 	std::vector<int> droneMeshIDs;
 	for (size_t i = 0; i < droneMeshs.size(); i++)
 	{
@@ -1749,7 +1991,7 @@ void buildScene()
 
 	if (stencilQuadID)
 	{
-		stencilQuad = new SceneObject(std::vector<int>{stencilQuadID}, TexMode::TEXTURE_NONE);
+		stencilQuad = new SceneObject(std::vector<int>{stencilQuadID}, TexMode::TEXTURE_MIRROR);
 		// Size of the rear-view mirror in pixels
 		float quadWidth = 256.0f;  // half the previous width
 		float quadHeight = 174.0f; // half the previous height
@@ -1777,7 +2019,9 @@ void buildScene()
 	}
 
 	// === SCENE LIGHTS === //
-	sceneLights.reserve(50);
+	// headlights keep references into sceneLights, so it must never reallocate
+	const int randomPointLights = 1000;
+	sceneLights.reserve(50 + randomPointLights);
 
 	float whiteLight[4] = {1.f, 1.f, 1.f, 1.f};
 	float sunDirection[4] = {-1.f, -1.f, 0.001f, 0.f};
@@ -1794,14 +2038,15 @@ void buildScene()
 	sceneLights.emplace_back(LightType::POINTLIGHT, redLight);
 	sceneLights.back().setPosition(rLightPos).createObject(renderer, sceneObjects);
 
-	std::uniform_real_distribution<float> lightPos{-20.f, 20.0f};
+	// many short range lights over the city: the clustered lighting only shades the ones near each fragment
+	std::uniform_real_distribution<float> lightPos{-150.f, 150.0f};
 	std::uniform_real_distribution<float> lightCol{0.f, 1.0f};
-	for (int i = 0; i < 0; i++)
+	for (int i = 0; i < randomPointLights; i++)
 	{
 		float lightColor[4] = {lightCol(gen), lightCol(gen), lightCol(gen), 1.f};
 		float lightPosition[4] = {lightPos(gen), 5.f, lightPos(gen), 1.f};
 		sceneLights.emplace_back(LightType::POINTLIGHT, lightColor);
-		sceneLights.back().setPosition(lightPosition).createObject(renderer, sceneObjects);
+		sceneLights.back().setPosition(lightPosition).setAmbient(0.f).setAttenuation(1.f, 0.35f, 0.44f);
 	}
 
 	float magLight[4] = {1.f, 0.f, 1.f, 1.f};
@@ -1839,15 +2084,23 @@ void buildScene()
 	sceneLights.emplace_back(LightType::SPOTLIGHT, blueLight);
 	sceneLights.back().setDebug().setPosition(origin).setDirection(axisZdir).setAmbient(0.f).setDiffuse(0.f).createObject(renderer, sceneObjects);
 
-	// The truetypeInit creates a texture object in TexObjArray for storing the fontAtlasTexture
+	// The truetypeInit creates the font atlas texture, with the ASCII glyphs; the others are added when first drawn
 	GLOBAL.fontLoaded = renderer.truetypeInit(FILEPATH.Font_File);
 	if (!GLOBAL.fontLoaded)
 		std::cerr << "Fonts not loaded\n";
 	else
 		std::cerr << "Fonts loaded\n";
 
+	if (GLOBAL.fontLoaded)
+		buildHud();
+
 	printf("\nNumber of Texture Objects is %d\n\n", renderer.TexObjArray.getNumTextureObjects());
 
+	GeometryPool &pool = GeometryPool::getInstance();
+	printf("Geometry pool: %zu vertices (%zu KB, %zu KB as separate vec4 streams), %zu indices\n\n",
+		   pool.getVertexCount(), pool.getVertexCount() * sizeof(GeometryPool::Vertex) / 1024,
+		   pool.getVertexCount() * 16 * sizeof(float) / 1024, pool.getIndexCount());
+
 	// Collision System
 	collisionSystem.setDebugCubeMesh(cubeID);
 }
@@ -1898,8 +2151,8 @@ int main(int argc, char **argv)
 	glewInit();
 
 	// some GL settings
-	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_CULL_FACE);
+	renderer.setDepthTest(true);
+	renderer.setCullFace(true);
 	glEnable(GL_MULTISAMPLE);
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
@@ -1919,13 +2172,18 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 	ilInit();
+	iluInit(); // iluScale fits the texture array layers
 
 	buildScene();
 
 	if (!renderer.setRenderMeshesShaderProg(FILEPATH.Mesh_Vert, FILEPATH.Mesh_Frag) ||
 		!renderer.setRenderTextShaderProg(FILEPATH.Font_Vert, FILEPATH.Font_Frag) ||
-		!renderer.setSkyboxShaderProg(FILEPATH.Post_Vert, FILEPATH.Post_Frag))
+		!renderer.setSkyboxShaderProg(FILEPATH.Post_Vert, FILEPATH.Post_Frag) ||
+		!renderer.setShadowShaderProg(FILEPATH.Shadow_Vert, FILEPATH.Shadow_Frag))
 		return (1);
+	// the setup code above binds GL objects directly, behind the renderer state cache
+	renderer.invalidateStateCache();
+	bakeImpostors();
 
 	//  GLUT main loop
 	glutMainLoop();
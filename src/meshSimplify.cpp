@@ -0,0 +1,251 @@
+#include <vector>
+#include <array>
+#include <queue>
+#include <unordered_map>
+#include <cmath>
+#include "meshSimplify.h"
+
+namespace
+{
+	// symmetric 4x4 matrix, upper triangle: sum of the squared distances to a set of planes
+	struct Quadric
+	{
+		double q[10] = {};
+
+		void addPlane(double a, double b, double c, double d, double weight)
+		{
+			double p[4] = {a, b, c, d};
+			int k = 0;
+			for (int i = 0; i < 4; i++)
+				for (int j = i; j < 4; j++)
+					q[k++] += weight * p[i] * p[j];
+		}
+
+		void add(const Quadric &o)
+		{
+			for (int k = 0; k < 10; k++)
+				q[k] += o.q[k];
+		}
+
+		double error(const float *v) const
+		{
+			double x = v[0], y = v[1], z = v[2];
+			return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z + 2 * q[3] * x +
+				   q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+				   q[7] * z * z + 2 * q[8] * z + q[9];
+		}
+	};
+
+	struct Collapse
+	{
+		double cost;
+		GLuint from, to;
+		unsigned int fromVersion, toVersion; // stale once either vertex changed since
+
+		bool operator<(const Collapse &o) const { return cost > o.cost; } // cheapest on top
+	};
+
+	void triangleNormal(const float *a, const float *b, const float *c, float *n)
+	{
+		float u[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+		float v[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+		n[0] = u[1] * v[2] - u[2] * v[1];
+		n[1] = u[2] * v[0] - u[0] * v[2];
+		n[2] = u[0] * v[1] - u[1] * v[0];
+	}
+}
+
+std::vector<GLuint> simplifyMesh(const float *position, const float *normal, const float *texCoord, int numVertices,
+								 const std::vector<GLuint> &indices, int targetTriangles)
+{
+	auto pos = [&](GLuint v)
+	{ return position + v * 4; };
+
+	// the surface is simplified over positions: the copies of a vertex split for its normal or texture coordinates
+	// (every vertex of a flat shaded mesh) are welded into the first one
+	std::vector<GLuint> weld(numVertices);
+	std::vector<std::vector<GLuint>> copies(numVertices);
+	{
+		struct PositionHash
+		{
+			size_t operator()(const std::array<float, 3> &p) const
+			{
+				size_t h = 0;
+				for (float f : p)
+					h = h * 31 + std::hash<float>()(f);
+				return h;
+			}
+		};
+		std::unordered_map<std::array<float, 3>, GLuint, PositionHash> firstAt;
+		for (int v = 0; v < numVertices; v++)
+		{
+			std::array<float, 3> p = {pos(v)[0], pos(v)[1], pos(v)[2]};
+			weld[v] = firstAt.emplace(p, (GLuint)v).first->second;
+			copies[weld[v]].push_back((GLuint)v);
+		}
+	}
+
+	// tris index the welded vertices, corners the original ones each triangle corner draws with
+	std::vector<GLuint> corners(indices), tris(indices.size());
+	for (size_t i = 0; i < indices.size(); i++)
+		tris[i] = weld[indices[i]];
+	int numTriangles = (int)tris.size() / 3;
+	std::vector<char> alive(numTriangles, 1);
+	std::vector<Quadric> quadrics(numVertices);
+	std::vector<std::vector<int>> vertexTriangles(numVertices);
+
+	// each vertex starts with the planes of its triangles, weighted by their area
+	for (int t = 0; t < numTriangles; t++)
+	{
+		const GLuint *v = &tris[t * 3];
+		float n[3];
+		triangleNormal(pos(v[0]), pos(v[1]), pos(v[2]), n);
+		double length = std::sqrt((double)n[0] * n[0] + (double)n[1] * n[1] + (double)n[2] * n[2]);
+		for (int k = 0; k < 3; k++)
+			vertexTriangles[v[k]].push_back(t);
+		if (length <= 0.0)
+			continue;
+		double a = n[0] / length, b = n[1] / length, c = n[2] / length;
+		double d = -(a * pos(v[0])[0] + b * pos(v[0])[1] + c * pos(v[0])[2]);
+		for (int k = 0; k < 3; k++)
+			quadrics[v[k]].addPlane(a, b, c, d, length * 0.5);
+	}
+
+	// edges of a single triangle are the open borders of the mesh, and a vertex whose copies have different
+	// texture coordinates lies on a seam: they stay put, so the outline and the texture mapping hold
+	std::unordered_map<unsigned long long, int> edgeUse;
+	auto edgeKey = [](GLuint a, GLuint b)
+	{ return a < b ? (unsigned long long)a << 32 | b : (unsigned long long)b << 32 | a; };
+	for (int t = 0; t < numTriangles; t++)
+		for (int k = 0; k < 3; k++)
+			edgeUse[edgeKey(tris[t * 3 + k], tris[t * 3 + (k + 1) % 3])]++;
+	std::vector<char> locked(numVertices, 0);
+	for (const auto &edge : edgeUse)
+		if (edge.second == 1)
+			locked[edge.first >> 32] = locked[edge.first & 0xFFFFFFFF] = 1;
+	if (texCoord)
+		for (int v = 0; v < numVertices; v++)
+			for (GLuint c : copies[v])
+				if (texCoord[c * 4] != texCoord[v * 4] || texCoord[c * 4 + 1] != texCoord[v * 4 + 1])
+					locked[v] = 1;
+
+	// the copy of welded vertex w a corner drawn with original vertex from moves to: the same texture coordinates
+	// (they differ only on seams), then the closest normal
+	auto closestCopy = [&](GLuint w, GLuint from)
+	{
+		GLuint best = copies[w][0];
+		float bestUv = INFINITY, bestDot = -INFINITY;
+		for (GLuint c : copies[w])
+		{
+			float uv = 0.f, dot = 0.f;
+			if (texCoord)
+			{
+				float du = texCoord[c * 4] - texCoord[from * 4], dv = texCoord[c * 4 + 1] - texCoord[from * 4 + 1];
+				uv = du * du + dv * dv;
+			}
+			if (normal)
+				dot = normal[c * 4] * normal[from * 4] + normal[c * 4 + 1] * normal[from * 4 + 1] + normal[c * 4 + 2] * normal[from * 4 + 2];
+			if (uv < bestUv || (uv == bestUv && dot > bestDot))
+			{
+				best = c;
+				bestUv = uv;
+				bestDot = dot;
+			}
+		}
+		return best;
+	};
+
+	std::priority_queue<Collapse> heap;
+	std::vector<unsigned int> version(numVertices, 0);
+	auto push = [&](GLuint a, GLuint b)
+	{
+		// the cheaper direction that moves an unlocked vertex onto the other
+		Quadric q = quadrics[a];
+		q.add(quadrics[b]);
+		Collapse best{INFINITY, 0, 0, 0, 0};
+		if (!locked[a])
+			best = {q.error(pos(b)), a, b, version[a], version[b]};
+		if (!locked[b] && q.error(pos(a)) < best.cost)
+			best = {q.error(pos(a)), b, a, version[b], version[a]};
+		if (best.cost < INFINITY)
+			heap.push(best);
+	};
+	for (const auto &edge : edgeUse)
+		push((GLuint)(edge.first >> 32), (GLuint)(edge.first & 0xFFFFFFFF));
+
+	int live = numTriangles;
+	while (live > targetTriangles && !heap.empty())
+	{
+		Collapse c = heap.top();
+		heap.pop();
+		if (version[c.from] != c.fromVersion || version[c.to] != c.toVersion)
+			continue;
+
+		// reject collapses that would fold a remaining triangle over
+		bool flips = false;
+		for (int t : vertexTriangles[c.from])
+		{
+			const GLuint *v = &tris[t * 3];
+			if (!alive[t] || v[0] == c.to || v[1] == c.to || v[2] == c.to)
+				continue;
+			const float *p[3], *q[3];
+			for (int k = 0; k < 3; k++)
+			{
+				p[k] = pos(v[k]);
+				q[k] = pos(v[k] == c.from ? c.to : v[k]);
+			}
+			float before[3], after[3];
+			triangleNormal(p[0], p[1], p[2], before);
+			triangleNormal(q[0], q[1], q[2], after);
+			if (before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0.f)
+			{
+				flips = true;
+				break;
+			}
+		}
+		if (flips)
+			continue;
+
+		// triangles on the edge vanish, the others follow the vertex
+		for (int t : vertexTriangles[c.from])
+		{
+			GLuint *v = &tris[t * 3];
+			if (!alive[t])
+				continue;
+			if (v[0] == c.to || v[1] == c.to || v[2] == c.to)
+			{
+				alive[t] = 0;
+				live--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++)
+				if (v[k] == c.from)
+				{
+					v[k] = c.to;
+					corners[t * 3 + k] = closestCopy(c.to, corners[t * 3 + k]);
+				}
+			vertexTriangles[c.to].push_back(t);
+		}
+		vertexTriangles[c.from].clear();
+		quadrics[c.to].add(quadrics[c.from]);
+		version[c.from]++;
+		version[c.to]++;
+
+		// the edges around the merged vertex get new costs
+		for (int t : vertexTriangles[c.to])
+		{
+			if (!alive[t])
+				continue;
+			for (int k = 0; k < 3; k++)
+				if (tris[t * 3 + k] != c.to)
+					push(c.to, tris[t * 3 + k]);
+		}
+	}
+
+	std::vector<GLuint> result;
+	result.reserve(live * 3);
+	for (int t = 0; t < numTriangles; t++)
+		if (alive[t])
+			result.insert(result.end(), corners.begin() + t * 3, corners.begin() + t * 3 + 3);
+	return result;
+}
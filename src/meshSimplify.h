@@ -0,0 +1,12 @@
+#pragma once
+#include <GL/glew.h>
+#include <vector>
+
+// Quadric error metric simplification (Garland & Heckbert): repeatedly collapses the edge whose removal moves the
+// surface least, until the triangle list is down to targetTriangles or nothing can be collapsed any more.
+// Vertices are only ever merged into one another, never moved, so the result indexes the same vertices as the
+// input and a coarser level of detail costs nothing but its indices. Vertices at the same position are simplified
+// as one; a corner moved onto them takes the copy with its texture coordinates and the closest normal.
+// The arrays hold 4 floats per vertex; normal and texCoord may be null.
+std::vector<GLuint> simplifyMesh(const float *position, const float *normal, const float *texCoord, int numVertices,
+								 const std::vector<GLuint> &indices, int targetTriangles);
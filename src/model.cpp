@@ -23,11 +23,11 @@
 #include "mathUtility.h"
 #include "shader.h"
 #include "model.h"
+#include "geometryPool.h"
+#include "meshSimplify.h"
 #include "cube.h"
 
-GLuint VboId[2];
-
-std::vector<MyMesh> createFromFile(const std::string &path)
+std::vector<MyMesh> createFromFile(const std::string &path, int lodLevels)
 {
 	Assimp::Importer importer;
 	const aiScene *scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_JoinIdenticalVertices | aiProcess_CalcTangentSpace);
@@ -102,52 +102,35 @@ std::vector<MyMesh> createFromFile(const std::string &path)
 			indices.push_back(face.mIndices[2]);
 		}
 
-		// Upload VAO/VBOs just like you do in computeVAO()
-		glGenVertexArrays(1, &mesh.vao);
-		glBindVertexArray(mesh.vao);
-
-		GLuint vbo[2];
-		glGenBuffers(2, vbo);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-		glBufferData(GL_ARRAY_BUFFER,
-					 vertices.size() * sizeof(float) +
-						 normals.size() * sizeof(float) +
-						 texcoords.size() * sizeof(float) +
-						 tangents.size() * sizeof(float),
-					 nullptr, GL_STATIC_DRAW);
-
-		size_t offset = 0;
-		glBufferSubData(GL_ARRAY_BUFFER, offset, vertices.size() * sizeof(float), vertices.data());
-		offset += vertices.size() * sizeof(float);
-		glBufferSubData(GL_ARRAY_BUFFER, offset, normals.size() * sizeof(float), normals.data());
-		offset += normals.size() * sizeof(float);
-		glBufferSubData(GL_ARRAY_BUFFER, offset, texcoords.size() * sizeof(float), texcoords.data());
-		offset += texcoords.size() * sizeof(float);
-		glBufferSubData(GL_ARRAY_BUFFER, offset, tangents.size() * sizeof(float), tangents.data());
-
-		// Setup attributes
-		glEnableVertexAttribArray(Shader::VERTEX_COORD_ATTRIB);
-		glVertexAttribPointer(Shader::VERTEX_COORD_ATTRIB, 4, GL_FLOAT, GL_FALSE, 0, 0);
-
-		glEnableVertexAttribArray(Shader::NORMAL_ATTRIB);
-		glVertexAttribPointer(Shader::NORMAL_ATTRIB, 4, GL_FLOAT, GL_FALSE, 0,
-							  (void *)(vertices.size() * sizeof(float)));
-
-		glEnableVertexAttribArray(Shader::TEXTURE_COORD_ATTRIB);
-		glVertexAttribPointer(Shader::TEXTURE_COORD_ATTRIB, 4, GL_FLOAT, GL_FALSE, 0,
-							  (void *)((vertices.size() + normals.size()) * sizeof(float)));
-
-		glEnableVertexAttribArray(Shader::TANGENT_ATTRIB);
-		glVertexAttribPointer(Shader::TANGENT_ATTRIB, 4, GL_FLOAT, GL_FALSE, 0,
-							  (void *)((vertices.size() + normals.size() + texcoords.size()) * sizeof(float)));
-
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
-
-		glBindVertexArray(0);
+		// Suballocate from the shared geometry pool
+		GeometryPool::Range range = GeometryPool::getInstance().add(
+			ai_mesh->mNumVertices, vertices.data(), normals.empty() ? nullptr : normals.data(),
+			texcoords.data(), tangents.data(), indices.size(), indices.data());
+		mesh.vao = GeometryPool::getInstance().getVAO();
+		mesh.baseVertex = range.baseVertex;
+		mesh.firstIndex = range.firstIndex;
+		memcpy(mesh.bounds, range.bounds, sizeof(range.bounds));
 		mesh.numIndexes = indices.size();
 		mesh.type = GL_TRIANGLES;
 
+		// each level about half the triangles of the previous one, indexing the same pool vertices. Every level is
+		// simplified from the full mesh, so the errors of the coarser ones do not add up
+		size_t previous = indices.size();
+		for (int level = 0; level < lodLevels; level++)
+		{
+			std::vector<GLuint> coarser = simplifyMesh(vertices.data(), normals.empty() ? nullptr : normals.data(),
+													   ai_mesh->HasTextureCoords(0) ? texcoords.data() : nullptr,
+													   ai_mesh->mNumVertices, indices, (int)(indices.size() / 3) >> (level + 1));
+			if (coarser.empty() || coarser.size() > previous * 3 / 4)
+				break; // borders and seams left too little to collapse
+			MyMesh lod = mesh;
+			lod.lods.clear();
+			lod.firstIndex = GeometryPool::getInstance().addIndices(coarser.size(), coarser.data());
+			lod.numIndexes = coarser.size();
+			mesh.lods.push_back(lod);
+			previous = coarser.size();
+		}
+
 		meshes.push_back(mesh);
 	}
 
@@ -169,30 +152,12 @@ MyMesh createQuad(float size_x, float size_y)
 		vert[i * 4 + 1] *= size_y;
 	}
 
-	glGenVertexArrays(1, &(amesh.vao));
-	glBindVertexArray(amesh.vao);
-
-	glGenBuffers(2, VboId);
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[0]);
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(quad_vertices) + sizeof(quad_normals) + sizeof(quad_texCoords), NULL, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(quad_vertices), vert);
-	glBufferSubData(GL_ARRAY_BUFFER, sizeof(quad_vertices), sizeof(quad_normals), quad_normals);
-	glBufferSubData(GL_ARRAY_BUFFER, sizeof(quad_vertices) + sizeof(quad_normals), sizeof(quad_texCoords), quad_texCoords);
-
-	glEnableVertexAttribArray(Shader::VERTEX_COORD_ATTRIB);
-	glVertexAttribPointer(Shader::VERTEX_COORD_ATTRIB, 4, GL_FLOAT, 0, 0, 0);
-	glEnableVertexAttribArray(Shader::NORMAL_ATTRIB);
-	glVertexAttribPointer(Shader::NORMAL_ATTRIB, 4, GL_FLOAT, 0, 0, (void *)sizeof(quad_vertices));
-	glEnableVertexAttribArray(Shader::TEXTURE_COORD_ATTRIB);
-	glVertexAttribPointer(Shader::TEXTURE_COORD_ATTRIB, 4, GL_FLOAT, 0, 0, (void *)(sizeof(quad_vertices) + sizeof(quad_normals)));
-
-	// index buffer
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, VboId[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * amesh.numIndexes, quad_faceIndex, GL_STATIC_DRAW);
-
-	// unbind the VAO
-	glBindVertexArray(0);
+	GeometryPool::Range range = GeometryPool::getInstance().add(
+		4, vert, quad_normals, quad_texCoords, nullptr, amesh.numIndexes, quad_faceIndex);
+	amesh.vao = GeometryPool::getInstance().getVAO();
+	amesh.baseVertex = range.baseVertex;
+	amesh.firstIndex = range.firstIndex;
+	memcpy(amesh.bounds, range.bounds, sizeof(range.bounds));
 
 	amesh.type = GL_TRIANGLES;
 	return (amesh);
@@ -203,30 +168,12 @@ MyMesh createCube()
 	MyMesh amesh;
 	amesh.numIndexes = faceCount * 3;
 
-	glGenVertexArrays(1, &(amesh.vao));
-	glBindVertexArray(amesh.vao);
-
-	glGenBuffers(2, VboId);
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[0]);
-
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices) + sizeof(normals) + sizeof(texCoords), NULL, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
-	glBufferSubData(GL_ARRAY_BUFFER, sizeof(vertices), sizeof(normals), normals);
-	glBufferSubData(GL_ARRAY_BUFFER, sizeof(vertices) + sizeof(normals), sizeof(texCoords), texCoords);
-
-	glEnableVertexAttribArray(Shader::VERTEX_COORD_ATTRIB);
-	glVertexAttribPointer(Shader::VERTEX_COORD_ATTRIB, 4, GL_FLOAT, 0, 0, 0);
-	glEnableVertexAttribArray(Shader::NORMAL_ATTRIB);
-	glVertexAttribPointer(Shader::NORMAL_ATTRIB, 4, GL_FLOAT, 0, 0, (void *)sizeof(vertices));
-	glEnableVertexAttribArray(Shader::TEXTURE_COORD_ATTRIB);
-	glVertexAttribPointer(Shader::TEXTURE_COORD_ATTRIB, 4, GL_FLOAT, 0, 0, (void *)(sizeof(vertices) + sizeof(normals)));
-
-	// index buffer
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, VboId[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * amesh.numIndexes, faceIndex, GL_STATIC_DRAW);
-
-	// unbind the VAO
-	glBindVertexArray(0);
+	GeometryPool::Range range = GeometryPool::getInstance().add(
+		sizeof(vertices) / (4 * sizeof(float)), vertices, normals, texCoords, tangents, amesh.numIndexes, faceIndex);
+	amesh.vao = GeometryPool::getInstance().getVAO();
+	amesh.baseVertex = range.baseVertex;
+	amesh.firstIndex = range.firstIndex;
+	memcpy(amesh.bounds, range.bounds, sizeof(range.bounds));
 
 	amesh.type = GL_TRIANGLES;
 	return (amesh);
@@ -506,32 +453,12 @@ MyMesh computeVAO(int numP, float *p, float *points, int sides, float smoothCos)
 	/* Calculate the tangent array*/
 	ComputeTangentArray(numVertices, vertex, normal, textco, amesh.numIndexes, faceIndex, tangent);
 
-	glGenVertexArrays(1, &(amesh.vao));
-	glBindVertexArray(amesh.vao);
-
-	glGenBuffers(2, VboId);
-	glBindBuffer(GL_ARRAY_BUFFER, VboId[0]);
-	glBufferData(GL_ARRAY_BUFFER, numVertices * sizeof(float) * 4 * 4, NULL, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, numVertices * sizeof(float) * 4, vertex);
-	glBufferSubData(GL_ARRAY_BUFFER, numVertices * sizeof(float) * 4, numVertices * sizeof(float) * 4, normal);
-	glBufferSubData(GL_ARRAY_BUFFER, numVertices * sizeof(float) * 4 * 2, numVertices * sizeof(float) * 4, textco);
-	glBufferSubData(GL_ARRAY_BUFFER, numVertices * sizeof(float) * 4 * 3, numVertices * sizeof(float) * 4, tangent);
-
-	glEnableVertexAttribArray(Shader::VERTEX_COORD_ATTRIB);
-	glVertexAttribPointer(Shader::VERTEX_COORD_ATTRIB, 4, GL_FLOAT, 0, 0, 0);
-	glEnableVertexAttribArray(Shader::NORMAL_ATTRIB);
-	glVertexAttribPointer(Shader::NORMAL_ATTRIB, 4, GL_FLOAT, 0, 0, (void *)(numVertices * sizeof(float) * 4));
-	glEnableVertexAttribArray(Shader::TEXTURE_COORD_ATTRIB);
-	glVertexAttribPointer(Shader::TEXTURE_COORD_ATTRIB, 4, GL_FLOAT, 0, 0, (void *)(numVertices * sizeof(float) * 4 * 2));
-	glEnableVertexAttribArray(Shader::TANGENT_ATTRIB);
-	glVertexAttribPointer(Shader::TANGENT_ATTRIB, 4, GL_FLOAT, 0, 0, (void *)(numVertices * sizeof(float) * 4 * 3));
-
-	// index buffer
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, VboId[1]);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * amesh.numIndexes, faceIndex, GL_STATIC_DRAW);
-
-	// unbind the VAO
-	glBindVertexArray(0);
+	GeometryPool::Range range = GeometryPool::getInstance().add(
+		numVertices, vertex, normal, textco, tangent, amesh.numIndexes, faceIndex);
+	amesh.vao = GeometryPool::getInstance().getVAO();
+	amesh.baseVertex = range.baseVertex;
+	amesh.firstIndex = range.firstIndex;
+	memcpy(amesh.bounds, range.bounds, sizeof(range.bounds));
 
 	amesh.type = GL_TRIANGLES;
 	return (amesh);
@@ -5,6 +5,7 @@
 #define MAX_TEXTURES 16
 
 #include <string>
+#include <vector>
 
 class Model
 {
@@ -43,16 +44,22 @@ struct Material
 // A model can be made of many meshes. Each is stored  in the following structure
 struct MyMesh
 {
-	GLuint vao;
+	GLuint vao;		   // the GeometryPool VAO, shared by all meshes
+	GLint baseVertex;  // first vertex of the mesh in the pool vertex buffer
+	GLuint firstIndex; // first index of the mesh in the pool index buffer
+	float bounds[4];   // object space bounding sphere (center xyz, radius), for culling
 	GLuint texUnits[MAX_TEXTURES];
 	texType texTypes[4];
 	float transform[16];
 	GLuint numIndexes;
 	unsigned int type;
 	struct Material mat;
+	int matSlot; // slot of mat in the renderer material UBO, set by Renderer::addMesh
+	std::vector<MyMesh> lods; // coarser versions, finest first; Renderer::addMesh makes them its level of detail chain
 };
 
-std::vector<MyMesh> createFromFile(const std::string &path);
+// lodLevels: coarser versions of each mesh to add to its lods, by quadric simplification over the same vertices
+std::vector<MyMesh> createFromFile(const std::string &path, int lodLevels = 0);
 MyMesh createCube();
 MyMesh createQuad(float size_x, float size_y);
 MyMesh createSphere(float radius, int divisions);
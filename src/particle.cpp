@@ -13,7 +13,6 @@ private:
     GLfloat ovx, ovy, ovz; // original velocity
 	GLfloat vx, vy, vz; // velocity
 	GLfloat ax, ay, az; // acceleration 
-    float camX, camY, camZ; // camera
     public:
     
     float	curr_life;
@@ -24,6 +23,8 @@ private:
             setPosition(x, y, z);
             vx = ovx; vy = ovy; vz = ovz;
             curr_life = original_life; 
+            transparent = true;
+            billboard = Billboard::Spherical;
         }
 
     void update(float deltaTime) override {
@@ -46,48 +47,4 @@ private:
         vx = ovx; vy = ovy; vz = ovz;
         curr_life = original_life; // reset current life
     }
-
-    void setCameraPos(float x, float y, float z) {
-        camX = x;
-        camY = y;
-        camZ = z;
-    }
-
-    void render(Renderer &renderer, gmu &mu) {
-        if (!active) return;
-
-            mu.pushMatrix(gmu::MODEL);
-            mu.translate(gmu::MODEL, pos[0], pos[1], pos[2]);
-            
-            // Face camera
-            float dirX = camX - pos[0];
-            float dirY = camY - pos[1];
-            float dirZ = camZ - pos[2];
-            
-            yaw   = atan2f(dirX, dirZ) * 180.0f / PI_F;
-            float lenXZ = sqrtf(dirX*dirX + dirZ*dirZ);
-            pitch = atan2f(dirY, lenXZ) * 180.0f / PI_F;
-            
-            mu.rotate(gmu::MODEL, yaw, 0.0f, 1.0f, 0.0f);
-            mu.rotate(gmu::MODEL, pitch, 1.0f, 0.0f, 0.0f);
-            mu.rotate(gmu::MODEL, roll, 0.0f, 0.0f, 1.0f);
-            mu.scale(gmu::MODEL, scale[0], scale[1], scale[2]);
-
-            mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
-            mu.computeNormalMatrix3x3();
-
-            for (int mID : meshID)
-            {
-                dataMesh data;
-                data.meshID = mID;
-                data.texMode = texMode;
-                data.vm = mu.get(gmu::VIEW_MODEL);
-                data.pvm = mu.get(gmu::PROJ_VIEW_MODEL);
-                data.normal = mu.getNormalMatrix();
-
-                renderer.renderMesh(data);
-            }
-
-            mu.popMatrix(gmu::MODEL);
-    }
 };
@@ -0,0 +1,57 @@
+#include <algorithm>
+#include <cstring>
+#include "renderQueue.h"
+
+const char *const renderPassNames[(int)RenderPass::Count] = {
+	"shadow map", "spot shadow", "rear view", "reflection", "planar shadow", "main", "overlay"};
+
+uint64_t RenderQueue::makeKey(const DrawItem &item, uint32_t sequence)
+{
+	uint64_t key = (uint64_t)((int)item.pass & 0xF) << 60;
+	sequence &= 0xFFFFFF;
+
+	if (item.blended)
+		return key | (1ull << 59) | sequence;
+
+	key |= (uint64_t)(item.texMode & 0xFF) << 51;
+	key |= (uint64_t)(item.meshID & 0xFFFF) << 35;
+	key |= (uint64_t)(item.matSlot & 0x7FF) << 24;
+	return key | sequence;
+}
+
+void RenderQueue::submit(DrawItem &item)
+{
+	item.key = makeKey(item, (uint32_t)items.size());
+	items.push_back(item);
+}
+
+void RenderQueue::sort()
+{
+	// sort (key, index) pairs, then copy each ~170 byte item once into place, instead of swapping items while sorting
+	order.clear();
+	for (size_t i = 0; i < items.size(); i++)
+		order.push_back({items[i].key, (uint32_t)i});
+	std::sort(order.begin(), order.end());
+
+	sorted.clear();
+	for (auto &o : order)
+		sorted.push_back(items[o.second]);
+	items.swap(sorted);
+}
+
+int RenderQueue::addProjection(const float *proj)
+{
+	if (!projections.empty() && memcmp(projections.back().data(), proj, 16 * sizeof(float)) == 0)
+		return (int)projections.size() - 1;
+
+	std::array<float, 16> m;
+	memcpy(m.data(), proj, 16 * sizeof(float));
+	projections.push_back(m);
+	return (int)projections.size() - 1;
+}
+
+void RenderQueue::clear()
+{
+	items.clear();
+	projections.clear();
+}
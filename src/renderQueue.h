@@ -0,0 +1,65 @@
+#pragma once
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <utility>
+
+// Passes of a frame, in the order renderSim draws them. Items are counted per pass.
+enum class RenderPass
+{
+	ShadowMap,	// depth only, once per cascade of the sun
+	SpotShadow, // depth only, the spot light tiles of the shadow atlas
+	RearView,
+	Reflection,
+	Shadow,
+	Main,
+	Overlay,
+	Count
+};
+
+extern const char *const renderPassNames[(int)RenderPass::Count];
+
+// A mesh draw captured at submission time, executed later by Renderer::flush
+struct DrawItem
+{
+	uint64_t key = 0;
+	int meshID = 0;
+	int texMode = 0;	// already resolved (never negative)
+	int matSlot = 0;	// slot in the material UBO
+	int projIndex = 0;	// projection matrix, see RenderQueue::addProjection
+	RenderPass pass = RenderPass::Main;
+	bool blended = false; // drawn after the opaque items, keeping submission order
+	float vm[16];
+	float tint[4];
+};
+
+/*
+ * Draw items are sorted by a 64-bit key, most significant bits first:
+ *   63..60 pass | 59 blended | 58..51 texMode | 50..35 mesh | 34..24 material | 23..0 sequence
+ * texMode selects the mesh program, the most expensive state change, so it sorts first.
+ * Blended items skip the state bits so they keep the (back to front) order they were submitted in.
+ * Consecutive items sharing mesh, texMode, material and projection end up in one instanced draw.
+ */
+class RenderQueue
+{
+public:
+	void submit(DrawItem &item);
+	void sort();
+	void clear();
+
+	// items only keep an index: a flush rarely sees more than one projection
+	int addProjection(const float *proj);
+	const float *getProjection(int index) const { return projections[index].data(); }
+
+	bool empty() const { return items.empty(); }
+	const std::vector<DrawItem> &getItems() const { return items; }
+
+	static uint64_t makeKey(const DrawItem &item, uint32_t sequence);
+
+private:
+	std::vector<DrawItem> items;
+	// scratch of sort, kept so they keep their capacity across flushes
+	std::vector<std::pair<uint64_t, uint32_t>> order;
+	std::vector<DrawItem> sorted;
+	std::vector<std::array<float, 16>> projections;
+};
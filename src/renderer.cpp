@@ -8,9 +8,14 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <cmath>
 #include "renderer.h"
 #include "mathUtility.h"
 #include "shader.h"
+#include "geometryPool.h"
 
 #define STB_RECT_PACK_IMPLEMENTATION
 #define STB_TRUETYPE_IMPLEMENTATION
@@ -18,7 +23,205 @@
 #include "stb_rect_pack.h"
 #include "stb_truetype.h"
 
-Renderer::Renderer() {}
+Renderer::Renderer()
+{
+    // the reflection and the mirror are small or blurred: they skip what would cover only a few of their pixels
+    minProjectedSize[(int)RenderPass::Reflection] = 0.02f;
+    minProjectedSize[(int)RenderPass::RearView] = 0.04f;
+
+    // and take coarser levels of detail
+    for (float &bias : lodBias)
+        bias = 1.f;
+    lodBias[(int)RenderPass::Reflection] = 0.5f;
+    lodBias[(int)RenderPass::RearView] = 0.5f;
+}
+
+int Renderer::addMesh(const MyMesh &mesh)
+{
+    int id = nextMeshID++;
+    meshRegistry[id] = mesh;
+    meshRegistry[id].matSlot = addMaterial(mesh.mat);
+    boundVAO = 0; // the mesh builders leave VAO 0 bound
+    if (mesh.vao != instanceAttribVAO)
+    {
+        // all the pool meshes share one VAO, so this runs once
+        setupInstanceAttribs(mesh.vao);
+        instanceAttribVAO = mesh.vao;
+    }
+
+    std::vector<int> chain;
+    for (MyMesh lod : mesh.lods)
+    {
+        lod.mat = mesh.mat;
+        lod.lods.clear();
+        chain.push_back(addMesh(lod));
+    }
+    if (!chain.empty())
+    {
+        meshRegistry[id].lods.clear(); // the chain holds them now
+        lodChains[id] = chain;
+    }
+    return id;
+}
+
+void Renderer::setupInstanceAttribs(GLuint vao)
+{
+    if (instanceVBO == 0)
+    {
+        instanceStream.init(GL_ARRAY_BUFFER, INSTANCE_STREAM_SIZE);
+        instanceVBO = instanceStream.buffer();
+    }
+
+    bindVAO(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+
+    // a mat4 attribute is fed as 4 consecutive vec4 columns
+    for (int col = 0; col < 4; col++)
+    {
+        GLuint loc = Shader::INSTANCE_VIEWMODEL_ATTRIB + col;
+        glEnableVertexAttribArray(loc);
+        glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                              (void *)(offsetof(InstanceData, viewModel) + col * 4 * sizeof(float)));
+        glVertexAttribDivisor(loc, 1);
+    }
+    glEnableVertexAttribArray(Shader::INSTANCE_TINT_ATTRIB);
+    glVertexAttribPointer(Shader::INSTANCE_TINT_ATTRIB, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                          (void *)offsetof(InstanceData, tint));
+    glVertexAttribDivisor(Shader::INSTANCE_TINT_ATTRIB, 1);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+int Renderer::addMaterial(const Material &mat)
+{
+    MaterialBlock block{};
+    memcpy(block.diffuse, mat.diffuse, sizeof(block.diffuse));
+    memcpy(block.ambient, mat.ambient, sizeof(block.ambient));
+    memcpy(block.specular, mat.specular, sizeof(block.specular));
+    memcpy(block.emissive, mat.emissive, sizeof(block.emissive));
+    block.shininess = mat.shininess;
+    return addMaterialBlock(block);
+}
+
+int Renderer::addMaterialBlock(const MaterialBlock &block)
+{
+    // meshes sharing the same material share the same slot
+    for (size_t i = 0; i < materialSlots.size(); i++)
+    {
+        if (memcmp(&materialSlots[i], &block, sizeof(MaterialBlock)) == 0)
+            return (int)i;
+    }
+
+    materialSlots.push_back(block);
+    materialsDirty = true;
+    return (int)materialSlots.size() - 1;
+}
+
+int Renderer::layeredMaterial(int slot, int texLayer, int normalLayer)
+{
+    if (texLayer == 0 && normalLayer == 0)
+        return slot;
+
+    uint64_t key = ((uint64_t)slot << 32) | ((uint64_t)(texLayer & 0xFFFF) << 16) | (uint64_t)(normalLayer & 0xFFFF);
+    auto it = layeredSlots.find(key);
+    if (it != layeredSlots.end())
+        return it->second;
+
+    // first draw of this material with these layers: a new slot, uploaded with the next bindMaterial
+    MaterialBlock block = materialSlots[slot];
+    block.texLayer = texLayer;
+    block.normalLayer = normalLayer;
+    int layered = addMaterialBlock(block);
+    layeredSlots[key] = layered;
+    return layered;
+}
+
+void Renderer::uploadMaterials()
+{
+    // each slot must start at a multiple of the UBO offset alignment to be bound with glBindBufferRange
+    GLint align = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    materialStride = (GLint)((sizeof(MaterialBlock) + align - 1) / align) * align;
+
+    std::vector<uint8_t> data(materialStride * materialSlots.size());
+    for (size_t i = 0; i < materialSlots.size(); i++)
+        memcpy(&data[i * materialStride], &materialSlots[i], sizeof(MaterialBlock));
+
+    if (!materialUBO)
+        glGenBuffers(1, &materialUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, materialUBO);
+    glBufferData(GL_UNIFORM_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    materialsDirty = false;
+    boundMaterial = -1;
+}
+
+void Renderer::bindMaterial(int slot)
+{
+    if (materialsDirty)
+        uploadMaterials();
+    if (slot == boundMaterial)
+        return;
+
+    glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_UBO_BINDING, materialUBO, slot * materialStride, sizeof(MaterialBlock));
+    boundMaterial = slot;
+    passStat().materialBinds++;
+}
+
+RenderStats Renderer::getTotalStats() const
+{
+    RenderStats total;
+    for (const auto &st : passStats)
+        total.add(st);
+    return total;
+}
+
+void Renderer::resetStats()
+{
+    for (auto &st : passStats)
+        st = RenderStats{};
+}
+
+void Renderer::useProgram(GLuint prog)
+{
+    passStat().unsortedProgramBinds++;
+    if (prog == boundProgram)
+        return;
+    glUseProgram(prog);
+    boundProgram = prog;
+    passStat().programBinds++;
+}
+
+void Renderer::bindVAO(GLuint vao)
+{
+    if (vao == boundVAO)
+        return;
+    glBindVertexArray(vao);
+    boundVAO = vao;
+    passStat().vaoBinds++;
+}
+
+void Renderer::bindTexture(int unit, GLenum target, GLuint texId)
+{
+    passStat().unsortedTextureBinds++;
+    if (unit < MAX_CACHED_TEXTURE_UNITS && boundTextures[unit] == texId)
+        return;
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(target, texId);
+    if (unit < MAX_CACHED_TEXTURE_UNITS)
+        boundTextures[unit] = texId;
+    passStat().textureBinds++;
+}
+
+void Renderer::invalidateStateCache()
+{
+    boundProgram = 0;
+    boundVAO = 0;
+    boundMaterial = -1;
+    for (auto &tex : boundTextures)
+        tex = 0;
+}
 
 bool Renderer::truetypeInit(const std::string &fontFile)
 {
@@ -53,188 +256,332 @@ bool Renderer::truetypeInit(const std::string &fontFile)
 
     inputStream.close();
 
-    constexpr auto TEX_SIZE = 1024; // Font atlast width and height
-    uint8_t *fontAtlasTextureData = new uint8_t[TEX_SIZE * TEX_SIZE];
-    // auto pixels = std::make_unique<uint8_t[]>(TEX_SIZE * TEX_SIZE);
+    // Signed distance field glyphs: each texel holds the distance to the glyph outline, 0.5 on the edge, so
+    // bilinear filtering keeps edges sharp at any scale (ttf.frag) from glyphs rasterized at a small pixel size.
+    // They are rasterized on first use (glyph) into the pages of the atlas; ASCII is done now, the rest as met
+    font.size = 128.f;     // the size the text sizes are relative to, as with the former 128 px atlas
+    font.pixelSize = 48.f; // rasterized size
+    font.scale = stbtt_ScaleForPixelHeight(&font.info, font.pixelSize);
+    for (uint32_t codepoint = 33; codepoint < 127; codepoint++)
+        glyph(codepoint);
+    printf("Font atlas: %zu glyphs in %zu page(s)\n", font.glyphs.size(), font.pages.size());
+
+    // configure VAO/VBO for char (glyph) texture aligned quads, all the queued text in one buffer (flushText)
+    // -----------------------------------
+    glGenVertexArrays(1, &textVAO);
+    glGenBuffers(1, &textIBO);
+    textStream.init(GL_ARRAY_BUFFER, TEXT_STREAM_SIZE);
+    textVBO = textStream.buffer();
+    setupTextAttribs();
+
+    // index buffer, filled by flushText
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, textIBO);
+    bindVAO(0);
+
+    return true;
+}
+
+void Renderer::setupTextAttribs()
+{
+    // each vertex has 9 floats: (vec2 pos, vec2 tex), the text color and the atlas page
+    bindVAO(textVAO);
+    glBindBuffer(GL_ARRAY_BUFFER, textVBO);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, TEXT_VERTEX_FLOATS * sizeof(float), 0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, TEXT_VERTEX_FLOATS * sizeof(float), (void *)(4 * sizeof(float)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, TEXT_VERTEX_FLOATS * sizeof(float), (void *)(8 * sizeof(float)));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+const Renderer::Glyph &Renderer::glyph(uint32_t codepoint)
+{
+    auto found = font.glyphs.find(codepoint);
+    if (found != font.glyphs.end())
+        return found->second;
+
+    constexpr uint32_t MISSING_GLYPH = 0xFFFFFFFF; // not a code point: the key of the font's missing glyph
+    constexpr int SDF_PADDING = 6; // pixels of distance kept around each glyph
+    constexpr unsigned char SDF_ON_EDGE = 128;
 
-    stbtt_pack_context pack_context;
-    if (!stbtt_PackBegin(&pack_context, fontAtlasTextureData, TEX_SIZE, TEX_SIZE, 0, 1, nullptr))
+    // all the code points the font lacks draw its glyph 0, rasterized and cached once
+    int index = stbtt_FindGlyphIndex(&font.info, (int)codepoint);
+    if (index == 0)
     {
-        std::cerr << "Failed to start font packing\n";
-        return false;
+        codepoint = MISSING_GLYPH;
+        found = font.glyphs.find(codepoint);
+        if (found != font.glyphs.end())
+            return found->second;
     }
 
-    font.size = 128.f;
-    stbtt_pack_range range{
-        font.size,
-        32,
-        nullptr,
-        96,
-        font.packedChars,
-        0, 0};
+    int advance, leftSideBearing, width = 0, height = 0, xoff = 0, yoff = 0;
+    stbtt_GetGlyphHMetrics(&font.info, index, &advance, &leftSideBearing);
+    unsigned char *sdf = stbtt_GetGlyphSDF(&font.info, font.scale, index, SDF_PADDING, SDF_ON_EDGE,
+                                           (float)SDF_ON_EDGE / SDF_PADDING, &width, &height, &xoff, &yoff);
+
+    Glyph &g = font.glyphs[codepoint];
+    g.xoff = (float)xoff;
+    g.yoff2 = (float)(yoff + height);
+    g.xadvance = advance * font.scale;
+    g.width = (float)width;
+    g.height = (float)height;
+    if (!sdf || width + 1 > FONT_PAGE_SIZE || height + 1 > FONT_PAGE_SIZE) // nothing to draw (e.g. a space), or too large
+    {
+        stbtt_FreeSDF(sdf, nullptr);
+        g.width = g.height = 0.f;
+        return g;
+    }
 
-    if (!stbtt_PackFontRanges(&pack_context, fontDataBuf, 0, &range, 1))
+    // skyline packing into the last page, with a texel of gap; a new page when it is full
+    stbrp_rect rect{};
+    rect.w = width + 1;
+    rect.h = height + 1;
+    bool newPage = font.pages.empty() || !stbrp_pack_rects(&font.packer, &rect, 1);
+    if (newPage)
     {
-        std::cerr << "Failed to pack font ranges\n";
-        return false;
+        font.pages.emplace_back(FONT_PAGE_SIZE * FONT_PAGE_SIZE, 0);
+        font.packerNodes.resize(FONT_PAGE_SIZE);
+        stbrp_init_target(&font.packer, FONT_PAGE_SIZE, FONT_PAGE_SIZE, font.packerNodes.data(), FONT_PAGE_SIZE);
+        stbrp_pack_rects(&font.packer, &rect, 1);
     }
 
-    stbtt_PackEnd(&pack_context);
+    int page = (int)font.pages.size() - 1;
+    std::vector<uint8_t> &pixels = font.pages[page];
+    for (int row = 0; row < height; row++)
+        memcpy(&pixels[(rect.y + row) * FONT_PAGE_SIZE + rect.x], sdf + row * width, width);
 
-    for (int i = 0; i < 96; i++)
-    {
-        float unusedX = 0, unusedY = 0;
+    g.page = page;
+    g.s0 = (float)rect.x / FONT_PAGE_SIZE;
+    g.t0 = (float)rect.y / FONT_PAGE_SIZE;
+    g.s1 = (float)(rect.x + width) / FONT_PAGE_SIZE;
+    g.t1 = (float)(rect.y + height) / FONT_PAGE_SIZE;
 
-        stbtt_GetPackedQuad(
-            font.packedChars,      // Array of stbtt_packedchar
-            TEX_SIZE,              // Width of the font atlas texture
-            TEX_SIZE,              // Height of the font atlas texture
-            i,                     // Index of the glyph
-            &unusedX, &unusedY,    // current position of the glyph in screen pixel coordinates, (not required as we have a different coordinate system)
-            &font.alignedQuads[i], // stbtt_alligned_quad struct. (this struct mainly consists of the texture coordinates)
-            0                      // Allign X and Y position to a integer (doesn't matter because we are not using 'unusedX' and 'unusedY')
-        );
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (newPage)
+    {
+        // a texture array cannot grow: a new one with a layer more, filled from the pages kept in memory
+        GLuint texture;
+        glGenTextures(1, &texture);
+        bindTexture(FONT_UNIT, GL_TEXTURE_2D_ARRAY, texture);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8, FONT_PAGE_SIZE, FONT_PAGE_SIZE, (GLsizei)font.pages.size(), 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+        for (size_t layer = 0; layer < font.pages.size(); layer++)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, (GLint)layer, FONT_PAGE_SIZE, FONT_PAGE_SIZE, 1, GL_RED, GL_UNSIGNED_BYTE, font.pages[layer].data());
+        glDeleteTextures(1, &font.textureId);
+        font.textureId = texture;
+    }
+    else
+    {
+        // only the new glyph
+        bindTexture(FONT_UNIT, GL_TEXTURE_2D_ARRAY, font.textureId);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, rect.x, rect.y, page, width, height, 1, GL_RED, GL_UNSIGNED_BYTE, sdf);
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 
-    // each glyph quad texture needs just one color channel: 0 in background and 1 for the actual character pixels. Use it for alpha blending
-    // It creates a texture object in TexObjArray for storing the fontAtlasTexture
-    TexObjArray.texture2D_Loader(TEX_SIZE, TEX_SIZE, fontAtlasTextureData);
-    GLuint texID_loc = TexObjArray.getNumTextureObjects() - 1; // position of font atlas textureObj in the textureArray;
-    printf("The texture object #%d stores fontAtlasTexture\n", texID_loc + 1);
-    font.textureId = TexObjArray.getTextureId(texID_loc);
+    stbtt_FreeSDF(sdf, nullptr);
+    return g;
+}
 
-    // configure VAO/VBO for char (glyph) texture aligned quads
-    // each vertex will have just the Position attribute containing 4 floats: (vec2 pos, vec2 tex)
-    // -----------------------------------
-    glGenVertexArrays(1, &textVAO);
-    glGenBuffers(2, textVBO);
-    glBindVertexArray(textVAO);
-    glBindBuffer(GL_ARRAY_BUFFER, textVBO[0]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 16, nullptr, GL_DYNAMIC_DRAW);
+// the code point starting at text[i], advancing i past it; malformed sequences decode to U+FFFD, and so do
+// overlong forms, surrogates and values past U+10FFFF, which are not valid UTF-8
+static uint32_t decodeUtf8(const std::string &text, size_t &i)
+{
+    unsigned char lead = (unsigned char)text[i++];
+    if (lead < 0x80)
+        return lead;
+
+    int continuation;
+    uint32_t codepoint, smallest; // smallest: what needs this many bytes
+    if ((lead & 0xE0) == 0xC0)
+        continuation = 1, codepoint = lead & 0x1F, smallest = 0x80;
+    else if ((lead & 0xF0) == 0xE0)
+        continuation = 2, codepoint = lead & 0x0F, smallest = 0x800;
+    else if ((lead & 0xF8) == 0xF0)
+        continuation = 3, codepoint = lead & 0x07, smallest = 0x10000;
+    else
+        return 0xFFFD;
+
+    for (int k = 0; k < continuation; k++)
+    {
+        if (i >= text.size() || ((unsigned char)text[i] & 0xC0) != 0x80)
+            return 0xFFFD;
+        codepoint = (codepoint << 6) | ((unsigned char)text[i++] & 0x3F);
+    }
+    if (codepoint < smallest || (codepoint >= 0xD800 && codepoint <= 0xDFFF) || codepoint > 0x10FFFF)
+        return 0xFFFD;
+    return codepoint;
+}
 
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
+uint32_t Renderer::meshFeatureKey(int texMode)
+{
+    // features each texMode needs, see mesh.frag
+    static const uint32_t texModeFeatures[MESH_TEX_MODES] = {
+        0,                                                         // 0 shadow: flat black
+        MESH_LIGHTING | MESH_REFLECTION | MESH_FOG | MESH_TINT,    // 1 floor grass
+        MESH_LIGHTING | MESH_NORMAL_MAP | MESH_FOG | MESH_TINT,    // 2 stone
+        MESH_LIGHTING | MESH_FOG | MESH_TINT,                      // 3 window
+        MESH_LIGHTING | MESH_ALPHA_TEST | MESH_FOG | MESH_TINT,    // 4 billboard grass
+        MESH_LIGHTING | MESH_ALPHA_TEST | MESH_FOG | MESH_TINT,    // 5 billboard tree
+        MESH_LIGHTING | MESH_FOG | MESH_TINT,                      // 6 lightwood
+        MESH_ALPHA_TEST | MESH_FOG | MESH_TINT,                    // 7 particle
+        MESH_ALPHA_TEST | MESH_TINT,                               // 8 flare
+        MESH_ALPHA_TEST | MESH_TINT,                               // 9..12 former per texture flare modes, same as 8
+        MESH_ALPHA_TEST | MESH_TINT,
+        MESH_ALPHA_TEST | MESH_TINT,
+        MESH_ALPHA_TEST | MESH_TINT,
+        MESH_ENV_MAP | MESH_TINT,                                  // 13 skybox reflection
+        MESH_ALPHA_TEST,                                           // 14 billboard tree shadow
+        0,                                                         // 15 rear view mirror
+        MESH_LIGHTING | MESH_ALPHA_TEST | MESH_FOG | MESH_TINT,    // 16 impostor card
+        MESH_ALPHA_TEST,                                           // 17 impostor bake: billboard tree, unlit
+    };
 
-    // index buffer
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, textVBO[1]);
-    GLuint quadFaceIndex[] = {0, 1, 2, 2, 3, 0};
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(quadFaceIndex), quadFaceIndex, GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+    // the texture now comes from the material layer, so modes differing only by texture share a program
+    if (texMode >= 9 && texMode <= 12)
+        texMode = 8;
+    uint32_t features = texMode < MESH_TEX_MODES ? texModeFeatures[texMode] : 0;
+    return ((uint32_t)texMode << 8) | features;
+}
 
-    return true;
+std::string Renderer::meshDefines(uint32_t key)
+{
+    static const char *names[] = {"LIGHTING", "NORMAL_MAP", "ENV_MAP", "ALPHA_TEST", "FOG", "TINT", "REFLECTION"};
+
+    std::string defines = "#define TEX_MODE " + std::to_string(key >> 8) + "\n";
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+        if (key & (1u << i))
+            defines += std::string("#define ") + names[i] + "\n";
+    return defines;
 }
 
 bool Renderer::setRenderMeshesShaderProg(const std::string &vertShaderPath, const std::string &fragShaderPath)
+{
+    meshVertPath = vertShaderPath;
+    meshFragPath = fragShaderPath;
+
+    // the permutations of the texModes in use are built up front; any other is compiled on its first draw
+    bool ok = true;
+    for (int texMode = 0; texMode < MESH_TEX_MODES; texMode++)
+        ok &= getMeshProgram(texMode).program != 0;
+    return ok;
+}
+
+Renderer::MeshProgram &Renderer::getMeshProgram(int texMode)
+{
+    uint32_t key = meshFeatureKey(texMode);
+    auto it = meshPrograms.find(key);
+    if (it != meshPrograms.end())
+        return it->second;
+
+    MeshProgram &mp = meshPrograms[key];
+    if (!buildMeshProgram(key, mp))
+        printf("GLSL Model Program Not Valid! (%s)\n", meshDefines(key).c_str());
+    return mp;
+}
+
+bool Renderer::buildMeshProgram(uint32_t key, MeshProgram &mp)
 {
     // Shader for models
+    std::string defines = meshDefines(key);
     Shader shader;
     shader.init();
-    program = shader.getProgramIndex();
-    shader.compileShader(Shader::VERTEX_SHADER, vertShaderPath);
-    shader.compileShader(Shader::FRAGMENT_SHADER, fragShaderPath);
+    GLuint program = shader.getProgramIndex();
+    shader.compileShader(Shader::VERTEX_SHADER, meshVertPath, defines);
+    shader.compileShader(Shader::FRAGMENT_SHADER, meshFragPath, defines);
 
     // set semantics for the shader variables
     glBindFragDataLocation(program, 0, "colorOut");
     glBindAttribLocation(program, Shader::VERTEX_COORD_ATTRIB, "position");
     glBindAttribLocation(program, Shader::NORMAL_ATTRIB, "normal");
     glBindAttribLocation(program, Shader::TEXTURE_COORD_ATTRIB, "texCoord");
+    glBindAttribLocation(program, Shader::TANGENT_ATTRIB, "tangent");
+    glBindAttribLocation(program, Shader::INSTANCE_TINT_ATTRIB, "instanceTint");
+    glBindAttribLocation(program, Shader::INSTANCE_VIEWMODEL_ATTRIB, "instanceViewModel");
 
     glLinkProgram(program);
+    if (!shader.isProgramLinked())
+        printf("InfoLog for Model Shaders and Program\n%s\n\n", shader.getAllInfoLogs().c_str());
+    mp.program = program;
+
+    mp.proj_loc = glGetUniformLocation(program, "m_projection");
+    mp.fogColor_loc = glGetUniformLocation(program, "fogColor");
+    mp.clusterViewport_loc = glGetUniformLocation(program, "clusterViewport");
+    mp.clusterDepth_loc = glGetUniformLocation(program, "clusterDepth");
+    mp.shadowMatrices_loc = glGetUniformLocation(program, "shadowMatrices");
+    mp.shadowsOn_loc = glGetUniformLocation(program, "shadowsOn");
+    mp.spotShadowMatrices_loc = glGetUniformLocation(program, "spotShadowMatrices");
+    mp.spotShadowTiles_loc = glGetUniformLocation(program, "spotShadowTiles");
+    mp.reflectionViewport_loc = glGetUniformLocation(program, "reflectionViewport");
+
+    // each texture array has a fixed texture unit, so the sampler uniforms are set once here.
+    // A permutation only declares the array it reads, the other locations are -1 and ignored
+    static const char *samplers[(int)TexArray::Count] = {"surfaceTextures", "billboardTextures", "spriteTextures"};
+    useProgram(program);
+    for (int i = 0; i < (int)(sizeof(samplers) / sizeof(samplers[0])); i++)
+        glUniform1i(glGetUniformLocation(program, samplers[i]), i);
+
+    GLuint materialBlock = glGetUniformBlockIndex(program, "Material");
+    if (materialBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, materialBlock, MATERIAL_UBO_BINDING);
+
+    GLuint lightsBlock = glGetUniformBlockIndex(program, "Lights");
+    if (lightsBlock != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, lightsBlock, LIGHT_UBO_BINDING);
+
+    // point and spot lights are read from texture buffers, binned per view by binLights
+    glUniform1i(glGetUniformLocation(program, "lightData"), LIGHT_DATA_UNIT);
+    glUniform1i(glGetUniformLocation(program, "clusterData"), CLUSTER_DATA_UNIT);
+    glUniform1i(glGetUniformLocation(program, "lightIndices"), LIGHT_INDEX_UNIT);
+    glUniform1i(glGetUniformLocation(program, "shadowMap"), SHADOW_MAP_UNIT);
+    glUniform1i(glGetUniformLocation(program, "spotShadowAtlas"), SPOT_SHADOW_UNIT);
+    glUniform1i(glGetUniformLocation(program, "reflectionTexture"), REFLECTION_UNIT);
+    glUniform1i(glGetUniformLocation(program, "mirrorTexture"), MIRROR_UNIT);
+    glUniform1i(glGetUniformLocation(program, "impostorTextures"), IMPOSTOR_UNIT);
+    glUniform1i(glGetUniformLocation(program, "skybox"), SKYBOX_UNIT);
+
+    // validated once the samplers point at their own units
+    return (shader.isProgramLinked() && shader.isProgramValid());
+}
 
-    printf("InfoLog for Model Shaders and Program\n%s\n\n", shader.getAllInfoLogs().c_str());
-    if (!shader.isProgramValid())
-        printf("GLSL Model Program Not Valid!\n");
-
-    pvm_loc = glGetUniformLocation(program, "m_pvm");
-    vm_loc = glGetUniformLocation(program, "m_viewModel");
-    normal_loc = glGetUniformLocation(program, "m_normal");
-    texMode_loc = glGetUniformLocation(program, "texMode"); // different modes of texturing
-
-    tex_loc[0] = glGetUniformLocation(program, "texmap_stone");
-    tex_loc[1] = glGetUniformLocation(program, "texmap_grass");
-    tex_loc[2] = glGetUniformLocation(program, "texmap_window");
-    tex_loc[3] = glGetUniformLocation(program, "texmap_bbgrass");
-    tex_loc[4] = glGetUniformLocation(program, "texmap_bbtree");
-    tex_loc[5] = glGetUniformLocation(program, "texmap_lightwood");
-    tex_loc[6] = glGetUniformLocation(program, "texmap_particle");
-    tex_loc[7] = glGetUniformLocation(program, "texmap_normal");
-    tex_loc[8] = glGetUniformLocation(program, "texmap_crcl");
-    tex_loc[9] = glGetUniformLocation(program, "texmap_flar");
-    tex_loc[10] = glGetUniformLocation(program, "texmap_hxgn");
-    tex_loc[11] = glGetUniformLocation(program, "texmap_ring");
-    tex_loc[12] = glGetUniformLocation(program, "texmap_sun");
-
-    fogColor_loc = glGetUniformLocation(program, "fogColor");
-
-    directionalLight_loc.color = glGetUniformLocation(program, "directionalLight.base.color");
-    directionalLight_loc.ambient = glGetUniformLocation(program, "directionalLight.base.ambientIntensity");
-    directionalLight_loc.diffuse = glGetUniformLocation(program, "directionalLight.base.diffuseIntensity");
-    directionalLight_loc.direction = glGetUniformLocation(program, "directionalLight.direction");
-    directionalLightToggle_loc = glGetUniformLocation(program, "directionalLightToggle");
-
-    pointLightNum_loc = glGetUniformLocation(program, "pointLightNum");
-    spotLightNum_loc = glGetUniformLocation(program, "spotLightNum");
-
-    for (int i = 0; i < MAX_POINT_LIGHTS; i++)
+void Renderer::syncMeshProgram(MeshProgram &mp)
+{
+    RenderStats &st = passStat();
+    if (mp.fogSerial != fogSerial)
     {
-        char name[64];
-        memset(name, 0, sizeof(name));
-        snprintf(name, sizeof(name), "pointLightArray[%d].base.color", i);
-        pointLight_loc[i].color = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "pointLightArray[%d].base.ambientIntensity", i);
-        pointLight_loc[i].ambient = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "pointLightArray[%d].base.diffuseIntensity", i);
-        pointLight_loc[i].diffuse = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "pointLightArray[%d].position", i);
-        pointLight_loc[i].position = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "pointLightArray[%d].constant", i);
-        pointLight_loc[i].attConstant = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "pointLightArray[%d].linear", i);
-        pointLight_loc[i].attLinear = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "pointLightArray[%d].exponential", i);
-        pointLight_loc[i].attExp = glGetUniformLocation(program, name);
+        glUniform4fv(mp.fogColor_loc, 1, fogColor);
+        mp.fogSerial = fogSerial;
+        st.uniformUploads += mp.fogColor_loc >= 0;
     }
-
-    for (int i = 0; i < MAX_SPOT_LIGHTS; i++)
+    if (mp.clusterSerial != clusterSerial && mp.clusterViewport_loc >= 0)
     {
-        char name[64];
-        memset(name, 0, sizeof(name));
-        snprintf(name, sizeof(name), "spotLightArray[%d].base.base.color", i);
-        spotLight_loc[i].color = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "spotLightArray[%d].base.base.ambientIntensity", i);
-        spotLight_loc[i].ambient = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "spotLightArray[%d].base.base.diffuseIntensity", i);
-        spotLight_loc[i].diffuse = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "spotLightArray[%d].base.position", i);
-        spotLight_loc[i].position = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "spotLightArray[%d].base.constant", i);
-        spotLight_loc[i].attConstant = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "spotLightArray[%d].base.linear", i);
-        spotLight_loc[i].attLinear = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "spotLightArray[%d].base.exponential", i);
-        spotLight_loc[i].attExp = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "spotLightArray[%d].direction", i);
-        spotLight_loc[i].direction = glGetUniformLocation(program, name);
-
-        snprintf(name, sizeof(name), "spotLightArray[%d].cutoff", i);
-        spotLight_loc[i].cutoff = glGetUniformLocation(program, name);
+        glUniform4fv(mp.clusterViewport_loc, 1, clusterViewport);
+        glUniform4fv(mp.clusterDepth_loc, 1, clusterDepth);
+        mp.clusterSerial = clusterSerial;
+        st.uniformUploads += 2;
+    }
+    if (mp.shadowSerial != shadowSerial && mp.shadowsOn_loc >= 0)
+    {
+        glUniform1i(mp.shadowsOn_loc, shadowsOn);
+        if (shadowsOn)
+            glUniformMatrix4fv(mp.shadowMatrices_loc, SHADOW_CASCADES, GL_FALSE, &shadowMatrices[0][0]);
+        if (spotShadowCount > 0)
+        {
+            glUniformMatrix4fv(mp.spotShadowMatrices_loc, spotShadowCount, GL_FALSE, &spotShadowMatrices[0][0]);
+            glUniform4fv(mp.spotShadowTiles_loc, spotShadowCount, &spotShadowTiles[0][0]);
+        }
+        mp.shadowSerial = shadowSerial;
+        st.uniformUploads += 1 + shadowsOn + 2 * (spotShadowCount > 0);
+    }
+    if (mp.reflectionSerial != reflectionSerial && mp.reflectionViewport_loc >= 0)
+    {
+        glUniform4fv(mp.reflectionViewport_loc, 1, reflectionViewport);
+        mp.reflectionSerial = reflectionSerial;
+        st.uniformUploads++;
     }
-
-    return (shader.isProgramLinked() && shader.isProgramValid());
 }
 
 bool Renderer::setSkyboxShaderProg(const std::string &vertShaderPath, const std::string &fragShaderPath)
@@ -258,7 +605,8 @@ bool Renderer::setSkyboxShaderProg(const std::string &vertShaderPath, const std:
 
     skyboxprojview_loc = glGetUniformLocation(skyboxProgram, "projview");
     fogColor_skyloc = glGetUniformLocation(skyboxProgram, "fogColor");
-    cubemap_loc = glGetUniformLocation(skyboxProgram, "skybox");
+    useProgram(skyboxProgram);
+    glUniform1i(glGetUniformLocation(skyboxProgram, "skybox"), SKYBOX_UNIT);
 
     float skyboxVert[] = {
         -1.f,
@@ -382,13 +730,57 @@ bool Renderer::setSkyboxShaderProg(const std::string &vertShaderPath, const std:
     return (shader.isProgramLinked() && shader.isProgramValid());
 }
 
+bool Renderer::setShadowShaderProg(const std::string &vertShaderPath, const std::string &fragShaderPath)
+{
+    // depth only: no normals, texture coordinates or materials
+    Shader shader;
+    shader.init();
+    depthProgram = shader.getProgramIndex();
+    shader.compileShader(Shader::VERTEX_SHADER, vertShaderPath);
+    shader.compileShader(Shader::FRAGMENT_SHADER, fragShaderPath);
+
+    glBindAttribLocation(depthProgram, Shader::VERTEX_COORD_ATTRIB, "position");
+    glBindAttribLocation(depthProgram, Shader::INSTANCE_VIEWMODEL_ATTRIB, "instanceViewModel");
+
+    glLinkProgram(depthProgram);
+
+    printf("InfoLog for Shadow Map Shaders and Program\n%s\n\n", shader.getAllInfoLogs().c_str());
+    if (!shader.isProgramValid())
+        printf("GLSL Shadow Map Program Not Valid!\n");
+
+    depthProj_loc = glGetUniformLocation(depthProgram, "m_projection");
+
+    return (shader.isProgramLinked() && shader.isProgramValid());
+}
+
 Renderer::~Renderer()
 {
-    glDeleteProgram(program);
+    for (auto &mp : meshPrograms)
+        glDeleteProgram(mp.second.program);
+    for (auto &group : occlusionGroups)
+        glDeleteQueries(1, &group.query);
     glDeleteProgram(textProgram);
-    for (auto &pair : meshRegistry)
-        glDeleteVertexArrays(1, &(pair.second.vao));
+    glDeleteTextures(1, &font.textureId);
+    glDeleteProgram(depthProgram);
+    glDeleteFramebuffers(1, &shadowFBO);
+    glDeleteTextures(1, &shadowTexture);
+    glDeleteFramebuffers(1, &spotAtlasFBO);
+    glDeleteTextures(1, &spotAtlasTexture);
+    reflectionTarget.release();
+    mirrorTarget.release();
+    glDeleteFramebuffers(1, &impostorFBO);
+    glDeleteTextures(1, &impostorTexture);
+    glDeleteRenderbuffers(1, &impostorDepth);
+    glDeleteBuffers(1, &materialUBO);
+    instanceStream.release();
+    textStream.release();
+    glDeleteBuffers(1, &textIBO);
+    glDeleteBuffers(1, &lightUBO);
+    lightData.release();
+    clusterData.release();
+    lightIndex.release();
     meshRegistry.clear();
+    GeometryPool::getInstance().release();
 }
 
 bool Renderer::setRenderTextShaderProg(const std::string &vertShaderPath, const std::string &fragShaderPath)
@@ -410,191 +802,1599 @@ bool Renderer::setRenderTextShaderProg(const std::string &vertShaderPath, const
     }
 
     fontPvm_loc = glGetUniformLocation(textProgram, "pvm");
-    textColor_loc = glGetUniformLocation(textProgram, "textColor");
 
-    // static font atlas texture binding
-    glUseProgram(textProgram);
-    glActiveTexture(GL_TEXTURE16);
-    glBindTexture(GL_TEXTURE_2D, font.textureId);
-    glUniform1i(glGetUniformLocation(textProgram, "fontAtlasTexture"), 16);
+    useProgram(textProgram);
+    glUniform1i(glGetUniformLocation(textProgram, "fontAtlasTexture"), FONT_UNIT);
 
     return (shader.isProgramLinked() && shader.isProgramValid());
 }
 
 void Renderer::activateRenderMeshesShaderProg()
-{ // GLSL program to draw the meshes
-    glUseProgram(program);
+{
+    // the mesh program of each texMode is bound by flush(); only make sure the next draw rebinds it
+    currentMeshProgram = nullptr;
 }
 
-void Renderer::activateSkyboxShaderProg(float *projview, unsigned int cubemap, float *fogColor)
+void Renderer::setSkybox(GLuint cubemap)
 {
-    // GLSL program to draw the skybox
+    bindTexture(SKYBOX_UNIT, GL_TEXTURE_CUBE_MAP, cubemap);
+}
+
+void Renderer::drawSkybox(float *projview, float *fogColor)
+{
+    // the vertex shader puts it at the far plane: with GL_LEQUAL only the pixels the scene left at the cleared
+    // depth pass, and nothing behind it needs the depth it would write
     glDepthFunc(GL_LEQUAL);
-    glUseProgram(program);
-    glActiveTexture(GL_TEXTURE0 + cubemap);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap);
-    glUniform1i(glGetUniformLocation(program, "skybox"), cubemap);
-    glUseProgram(skyboxProgram);
+    glDepthMask(GL_FALSE);
+    useProgram(skyboxProgram);
     glUniformMatrix4fv(skyboxprojview_loc, 1, GL_FALSE, projview);
-
-    glUniform4fv(fogColor_skyloc, 1, fogColor);
-    glBindVertexArray(skyboxVAO);
-    glActiveTexture(GL_TEXTURE0 + cubemap);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap);
-    glUniform1i(cubemap_loc, cubemap);
+    passStat().uniformUploads++;
+    if (memcmp(skyboxFogColor, fogColor, sizeof(skyboxFogColor)) != 0)
+    {
+        memcpy(skyboxFogColor, fogColor, sizeof(skyboxFogColor));
+        glUniform4fv(fogColor_skyloc, 1, fogColor);
+        passStat().uniformUploads++;
+    }
+    bindVAO(skyboxVAO);
 
     glDrawArrays(GL_TRIANGLES, 0, 36);
-    glBindVertexArray(0);
-    glDepthFunc(GL_LESS);
+    passStat().draws++;
+    glDepthMask(depthWrite ? GL_TRUE : GL_FALSE);
+    glDepthFunc(depthFunc);
 }
 
 void Renderer::resetLights()
 {
-    pointLightCount = 0;
-    spotLightCount = 0;
-    glUniform1i(directionalLightToggle_loc, 0);
-    glUniform1i(pointLightNum_loc, pointLightCount);
-    glUniform1i(spotLightNum_loc, spotLightCount);
+    lights.directionalToggle = 0;
+    localLights.clear();
 }
 
 void Renderer::setFogColor(float *color)
 {
-    glUniform4fv(fogColor_loc, 1, color);
+    // sent to each mesh program the next time it is bound
+    memcpy(fogColor, color, sizeof(fogColor));
+    fogSerial++;
 }
 
 void Renderer::setDirectionalLight(float *color, float ambient, float diffuse, float *direction)
 {
-    glUniform4fv(directionalLight_loc.color, 1, color);
-    glUniform1f(directionalLight_loc.ambient, ambient);
-    glUniform1f(directionalLight_loc.diffuse, diffuse);
-    glUniform4fv(directionalLight_loc.direction, 1, direction);
-    glUniform1i(directionalLightToggle_loc, 1);
+    memcpy(lights.directionalBase.color, color, sizeof(lights.directionalBase.color));
+    lights.directionalBase.ambient = ambient;
+    lights.directionalBase.diffuse = diffuse;
+    memcpy(lights.directionalDirection, direction, sizeof(lights.directionalDirection));
+    lights.directionalToggle = 1;
+}
+
+// distance where color * intensity / attenuation drops under 1/256
+static float lightRadius(const float *color, float ambient, float diffuse, float constant, float linear, float exponential)
+{
+    float intensity = std::max(ambient, diffuse) * std::max(color[0], std::max(color[1], color[2]));
+    float c = constant - intensity * 256.f;
+    if (c >= 0.f)
+        return 0.f;
+    if (exponential > 0.f)
+        return (-linear + std::sqrt(linear * linear - 4.f * exponential * c)) / (2.f * exponential);
+    if (linear > 0.f)
+        return -c / linear;
+    return INFINITY;
 }
 
 void Renderer::setPointLight(float *color, float ambient, float diffuse, float *position,
                              float constant, float linear, float exponential)
 {
-    assert(pointLightCount < MAX_POINT_LIGHTS);
-    glUniform4fv(pointLight_loc[pointLightCount].color, 1, color);
-    glUniform1f(pointLight_loc[pointLightCount].ambient, ambient);
-    glUniform1f(pointLight_loc[pointLightCount].diffuse, diffuse);
-    glUniform4fv(pointLight_loc[pointLightCount].position, 1, position);
-    glUniform1f(pointLight_loc[pointLightCount].attConstant, constant);
-    glUniform1f(pointLight_loc[pointLightCount].attLinear, linear);
-    glUniform1f(pointLight_loc[pointLightCount].attExp, exponential);
-    pointLightCount += 1;
-    glUniform1i(pointLightNum_loc, pointLightCount);
+    LocalLight light{};
+    memcpy(light.color, color, sizeof(light.color));
+    memcpy(light.position, position, sizeof(light.position));
+    light.ambient = ambient;
+    light.diffuse = diffuse;
+    light.constant = constant;
+    light.linear = linear;
+    light.exponential = exponential;
+    light.cutoff = -2.f;
+    light.radius = lightRadius(color, ambient, diffuse, constant, linear, exponential);
+    light.shadow = -1.f;
+    localLights.push_back(light);
 }
 
 void Renderer::setSpotLight(float *color, float ambient, float diffuse, float *direction, float cutoff,
                             float *position, float constant, float linear, float exponential)
 {
-    assert(spotLightCount < MAX_SPOT_LIGHTS);
-    glUniform4fv(spotLight_loc[spotLightCount].color, 1, color);
-    glUniform1f(spotLight_loc[spotLightCount].ambient, ambient);
-    glUniform1f(spotLight_loc[spotLightCount].diffuse, diffuse);
-    glUniform4fv(spotLight_loc[spotLightCount].position, 1, position);
-    glUniform4fv(spotLight_loc[spotLightCount].direction, 1, direction);
-    glUniform1f(spotLight_loc[spotLightCount].cutoff, cutoff);
-    glUniform1f(spotLight_loc[spotLightCount].attConstant, constant);
-    glUniform1f(spotLight_loc[spotLightCount].attLinear, linear);
-    glUniform1f(spotLight_loc[spotLightCount].attExp, exponential);
-    spotLightCount += 1;
-    glUniform1i(spotLightNum_loc, spotLightCount);
+    LocalLight light{};
+    memcpy(light.color, color, sizeof(light.color));
+    memcpy(light.position, position, sizeof(light.position));
+    memcpy(light.direction, direction, sizeof(light.direction));
+    light.ambient = ambient;
+    light.diffuse = diffuse;
+    light.constant = constant;
+    light.linear = linear;
+    light.exponential = exponential;
+    light.cutoff = cutoff;
+    light.radius = lightRadius(color, ambient, diffuse, constant, linear, exponential);
+    light.shadow = -1.f;
+    localLights.push_back(light);
 }
 
-void Renderer::setTexUnit(int tuId, int texObjId)
+// res = m * v, m column major
+static void transformVec4(const float *m, const float *v, float *res)
 {
-    glActiveTexture(GL_TEXTURE0 + tuId);
-    glBindTexture(GL_TEXTURE_2D, TexObjArray.getTextureId(texObjId));
-    glUniform1i(tex_loc[tuId], tuId);
+    for (int i = 0; i < 4; i++)
+        res[i] = m[i] * v[0] + m[4 + i] * v[1] + m[8 + i] * v[2] + m[12 + i] * v[3];
 }
 
-void Renderer::renderMesh(const dataMesh &data)
+void Renderer::setLightView(const float *view, bool mirrorY)
 {
-    GLint loc;
+    // queued draws were submitted under the previous lights
+    flush();
+
+    float m[16];
+    memcpy(m, view, sizeof(m));
+    if (mirrorY)
+    {
+        // view * scale(1, -1, 1)
+        for (int i = 4; i < 8; i++)
+            m[i] = -m[i];
+    }
+
+    viewLights = lights;
+    transformVec4(m, lights.directionalDirection, viewLights.directionalDirection);
+    updateShadowMatrices(m);
 
-    // be aware to activate previously the Model shader program
-    glUniformMatrix4fv(vm_loc, 1, GL_FALSE, data.vm);
-    glUniformMatrix4fv(pvm_loc, 1, GL_FALSE, data.pvm);
-    glUniformMatrix3fv(normal_loc, 1, GL_FALSE, data.normal);
+    viewLocalLights.resize(localLights.size());
+    int spotCount = 0;
+    for (size_t i = 0; i < localLights.size(); i++)
+    {
+        viewLocalLights[i] = localLights[i];
+        transformVec4(m, localLights[i].position, viewLocalLights[i].position);
+        transformVec4(m, localLights[i].direction, viewLocalLights[i].direction);
+        spotCount += localLights[i].cutoff > -1.5f;
+    }
+    lightsDirty = true;
+    clustersDirty = true;
 
-    const auto &mesh = getMesh(data.meshID);
+    // what the per field path sent: 3 counts, 5 uniforms for the sun, 7 per point light and 9 per spot light
+    int pointCount = (int)localLights.size() - spotCount;
+    passStat().unsortedLightUniforms += 3 + 5 * lights.directionalToggle + 7 * pointCount + 9 * spotCount;
+}
 
-    // send the material
-    loc = glGetUniformLocation(program, "mat.ambient");
-    glUniform4fv(loc, 1, mesh.mat.ambient);
-    loc = glGetUniformLocation(program, "mat.diffuse");
-    glUniform4fv(loc, 1, mesh.mat.diffuse);
-    loc = glGetUniformLocation(program, "mat.specular");
-    glUniform4fv(loc, 1, mesh.mat.specular);
-    loc = glGetUniformLocation(program, "mat.emissive");
-    glUniform4fv(loc, 1, mesh.mat.emissive);
-    loc = glGetUniformLocation(program, "mat.shininess");
-    glUniform1f(loc, mesh.mat.shininess);
+static_assert(sizeof(LightsBlock) == 64, "LightsBlock must match the std140 layout of the Lights block");
 
-    // Render mesh
-    int finalTexMode = data.texMode;
-    if (finalTexMode < 0)
+void Renderer::uploadLights()
+{
+    if (lightUBO == 0)
     {
-        finalTexMode = mesh.mat.texCount;
+        glGenBuffers(1, &lightUBO);
+        glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_UBO_BINDING, lightUBO);
     }
-    glUniform1i(texMode_loc, finalTexMode);
 
-    glBindVertexArray(mesh.vao);
-    glDrawElements(mesh.type, mesh.numIndexes, GL_UNSIGNED_INT, nullptr);
-    glBindVertexArray(0);
+    // orphaning the storage keeps the earlier draws of the frame on their own lights
+    glBindBuffer(GL_UNIFORM_BUFFER, lightUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(LightsBlock), &viewLights, GL_STREAM_DRAW);
+    lightsDirty = false;
+
+    passStat().lightUploads++;
+    passStat().lightBytes += sizeof(LightsBlock);
 }
 
-void Renderer::renderText(const TextCommand &text)
+void Renderer::TextureBuffer::upload(const void *data, size_t bytes)
 {
-    glUseProgram(textProgram); // use GLSL program for text rendering
-    glUniformMatrix4fv(fontPvm_loc, 1, GL_FALSE, text.pvm);
-    glUniform4fv(textColor_loc, 1, text.color);
-    glBindVertexArray(textVAO);
+    if (buffer == 0)
+    {
+        glGenBuffers(1, &buffer);
+        glGenTextures(1, &texture);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    // a texture buffer must not be empty
+    glBufferData(GL_TEXTURE_BUFFER, std::max(bytes, (size_t)16), nullptr, GL_STREAM_DRAW);
+    if (bytes > 0)
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes, data);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
 
-    float localPosition[2] = {text.position[0], text.position[1]}; // screen coordinates
+void Renderer::TextureBuffer::release()
+{
+    glDeleteTextures(1, &texture);
+    glDeleteBuffers(1, &buffer);
+    texture = buffer = 0;
+}
+
+// near and far distances of a projection: perspective has m[11] == -1, orthographic m[15] == 1
+static bool projectionDepthRange(const float *proj, float &zNear, float &zFar)
+{
+    bool perspective = proj[11] < -0.5f;
+    if (perspective)
+    {
+        zNear = proj[14] / (proj[10] - 1.f);
+        zFar = proj[14] / (proj[10] + 1.f);
+    }
+    else
+    {
+        zNear = (proj[14] + 1.f) / proj[10];
+        zFar = (proj[14] - 1.f) / proj[10];
+    }
+    return perspective;
+}
+
+void Renderer::binLights(const float *proj)
+{
+    RenderStats &st = passStat();
+    GLint vp[4];
+    glGetIntegerv(GL_VIEWPORT, vp);
+
+    // depth range and slicing of the projection
+    float zNear, zFar, depthScale, depthBias;
+    bool perspective = projectionDepthRange(proj, zNear, zFar);
+    if (perspective)
+    {
+        // slice = log(depth / near) / log(far / near) * CLUSTER_Z
+        depthScale = CLUSTER_Z / std::log(zFar / zNear);
+        depthBias = -std::log(zNear) * depthScale;
+    }
+    else
+    {
+        depthScale = CLUSTER_Z / (zFar - zNear);
+        depthBias = -zNear * depthScale;
+    }
+    auto sliceOf = [&](float depth)
+    {
+        float s = perspective ? std::log(std::max(depth, zNear)) * depthScale + depthBias : depth * depthScale + depthBias;
+        return std::min(CLUSTER_Z - 1, std::max(0, (int)s));
+    };
+
+    // cluster range [x0, x1] x [y0, y1] x [z0, z1] touched by each light's bounding sphere
+    struct Box
+    {
+        int x0, x1, y0, y1, z0, z1;
+    };
+    std::vector<Box> boxes(viewLocalLights.size());
+    std::vector<GLuint> counts(CLUSTER_X * CLUSTER_Y * CLUSTER_Z, 0);
 
-    for (auto ch : text.str)
+    for (size_t i = 0; i < viewLocalLights.size(); i++)
     {
+        const LocalLight &light = viewLocalLights[i];
+        Box &box = boxes[i];
+        box = {0, CLUSTER_X - 1, 0, CLUSTER_Y - 1, 0, CLUSTER_Z - 1};
 
-        if (ch > 32 && ch < 127)
+        if (light.radius <= 0.f)
         {
-            // Retrieve the data that is used to render a glyph of character 'ch'
-            stbtt_packedchar packedChar = font.packedChars[ch - 32];
-            stbtt_aligned_quad alignedQuad = font.alignedQuads[ch - 32];
+            box.x1 = -1; // reaches nothing
+            continue;
+        }
+        if (std::isfinite(light.radius))
+        {
+            const float *p = light.position;
+            float r = light.radius;
+            // the view looks down -z
+            float dMin = -p[2] - r, dMax = -p[2] + r;
+            if (dMax < zNear || dMin > zFar)
+            {
+                box.x1 = -1;
+                continue;
+            }
+            box.z0 = sliceOf(dMin);
+            box.z1 = sliceOf(dMax);
+
+            // project the corners of the sphere's bounding box; any corner behind the eye keeps the full screen
+            bool behind = false;
+            float minX = 1.f, maxX = -1.f, minY = 1.f, maxY = -1.f;
+            for (int c = 0; c < 8 && !behind; c++)
+            {
+                float corner[4] = {p[0] + (c & 1 ? r : -r), p[1] + (c & 2 ? r : -r), p[2] + (c & 4 ? r : -r), 1.f};
+                float clip[4];
+                transformVec4(proj, corner, clip);
+                if (clip[3] <= 1e-4f)
+                {
+                    behind = true;
+                    break;
+                }
+                minX = std::min(minX, clip[0] / clip[3]);
+                maxX = std::max(maxX, clip[0] / clip[3]);
+                minY = std::min(minY, clip[1] / clip[3]);
+                maxY = std::max(maxY, clip[1] / clip[3]);
+            }
+            if (!behind)
+            {
+                if (maxX < -1.f || minX > 1.f || maxY < -1.f || minY > 1.f)
+                {
+                    box.x1 = -1;
+                    continue;
+                }
+                auto tile = [](float ndc, int n)
+                { return std::min(n - 1, std::max(0, (int)((ndc * 0.5f + 0.5f) * n))); };
+                box.x0 = tile(minX, CLUSTER_X);
+                box.x1 = tile(maxX, CLUSTER_X);
+                box.y0 = tile(minY, CLUSTER_Y);
+                box.y1 = tile(maxY, CLUSTER_Y);
+            }
+        }
 
-            // The units of the fields of the above structs are in pixels,
+        for (int z = box.z0; z <= box.z1; z++)
+            for (int y = box.y0; y <= box.y1; y++)
+                for (int x = box.x0; x <= box.x1; x++)
+                    counts[(z * CLUSTER_Y + y) * CLUSTER_X + x]++;
+    }
 
-            float glyphSize[2] = {(float)(packedChar.x1 - packedChar.x0) * text.size, (float)(packedChar.y1 - packedChar.y0) * text.size};
-            float glyphBoundingBoxBottomLeft[2] = {localPosition[0] + (packedChar.xoff * text.size), (localPosition[1] - packedChar.yoff2) * text.size};
+    // (first, count) per cluster, then the indices, cluster by cluster
+    clusterTexels.resize(counts.size() * 2);
+    GLuint total = 0;
+    for (size_t c = 0; c < counts.size(); c++)
+    {
+        clusterTexels[c * 2] = total;
+        clusterTexels[c * 2 + 1] = 0;
+        total += counts[c];
+    }
+    lightIndexTexels.resize(total);
+    for (size_t i = 0; i < boxes.size(); i++)
+    {
+        const Box &box = boxes[i];
+        for (int z = box.z0; z <= box.z1; z++)
+            for (int y = box.y0; y <= box.y1; y++)
+                for (int x = box.x0; x <= box.x1; x++)
+                {
+                    int c = (z * CLUSTER_Y + y) * CLUSTER_X + x;
+                    lightIndexTexels[clusterTexels[c * 2] + clusterTexels[c * 2 + 1]++] = (GLuint)i;
+                }
+    }
 
-            // The order of vertices of a quad goes top-right, top-left, bottom-left, bottom-right
-            // each vertex will have just the Position attribute containing 4 floats: (vec2 pos, vec2 tex), in total 16 floats
-            float glyphVertices[16] = {glyphBoundingBoxBottomLeft[0] + glyphSize[0], glyphBoundingBoxBottomLeft[1] + glyphSize[1], alignedQuad.s1, alignedQuad.t0,
-                                       glyphBoundingBoxBottomLeft[0], glyphBoundingBoxBottomLeft[1] + glyphSize[1], alignedQuad.s0, alignedQuad.t0,
-                                       glyphBoundingBoxBottomLeft[0], glyphBoundingBoxBottomLeft[1], alignedQuad.s0, alignedQuad.t1,
-                                       glyphBoundingBoxBottomLeft[0] + glyphSize[0], glyphBoundingBoxBottomLeft[1], alignedQuad.s1, alignedQuad.t1};
+    // 5 texels per light: (color.rgb, ambient) (position.xyz, diffuse) (constant, linear, exponential, cutoff)
+    // (direction.xyz, color.a) (shadow tile, unused), the last two only read for spot lights
+    lightTexels.resize(viewLocalLights.size() * 20);
+    for (size_t i = 0; i < viewLocalLights.size(); i++)
+    {
+        const LocalLight &light = viewLocalLights[i];
+        float *t = &lightTexels[i * 20];
+        float texels[20] = {light.color[0], light.color[1], light.color[2], light.ambient,
+                            light.position[0], light.position[1], light.position[2], light.diffuse,
+                            light.constant, light.linear, light.exponential, light.cutoff,
+                            light.direction[0], light.direction[1], light.direction[2], light.color[3],
+                            light.shadow, 0.f, 0.f, 0.f};
+        memcpy(t, texels, sizeof(texels));
+    }
 
-            // update content of VBO memory
-            glBindBuffer(GL_ARRAY_BUFFER, textVBO[0]);
-            glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glyphVertices), glyphVertices);
-            glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    lightData.upload(lightTexels.data(), lightTexels.size() * sizeof(float));
+    clusterData.upload(clusterTexels.data(), clusterTexels.size() * sizeof(GLuint));
+    lightIndex.upload(lightIndexTexels.data(), lightIndexTexels.size() * sizeof(GLuint));
 
-            // Update the position to render the next glyph specified by packedChar->xadvance.
-            localPosition[0] += packedChar.xadvance * text.size;
-        }
-        // Handle newlines seperately.
-        else if (ch == '\n')
+    // bindTexture may skip the bind (and the glActiveTexture), so the unit is made active for glTexBuffer
+    auto attach = [this](int unit, GLenum internalFormat, const TextureBuffer &tb)
+    {
+        bindTexture(unit, GL_TEXTURE_BUFFER, tb.texture);
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glTexBuffer(GL_TEXTURE_BUFFER, internalFormat, tb.buffer);
+    };
+    attach(LIGHT_DATA_UNIT, GL_RGBA32F, lightData);
+    attach(CLUSTER_DATA_UNIT, GL_RG32UI, clusterData);
+    attach(LIGHT_INDEX_UNIT, GL_R32UI, lightIndex);
+
+    // the lit mesh programs pick these up in syncMeshProgram
+    float viewport[4] = {(float)vp[0], (float)vp[1], (float)vp[2], (float)vp[3]};
+    float depth[4] = {depthScale, depthBias, perspective ? 1.f : 0.f, 0.f};
+    memcpy(clusterViewport, viewport, sizeof(clusterViewport));
+    memcpy(clusterDepth, depth, sizeof(clusterDepth));
+    clusterSerial++;
+
+    memcpy(binnedProj, proj, sizeof(binnedProj));
+    clustersDirty = false;
+
+    st.lightBins++;
+    st.lightIndices += total;
+}
+
+// res = a * b, column major
+static void multMat4(const float *a, const float *b, float *res)
+{
+    float r[16];
+    for (int col = 0; col < 4; col++)
+        transformVec4(a, b + col * 4, r + col * 4);
+    memcpy(res, r, sizeof(r));
+}
+
+// general 4x4 inverse by cofactors; false for a singular matrix
+static bool invertMat4(const float *m, float *res)
+{
+    float inv[16];
+    inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+    inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+    inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+    inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+    inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+    inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+    inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+    inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+    inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+    inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+    inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+    inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+    inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+    inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+    inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+    inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+    float det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+    if (det == 0.f)
+        return false;
+    for (int i = 0; i < 16; i++)
+        res[i] = inv[i] / det;
+    return true;
+}
+
+// view matrix of an eye looking along dir
+static void lookAlong(const float *eye, const float *dir, float *res)
+{
+    float len = std::sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+    float f[3] = {dir[0] / len, dir[1] / len, dir[2] / len};
+    float up[3] = {0.f, 1.f, 0.f};
+    if (std::fabs(f[1]) > 0.99f)
+        up[0] = 1.f, up[1] = 0.f;
+    float side[3] = {f[1] * up[2] - f[2] * up[1], f[2] * up[0] - f[0] * up[2], f[0] * up[1] - f[1] * up[0]};
+    len = std::sqrt(side[0] * side[0] + side[1] * side[1] + side[2] * side[2]);
+    for (float &x : side)
+        x /= len;
+    float u[3] = {side[1] * f[2] - side[2] * f[1], side[2] * f[0] - side[0] * f[2], side[0] * f[1] - side[1] * f[0]};
+    float view[16] = {side[0], u[0], -f[0], 0.f,
+                      side[1], u[1], -f[1], 0.f,
+                      side[2], u[2], -f[2], 0.f,
+                      0.f, 0.f, 0.f, 1.f};
+    for (int k = 0; k < 3; k++)
+    {
+        view[12] -= view[k * 4] * eye[k];
+        view[13] -= view[k * 4 + 1] * eye[k];
+        view[14] -= view[k * 4 + 2] * eye[k];
+    }
+    memcpy(res, view, sizeof(view));
+}
+
+// bounding sphere (view space center) against the frustum planes of proj (Gribb & Hartmann)
+static bool sphereInFrustum(const float *c, float radius, const float *proj)
+{
+    for (int row = 0; row < 3; row++)
+        for (float sign : {1.f, -1.f})
         {
-            // advance y by fontSize, reset x-coordinate
-            localPosition[1] -= 1.0 * font.size * text.size;
-            localPosition[0] = text.position[0];
+            float plane[4];
+            for (int k = 0; k < 4; k++)
+                plane[k] = proj[k * 4 + 3] + sign * proj[k * 4 + row];
+            float norm = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+            if (plane[0] * c[0] + plane[1] * c[1] + plane[2] * c[2] + plane[3] < -radius * norm)
+                return false;
         }
-        else if (ch == ' ')
+    return true;
+}
+
+// depth texture with hardware comparison, bilinearly filtered so each PCF tap is already a 2x2 average,
+// and a framebuffer rendering into it (layer 0 of an array)
+static void createDepthTarget(GLenum target, int size, int layers, GLuint &texture, GLuint &fbo)
+{
+    glGenTextures(1, &texture);
+    glBindTexture(target, texture);
+    if (target == GL_TEXTURE_2D_ARRAY)
+        glTexImage3D(target, 0, GL_DEPTH_COMPONENT24, size, size, layers, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    else
+        glTexImage2D(target, 0, GL_DEPTH_COMPONENT24, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(target, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    // outside the map is lit
+    static const float border[4] = {1.f, 1.f, 1.f, 1.f};
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameterfv(target, GL_TEXTURE_BORDER_COLOR, border);
+    glBindTexture(target, 0);
+
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    if (target == GL_TEXTURE_2D_ARRAY)
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, 0);
+    else
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, target, texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        printf("Shadow map framebuffer is incomplete!\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// casters up to this far behind a cascade (towards the sun) still land in its depth range
+#define SHADOW_CASTER_RANGE 100.f
+
+bool Renderer::fitShadowCascades(const float *cameraView, const float *cameraProj, float shadowDistance)
+{
+    shadowSerial++;
+    shadowsOn = lights.directionalToggle != 0;
+    if (!shadowsOn)
+        return false;
+
+    // light view: looking down the sun direction, from the world origin
+    static const float origin[3] = {0.f, 0.f, 0.f};
+    lookAlong(origin, lights.directionalDirection, shadowView);
+
+    // corners of the camera frustum in world space, near plane first
+    float viewProj[16], invViewProj[16];
+    multMat4(cameraProj, cameraView, viewProj);
+    if (!invertMat4(viewProj, invViewProj))
+    {
+        shadowsOn = false;
+        return false;
+    }
+    float corners[8][3];
+    for (int c = 0; c < 8; c++)
+    {
+        float ndc[4] = {c & 1 ? 1.f : -1.f, c & 2 ? 1.f : -1.f, c & 4 ? 1.f : -1.f, 1.f}, world[4];
+        transformVec4(invViewProj, ndc, world);
+        for (int k = 0; k < 3; k++)
+            corners[c][k] = world[k] / world[3];
+    }
+
+    // split distances: halfway between uniform and logarithmic (the usual "practical" split) in
+    // perspective, uniform for an orthographic camera whose texel density does not change with depth
+    float zNear, zFar;
+    bool perspective = projectionDepthRange(cameraProj, zNear, zFar);
+    float zEnd = std::min(zFar, shadowDistance);
+    float splits[SHADOW_CASCADES + 1];
+    for (int i = 0; i <= SHADOW_CASCADES; i++)
+    {
+        float t = (float)i / SHADOW_CASCADES;
+        float uniform = zNear + (zEnd - zNear) * t;
+        splits[i] = perspective ? 0.5f * zNear * std::pow(zEnd / zNear, t) + 0.5f * uniform : uniform;
+    }
+
+    for (int c = 0; c < SHADOW_CASCADES; c++)
+    {
+        // the slice corners lie on the frustum edges, linearly in view depth
+        float slice[8][3], center[3] = {0.f, 0.f, 0.f};
+        for (int i = 0; i < 4; i++)
+            for (int end = 0; end < 2; end++)
+            {
+                float t = (splits[c + end] - zNear) / (zFar - zNear);
+                for (int k = 0; k < 3; k++)
+                {
+                    slice[i + end * 4][k] = corners[i][k] + (corners[i + 4][k] - corners[i][k]) * t;
+                    center[k] += slice[i + end * 4][k] / 8.f;
+                }
+            }
+
+        // a bounding sphere keeps the projection size fixed while the camera turns; rounded up so it stays put
+        float radius = 0.f;
+        for (auto &p : slice)
         {
-            // advance x by fontSize, keep y-coordinate
-            localPosition[0] += 0.2 * font.size * text.size;
+            float dx = p[0] - center[0], dy = p[1] - center[1], dz = p[2] - center[2];
+            radius = std::max(radius, std::sqrt(dx * dx + dy * dy + dz * dz));
         }
+        radius = std::ceil(radius);
+
+        // snapping the center to whole texels keeps the shadow edges from crawling as the camera moves
+        float worldCenter[4] = {center[0], center[1], center[2], 1.f}, lc[4];
+        transformVec4(shadowView, worldCenter, lc);
+        float texel = 2.f * radius / SHADOW_MAP_SIZE;
+        lc[0] = std::floor(lc[0] / texel) * texel;
+        lc[1] = std::floor(lc[1] / texel) * texel;
+
+        float l = lc[0] - radius, r = lc[0] + radius, b = lc[1] - radius, t = lc[1] + radius;
+        float n = -lc[2] - radius - SHADOW_CASTER_RANGE, fa = -lc[2] + radius;
+        float ortho[16] = {2.f / (r - l), 0.f, 0.f, 0.f,
+                           0.f, 2.f / (t - b), 0.f, 0.f,
+                           0.f, 0.f, -2.f / (fa - n), 0.f,
+                           -(r + l) / (r - l), -(t + b) / (t - b), -(fa + n) / (fa - n), 1.f};
+        memcpy(shadowProj[c], ortho, sizeof(ortho));
     }
+    return true;
+}
+
+// spot shadow frusta: past the light's own marker mesh, and no further than this even for lights that never fade
+#define SPOT_SHADOW_NEAR 0.3f
+#define SPOT_SHADOW_FAR 150.f
+
+int Renderer::allocateSpotShadows(const float *cameraView, const float *cameraProj)
+{
+    flush();
+    for (auto &light : localLights)
+        light.shadow = -1.f;
+
+    // importance: how large the reach of the light looks from the camera, 0 when it is out of view
+    float invView[16];
+    invertMat4(cameraView, invView);
+    const float *eye = invView + 12;
+    std::vector<std::pair<float, int>> candidates;
+    for (size_t i = 0; i < localLights.size(); i++)
+    {
+        const LocalLight &light = localLights[i];
+        if (light.cutoff < -1.5f || light.radius <= 0.f)
+            continue;
+        float range = std::min(light.radius, SPOT_SHADOW_FAR);
+        float c[4];
+        transformVec4(cameraView, light.position, c);
+        if (!sphereInFrustum(c, range, cameraProj))
+            continue;
+        float dx = light.position[0] - eye[0], dy = light.position[1] - eye[1], dz = light.position[2] - eye[2];
+        candidates.push_back({range / std::max(1.f, std::sqrt(dx * dx + dy * dy + dz * dz)), (int)i});
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const std::pair<float, int> &a, const std::pair<float, int> &b)
+              { return a.first > b.first; });
+
+    // sizes never grow down the list, so each tile starts aligned in Z order right after the previous one
+    const int grid = SPOT_ATLAS_SIZE / SPOT_TILE_MIN;
+    int cursor = 0, count = 0;
+    for (auto &candidate : candidates)
+    {
+        if (count == MAX_SPOT_SHADOWS)
+            break;
+        int size = SPOT_TILE_MAX;
+        while (size > SPOT_TILE_MIN && candidate.first < 0.5f * size / SPOT_TILE_MAX)
+            size /= 2;
+        if (count > 0)
+            size = std::min(size, spotShadows[count - 1].rect[2]);
+        int cells = (size / SPOT_TILE_MIN) * (size / SPOT_TILE_MIN);
+        while (cursor + cells > grid * grid && size > SPOT_TILE_MIN)
+        {
+            size /= 2;
+            cells /= 4;
+        }
+        if (cursor + cells > grid * grid)
+            break; // atlas full
+
+        int x = 0, y = 0;
+        for (int bit = 0; (1 << (2 * bit)) < grid * grid; bit++)
+        {
+            x |= ((cursor >> (2 * bit)) & 1) << bit;
+            y |= ((cursor >> (2 * bit + 1)) & 1) << bit;
+        }
+        cursor += cells;
+
+        SpotShadow &tile = spotShadows[count];
+        LocalLight &light = localLights[candidate.second];
+        tile.light = candidate.second;
+        tile.rect[0] = x * SPOT_TILE_MIN;
+        tile.rect[1] = y * SPOT_TILE_MIN;
+        tile.rect[2] = size;
+        lookAlong(light.position, light.direction, tile.view);
+
+        // the cone plus a margin for the PCF taps
+        float halfAngle = std::acos(std::max(-1.f, std::min(1.f, light.cutoff))) + 0.05f;
+        float zNear = SPOT_SHADOW_NEAR, zFar = std::min(light.radius, SPOT_SHADOW_FAR);
+        float f = 1.f / std::tan(std::min(halfAngle, 1.5f));
+        float proj[16] = {f, 0.f, 0.f, 0.f,
+                          0.f, f, 0.f, 0.f,
+                          0.f, 0.f, (zFar + zNear) / (zNear - zFar), -1.f,
+                          0.f, 0.f, 2.f * zFar * zNear / (zNear - zFar), 0.f};
+        memcpy(tile.proj, proj, sizeof(proj));
+
+        light.shadow = (float)count;
+        count++;
+    }
+
+    // tiles beyond the count keep no claim on the atlas
+    for (int i = count; i < MAX_SPOT_SHADOWS; i++)
+        spotShadows[i].drawnHash = 0;
+    spotShadowCount = count;
+    shadowSerial++;
+    passStat().spotTiles += count;
+    return count;
+}
+
+void Renderer::beginSpotShadow(int tile)
+{
+    flush();
+    currentSpotShadow = tile;
+}
+
+void Renderer::endSpotShadow()
+{
+    SpotShadow &tile = spotShadows[currentSpotShadow];
+
+    // FNV-1a over the tile and every queued caster: equal to the last draw means the tile already holds this depth
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const void *data, size_t bytes)
+    {
+        const uint8_t *b = (const uint8_t *)data;
+        for (size_t i = 0; i < bytes; i++)
+            hash = (hash ^ b[i]) * 1099511628211ull;
+    };
+    mix(tile.rect, sizeof(tile.rect));
+    mix(tile.proj, sizeof(tile.proj));
+    for (const DrawItem &item : queue.getItems())
+    {
+        mix(&item.meshID, sizeof(item.meshID));
+        mix(item.vm, sizeof(item.vm));
+    }
+    hash |= 1; // 0 means nothing drawn
+
+    if (hash == tile.drawnHash && memcmp(tile.rect, tile.drawnRect, sizeof(tile.rect)) == 0)
+    {
+        queue.clear();
+        currentSpotShadow = -1;
+        return;
+    }
+
+    if (spotAtlasFBO == 0)
+        createDepthTarget(GL_TEXTURE_2D, SPOT_ATLAS_SIZE, 1, spotAtlasTexture, spotAtlasFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, spotAtlasFBO);
+    glViewport(tile.rect[0], tile.rect[1], tile.rect[2], tile.rect[2]);
+    glScissor(tile.rect[0], tile.rect[1], tile.rect[2], tile.rect[2]);
+    glEnable(GL_SCISSOR_TEST);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.f, 4.f);
+    flush();
+
+    // whatever other tile had depth under this rect lost it
+    for (int i = 0; i < MAX_SPOT_SHADOWS; i++)
+    {
+        const int *r = spotShadows[i].drawnRect;
+        if (i != currentSpotShadow && spotShadows[i].drawnHash != 0 &&
+            r[0] < tile.rect[0] + tile.rect[2] && tile.rect[0] < r[0] + r[2] &&
+            r[1] < tile.rect[1] + tile.rect[2] && tile.rect[1] < r[1] + r[2])
+            spotShadows[i].drawnHash = 0;
+    }
+    tile.drawnHash = hash;
+    memcpy(tile.drawnRect, tile.rect, sizeof(tile.rect));
+    currentSpotShadow = -1;
+    passStat().spotTilesDrawn++;
+}
+
+void Renderer::updateShadowMatrices(const float *view)
+{
+    if (!shadowsOn && spotShadowCount == 0)
+        return;
+
+    // view space -> world -> light clip space -> [0, 1] texture coordinates and depth
+    static const float bias[16] = {0.5f, 0.f, 0.f, 0.f,
+                                   0.f, 0.5f, 0.f, 0.f,
+                                   0.f, 0.f, 0.5f, 0.f,
+                                   0.5f, 0.5f, 0.5f, 1.f};
+    float invView[16];
+    if (!invertMat4(view, invView))
+        return;
+    for (int c = 0; shadowsOn && c < SHADOW_CASCADES; c++)
+    {
+        multMat4(shadowView, invView, shadowMatrices[c]);
+        multMat4(shadowProj[c], shadowMatrices[c], shadowMatrices[c]);
+        multMat4(bias, shadowMatrices[c], shadowMatrices[c]);
+    }
+
+    // spot tiles: the same into the tile's corner of the atlas (projective, divided in the shader)
+    for (int i = 0; i < spotShadowCount; i++)
+    {
+        const SpotShadow &tile = spotShadows[i];
+        float scale = (float)tile.rect[2] / SPOT_ATLAS_SIZE;
+        float x = (float)tile.rect[0] / SPOT_ATLAS_SIZE, y = (float)tile.rect[1] / SPOT_ATLAS_SIZE;
+        float tileBias[16] = {0.5f * scale, 0.f, 0.f, 0.f,
+                              0.f, 0.5f * scale, 0.f, 0.f,
+                              0.f, 0.f, 0.5f, 0.f,
+                              0.5f * scale + x, 0.5f * scale + y, 0.5f, 1.f};
+        float *m = spotShadowMatrices[i];
+        multMat4(tile.view, invView, m);
+        multMat4(tile.proj, m, m);
+        multMat4(tileBias, m, m);
+
+        // inset half a texel, so the filtered taps at the edge do not read the neighbouring tile
+        float half = 0.5f / SPOT_ATLAS_SIZE;
+        spotShadowTiles[i][0] = x + half;
+        spotShadowTiles[i][1] = y + half;
+        spotShadowTiles[i][2] = x + scale - half;
+        spotShadowTiles[i][3] = y + scale - half;
+    }
+    shadowSerial++;
+}
+
+void Renderer::disableSunShadows()
+{
+    flush();
+    shadowsOn = false;
+    shadowSerial++;
+}
+
+void Renderer::beginShadowMaps()
+{
+    flush();
+    glGetIntegerv(GL_VIEWPORT, savedViewport);
+    // the textures are written now; unbind them so they are not sampled at the same time
+    bindTexture(SHADOW_MAP_UNIT, GL_TEXTURE_2D_ARRAY, 0);
+    bindTexture(SPOT_SHADOW_UNIT, GL_TEXTURE_2D, 0);
+}
+
+void Renderer::beginShadowCascade(int cascade)
+{
+    flush();
+    if (shadowFBO == 0)
+        createDepthTarget(GL_TEXTURE_2D_ARRAY, SHADOW_MAP_SIZE, SHADOW_CASCADES, shadowTexture, shadowFBO);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadowTexture, 0, cascade);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    // slope scaled bias against shadow acne
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.f, 4.f);
+}
+
+void Renderer::endShadowMaps()
+{
+    flush();
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+    bindTexture(SHADOW_MAP_UNIT, GL_TEXTURE_2D_ARRAY, shadowTexture);
+    bindTexture(SPOT_SHADOW_UNIT, GL_TEXTURE_2D, spotAtlasTexture);
+}
+
+// bounding sphere of the mesh, in the view space of vm
+// the mesh bounding sphere in view space, scaled by the largest axis scale of vm
+static void viewSphere(const MyMesh &mesh, const float *vm, float *c, float &radius)
+{
+    if (vm[11] != 0.f)
+    {
+        // a billboard (submitBillboard), turned on the GPU: around its position, whatever way it faces
+        float scale = std::max(std::fabs(vm[0]), std::max(std::fabs(vm[1]), std::fabs(vm[2])));
+        float offset = std::sqrt(mesh.bounds[0] * mesh.bounds[0] + mesh.bounds[1] * mesh.bounds[1] + mesh.bounds[2] * mesh.bounds[2]);
+        memcpy(c, vm + 12, 3 * sizeof(float));
+        c[3] = 1.f;
+        radius = (offset + mesh.bounds[3]) * scale;
+        return;
+    }
+    float center[4] = {mesh.bounds[0], mesh.bounds[1], mesh.bounds[2], 1.f};
+    transformVec4(vm, center, c);
+    float scale = 0.f;
+    for (int col = 0; col < 3; col++)
+        scale = std::max(scale, vm[col * 4] * vm[col * 4] + vm[col * 4 + 1] * vm[col * 4 + 1] + vm[col * 4 + 2] * vm[col * 4 + 2]);
+    radius = mesh.bounds[3] * std::sqrt(scale);
+}
+
+// radius over clip w: its size in NDC (w is the depth in perspective, 1 in orthographic); unbounded at the eye
+static float projectedSize(const float *c, float radius, const float *proj)
+{
+    float w = proj[3] * c[0] + proj[7] * c[1] + proj[11] * c[2] + proj[15];
+    return w > 1e-4f ? radius * proj[5] / w : INFINITY;
+}
+
+bool Renderer::inFrustum(const MyMesh &mesh, const float *vm, const float *proj, float minSize) const
+{
+    float c[4], radius;
+    viewSphere(mesh, vm, c, radius);
+    if (!sphereInFrustum(c, radius, proj))
+        return false;
+    return minSize <= 0.f || projectedSize(c, radius, proj) >= minSize;
+}
+
+int Renderer::selectLod(const dataMesh &data)
+{
+    auto chain = lodChains.find(data.meshID);
+    if (!levelOfDetail || chain == lodChains.end())
+        return data.meshID;
+
+    float c[4], radius;
+    viewSphere(getMesh(data.meshID), data.vm, c, radius);
+    float size = projectedSize(c, radius, data.proj) * lodBias[(int)currentPass];
+    int levels = (int)chain->second.size();
+    auto threshold = [&](int level)
+    { return lodSize * std::ldexp(1.f, 1 - level); };
+
+    int level = 0;
+    if (data.lod && currentPass == RenderPass::Main)
+    {
+        // from the level it had, move only once clearly past a threshold
+        level = std::min(std::max(*data.lod, 0), levels);
+        while (level < levels && size < threshold(level + 1) * (1.f - LOD_HYSTERESIS))
+            level++;
+        while (level > 0 && size > threshold(level) * (1.f + LOD_HYSTERESIS))
+            level--;
+        *data.lod = level;
+    }
+    else
+    {
+        while (level < levels && size < threshold(level + 1))
+            level++;
+    }
+
+    return level == 0 ? data.meshID : chain->second[level - 1];
+}
+
+void Renderer::clipProjectionToPlane(float *proj, const float *view, const float *worldPlane)
+{
+    // planes transform by the inverse transpose: view space plane = transpose(inverse(view)) * plane
+    float invView[16], plane[4];
+    if (!invertMat4(view, invView))
+        return;
+    for (int i = 0; i < 4; i++)
+        plane[i] = invView[i * 4] * worldPlane[0] + invView[i * 4 + 1] * worldPlane[1] + invView[i * 4 + 2] * worldPlane[2] + invView[i * 4 + 3] * worldPlane[3];
+
+    // Lengyel's oblique near plane: q is the frustum corner opposite the plane, in view space; the third row
+    // of the projection becomes the plane scaled so that q stays on the far plane
+    float invProj[16], q[4];
+    if (!invertMat4(proj, invProj))
+        return;
+    float corner[4] = {plane[0] > 0.f ? 1.f : -1.f, plane[1] > 0.f ? 1.f : -1.f, 1.f, 1.f};
+    transformVec4(invProj, corner, q);
+    float dot = plane[0] * q[0] + plane[1] * q[1] + plane[2] * q[2] + plane[3] * q[3];
+    if (std::fabs(dot) < 1e-6f)
+        return;
+    float scale = 2.f / dot;
+    for (int i = 0; i < 4; i++)
+        proj[i * 4 + 2] = plane[i] * scale - proj[i * 4 + 3];
+}
+
+void Renderer::ViewTarget::release()
+{
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteTextures(1, &texture);
+    glDeleteRenderbuffers(1, &depth);
+    fbo = texture = depth = 0;
+    size[0] = size[1] = 0;
+}
+
+void Renderer::resizeViewTarget(ViewTarget &target, int width, int height, int unit)
+{
+    if (width == target.size[0] && height == target.size[1])
+        return;
+
+    if (target.fbo == 0)
+    {
+        glGenFramebuffers(1, &target.fbo);
+        glGenTextures(1, &target.texture);
+        glGenRenderbuffers(1, &target.depth);
+    }
+    // through the cache, so the bindings it remembers stay true
+    bindTexture(unit, GL_TEXTURE_2D, target.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, target.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        printf("Off screen view framebuffer is incomplete!\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    target.size[0] = width;
+    target.size[1] = height;
+}
+
+void Renderer::beginReflection(int scale)
+{
+    flush();
+    glGetIntegerv(GL_VIEWPORT, savedViewport);
+    int width = std::max(1, savedViewport[2] / scale), height = std::max(1, savedViewport[3] / scale);
+    resizeViewTarget(reflectionTarget, width, height, REFLECTION_UNIT);
+
+    // not sampled while it is drawn
+    bindTexture(REFLECTION_UNIT, GL_TEXTURE_2D, 0);
+    disableReflection();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, reflectionTarget.fbo);
+    glViewport(0, 0, width, height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void Renderer::endReflection()
+{
+    flush();
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+    bindTexture(REFLECTION_UNIT, GL_TEXTURE_2D, reflectionTarget.texture);
+
+    for (int i = 0; i < 4; i++)
+        reflectionViewport[i] = (float)savedViewport[i];
+    reflectionSerial++;
+}
+
+void Renderer::disableReflection()
+{
+    flush();
+    reflectionViewport[2] = 0.f;
+    reflectionSerial++;
+}
+
+void Renderer::beginMirror(int width, int height)
+{
+    flush();
+    glGetIntegerv(GL_VIEWPORT, savedViewport);
+    resizeViewTarget(mirrorTarget, std::max(1, width), std::max(1, height), MIRROR_UNIT);
+    bindTexture(MIRROR_UNIT, GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, mirrorTarget.fbo);
+    glViewport(0, 0, mirrorTarget.size[0], mirrorTarget.size[1]);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void Renderer::endMirror()
+{
+    flush();
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+    bindTexture(MIRROR_UNIT, GL_TEXTURE_2D, mirrorTarget.texture);
+    mirrorDrawn = true;
+}
+
+void Renderer::beginImpostors(int count)
+{
+    flush();
+    glGetIntegerv(GL_VIEWPORT, savedViewport);
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, savedClearColor);
+    if (impostorFBO == 0)
+    {
+        glGenFramebuffers(1, &impostorFBO);
+        glGenTextures(1, &impostorTexture);
+        glGenRenderbuffers(1, &impostorDepth);
+    }
+    bindTexture(IMPOSTOR_UNIT, GL_TEXTURE_2D_ARRAY, impostorTexture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, IMPOSTOR_WIDTH, IMPOSTOR_HEIGHT, std::max(1, count), 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // not sampled while it is drawn
+    bindTexture(IMPOSTOR_UNIT, GL_TEXTURE_2D_ARRAY, 0);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, impostorDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, IMPOSTOR_WIDTH, IMPOSTOR_HEIGHT);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, impostorFBO);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, impostorDepth);
+    glViewport(0, 0, IMPOSTOR_WIDTH, IMPOSTOR_HEIGHT);
+    glClearColor(0.f, 0.f, 0.f, 0.f);
+}
+
+void Renderer::beginImpostor(int layer)
+{
+    flush();
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, impostorTexture, 0, layer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        printf("Impostor framebuffer is incomplete!\n");
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void Renderer::endImpostors()
+{
+    flush();
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+    glClearColor(savedClearColor[0], savedClearColor[1], savedClearColor[2], savedClearColor[3]);
+
+    // the layers were cleared to transparent black, so the mipmaps come out premultiplied: the shader divides by alpha
+    bindTexture(IMPOSTOR_UNIT, GL_TEXTURE_2D_ARRAY, impostorTexture);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+}
+
+int Renderer::addOcclusionGroup(const float *boxMin, const float *boxMax)
+{
+    if (boxBaseVertex < 0)
+    {
+        static const float corners[8 * 4] = {
+            0, 0, 0, 1, 1, 0, 0, 1, 1, 1, 0, 1, 0, 1, 0, 1,
+            0, 0, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 0, 1, 1, 1};
+        static const GLuint faces[36] = {
+            0, 2, 1, 0, 3, 2, 4, 5, 6, 4, 6, 7, 0, 1, 5, 0, 5, 4,
+            3, 6, 2, 3, 7, 6, 0, 4, 7, 0, 7, 3, 1, 2, 6, 1, 6, 5};
+        GeometryPool::Range range = GeometryPool::getInstance().add(8, corners, nullptr, nullptr, nullptr, 36, faces);
+        boxBaseVertex = range.baseVertex;
+        boxFirstIndex = range.firstIndex;
+        boundVAO = 0; // the pool leaves VAO 0 bound
+    }
+
+    OcclusionGroup group;
+    for (int k = 0; k < 3; k++)
+    {
+        group.box[k] = boxMin[k];
+        group.box[k + 3] = boxMax[k];
+    }
+    glGenQueries(1, &group.query);
+    occlusionGroups.push_back(group);
+    return (int)occlusionGroups.size() - 1;
+}
+
+bool Renderer::occluded(int group)
+{
+    if (group < 0 || !occlusionCulling || currentPass != RenderPass::Main || occlusionGroups[group].visible)
+        return false;
+    passStat().occluded++;
+    return true;
+}
+
+void Renderer::testOcclusionGroups(const float *view, const float *proj)
+{
+    if (!occlusionCulling)
+    {
+        for (auto &group : occlusionGroups)
+            group.visible = true;
+        return;
+    }
+    flush();
+
+    // camera position: -transpose(R) * t
+    float eye[3];
+    for (int i = 0; i < 3; i++)
+        eye[i] = -(view[i * 4] * view[12] + view[i * 4 + 1] * view[13] + view[i * 4 + 2] * view[14]);
+
+    std::vector<int> &tested = testedGroups;
+    tested.clear();
+    instanceData.clear();
+    for (int g = 0; g < (int)occlusionGroups.size(); g++)
+    {
+        OcclusionGroup &group = occlusionGroups[g];
+        if (group.pending)
+        {
+            GLuint available = 0;
+            glGetQueryObjectuiv(group.query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                continue; // keeps its last visibility until the GPU gets there
+            GLuint samples = 0;
+            glGetQueryObjectuiv(group.query, GL_QUERY_RESULT, &samples);
+            group.visible = samples != 0;
+            group.pending = false;
+        }
+
+        // from inside (or just outside, where the near plane cuts the box) its faces prove nothing
+        const float *b = group.box;
+        const float margin = 1.f;
+        if (eye[0] > b[0] - margin && eye[0] < b[3] + margin && eye[1] > b[1] - margin && eye[1] < b[4] + margin &&
+            eye[2] > b[2] - margin && eye[2] < b[5] + margin)
+        {
+            group.visible = true;
+            continue;
+        }
+        // outside the frustum the query would fail: visible, so it does not pop in a frame late when it enters
+        float center[4] = {(b[0] + b[3]) * 0.5f, (b[1] + b[4]) * 0.5f, (b[2] + b[5]) * 0.5f, 1.f}, c[4];
+        float extent[3] = {b[3] - b[0], b[4] - b[1], b[5] - b[2]};
+        transformVec4(view, center, c);
+        if (!sphereInFrustum(c, 0.5f * std::sqrt(extent[0] * extent[0] + extent[1] * extent[1] + extent[2] * extent[2]), proj))
+        {
+            group.visible = true;
+            continue;
+        }
+
+        // view * translate(min) * scale(extent)
+        InstanceData box{};
+        float model[16] = {extent[0], 0, 0, 0, 0, extent[1], 0, 0, 0, 0, extent[2], 0, b[0], b[1], b[2], 1};
+        multMat4(view, model, box.viewModel);
+        instanceData.push_back(box);
+        tested.push_back(g);
+    }
+    if (tested.empty())
+        return;
+    uploadInstanceData();
+
+    // the boxes only test the depth: no color, no depth writes, both faces
+    useProgram(depthProgram);
+    currentMeshProgram = nullptr;
+    if (!depthProjValid || memcmp(depthProj, proj, sizeof(depthProj)) != 0)
+    {
+        glUniformMatrix4fv(depthProj_loc, 1, GL_FALSE, proj);
+        memcpy(depthProj, proj, sizeof(depthProj));
+        depthProjValid = true;
+        passStat().uniformUploads++;
+    }
+    bindVAO(GeometryPool::getInstance().getVAO());
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_LEQUAL); // a box face lying on its own object's face still passes
+    if (cullFace)
+        glDisable(GL_CULL_FACE);
+
+    for (size_t i = 0; i < tested.size(); i++)
+    {
+        OcclusionGroup &group = occlusionGroups[tested[i]];
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, group.query);
+        glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, 36, GL_UNSIGNED_INT, (void *)(boxFirstIndex * sizeof(GLuint)),
+                                                      1, boxBaseVertex, instanceBase + (GLuint)i);
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+        group.pending = true;
+    }
+    passStat().occlusionQueries += (unsigned int)tested.size();
+    passStat().draws += (unsigned int)tested.size();
+
+    if (cullFace)
+        glEnable(GL_CULL_FACE);
+    glDepthFunc(depthFunc);
+    glDepthMask(depthWrite ? GL_TRUE : GL_FALSE);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+}
+
+void Renderer::setTextureArray(TexArray array, int texObjId)
+{
+    // the sampler uniform of each array was set at program setup
+    bindTexture((int)array, GL_TEXTURE_2D_ARRAY, TexObjArray.getTextureId(texObjId));
+}
+
+void Renderer::submit(const dataMesh &data)
+{
+    static const float white[4] = {1.f, 1.f, 1.f, 1.f};
+    int meshID = selectLod(data);
+    const auto &mesh = getMesh(meshID);
+
+    DrawItem item;
+    item.meshID = meshID;
+    item.texMode = data.texMode < 0 ? mesh.mat.texCount : data.texMode;
+    item.matSlot = layeredMaterial(mesh.matSlot, data.texLayer, data.normalLayer);
+    item.projIndex = queue.addProjection(data.proj);
+    item.pass = currentPass;
+    item.blended = data.blended;
+    bool depthOnly = currentPass == RenderPass::ShadowMap || currentPass == RenderPass::SpotShadow;
+    if (depthOnly || currentPass == RenderPass::Reflection || currentPass == RenderPass::RearView)
+    {
+        if (!inFrustum(mesh, data.vm, data.proj, minProjectedSize[(int)currentPass]))
+        {
+            passStat().culled++;
+            return;
+        }
+    }
+    if (depthOnly)
+    {
+        // depth only: every caster of a mesh shares one batch, whatever its texture or material
+        item.texMode = 0;
+        item.matSlot = mesh.matSlot;
+    }
+    memcpy(item.vm, data.vm, sizeof(item.vm));
+    memcpy(item.tint, data.tint ? data.tint : white, sizeof(item.tint));
+    if (meshID != data.meshID)
+        passStat().lodReduced++;
+
+    queue.submit(item);
+}
+
+void Renderer::submitBillboard(const dataMesh &data, const float *position, const float *scale, Billboard mode)
+{
+    // columns: scale, the world up axis in view space, (0, 0, 0, mode), the view space position
+    float packed[16] = {};
+    float world[4] = {position[0], position[1], position[2], 1.f};
+    transformVec4(data.vm, world, packed + 12);
+    memcpy(packed, scale, 3 * sizeof(float));
+    memcpy(packed + 4, data.vm + 4, 3 * sizeof(float));
+    packed[11] = mode == Billboard::Spherical ? 2.f : 1.f;
+
+    dataMesh billboard = data;
+    billboard.vm = packed;
+    submit(billboard);
+}
+
+void Renderer::uploadInstances()
+{
+    // written straight into the stream, in draw order
+    const auto &items = queue.getItems();
+    InstanceData *instances = mapInstances(items.size());
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        memcpy(instances[i].viewModel, items[i].vm, sizeof(items[i].vm));
+        memcpy(instances[i].tint, items[i].tint, sizeof(items[i].tint));
+    }
+    instanceStream.unmap();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Renderer::uploadInstanceData()
+{
+    InstanceData *instances = mapInstances(instanceData.size());
+    memcpy(instances, instanceData.data(), instanceData.size() * sizeof(InstanceData));
+    instanceStream.unmap();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+Renderer::InstanceData *Renderer::mapInstances(size_t count)
+{
+    size_t offset;
+    void *instances = instanceStream.map(std::max(count, (size_t)1) * sizeof(InstanceData), sizeof(InstanceData), offset);
+    if (instanceStream.buffer() != instanceVBO)
+    {
+        // the stream outgrew its buffer: the VAO sources the new one
+        instanceVBO = instanceStream.buffer();
+        setupInstanceAttribs(instanceAttribVAO);
+    }
+    instanceBase = (GLuint)(offset / sizeof(InstanceData));
+    return (InstanceData *)instances;
+}
+
+void Renderer::endFrame()
+{
+    instanceStream.endFrame();
+    textStream.endFrame();
+}
+
+static bool sameBatch(const DrawItem &a, const DrawItem &b)
+{
+    return a.meshID == b.meshID && a.texMode == b.texMode && a.matSlot == b.matSlot &&
+           a.projIndex == b.projIndex && a.blended == b.blended;
+}
+
+bool Renderer::prepassable(const DrawItem &item) const
+{
+    // lit passes only; alpha tested meshes need their texture for the depth, blended ones write none
+    bool litPass = item.pass == RenderPass::Main || item.pass == RenderPass::Reflection || item.pass == RenderPass::RearView;
+    return litPass && !item.blended && !(meshFeatureKey(item.texMode) & MESH_ALPHA_TEST);
+}
+
+void Renderer::flush()
+{
+    if (queue.empty())
+        return;
+
+    queue.sort();
+    uploadInstances();
+    if (lightsDirty)
+        uploadLights();
+    // items are sorted by texMode first, so each mesh program is bound once per flush
+    currentMeshProgram = nullptr;
+
+    const auto &items = queue.getItems();
+
+    // depth pre-pass, unless the caller draws without depth testing or writing (overlays, planar shadows)
+    bool prepass = depthPrepass && depthWrite && depthTest;
+    bool prepassed = false;
+    if (prepass)
+    {
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        for (size_t first = 0, last; first < items.size(); first = last)
+        {
+            for (last = first + 1; last < items.size() && sameBatch(items[first], items[last]); last++)
+                ;
+            if (prepassable(items[first]))
+            {
+                drawBatch(items[first], (int)first, (int)(last - first), true);
+                passStat().prepassDraws++;
+                prepassed = true;
+            }
+        }
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    }
+
+    bool blendSet = false;
+    bool depthEqual = false;
+    size_t first = 0;
+    while (first < items.size())
+    {
+        size_t last = first + 1;
+        while (last < items.size() && sameBatch(items[first], items[last]))
+            last++;
+
+        // what the pre-pass drew is shaded where its depth matches exactly, the depth is already there
+        bool equal = prepassed && prepassable(items[first]);
+        if (equal != depthEqual)
+        {
+            depthEqual = equal;
+            glDepthFunc(equal ? GL_EQUAL : depthFunc);
+            glDepthMask(equal ? GL_FALSE : GL_TRUE); // the pre-pass only runs with depth writes on
+        }
+
+        // blended items sort last; turn blending on for them unless the caller already did
+        if (items[first].blended && !blend && !blendSet)
+        {
+            blendSet = true;
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        }
+        // instances are rasterized in order, so a batch of blended items keeps their back to front order
+        drawBatch(items[first], (int)first, (int)(last - first),
+                  items[first].pass == RenderPass::ShadowMap || items[first].pass == RenderPass::SpotShadow);
+        first = last;
+    }
+    if (depthEqual)
+    {
+        glDepthFunc(depthFunc);
+        glDepthMask(GL_TRUE);
+    }
+    if (blendSet)
+        glDisable(GL_BLEND);
+
+    queue.clear();
+}
+
+void Renderer::setDepthTest(bool enable)
+{
+    depthTest = enable;
+    if (enable)
+        glEnable(GL_DEPTH_TEST);
+    else
+        glDisable(GL_DEPTH_TEST);
+}
+
+void Renderer::setDepthWrite(bool enable)
+{
+    depthWrite = enable;
+    glDepthMask(enable ? GL_TRUE : GL_FALSE);
+}
+
+void Renderer::setDepthFunc(GLenum func)
+{
+    depthFunc = func;
+    glDepthFunc(func);
+}
+
+void Renderer::setBlend(bool enable)
+{
+    blend = enable;
+    if (enable)
+        glEnable(GL_BLEND);
+    else
+        glDisable(GL_BLEND);
+}
+
+void Renderer::setCullFace(bool enable)
+{
+    cullFace = enable;
+    if (enable)
+        glEnable(GL_CULL_FACE);
+    else
+        glDisable(GL_CULL_FACE);
+}
+
+void Renderer::drawBatch(const DrawItem &item, int first, int count, bool depthOnly)
+{
+    RenderStats &st = passStat();
+    const auto &mesh = getMesh(item.meshID);
+    const float *proj = queue.getProjection(item.projIndex);
+
+    if (depthOnly)
+    {
+        // shadow maps and depth pre-pass: no material, textures or lights
+        useProgram(depthProgram);
+        currentMeshProgram = nullptr;
+        if (!depthProjValid || memcmp(depthProj, proj, sizeof(depthProj)) != 0)
+        {
+            glUniformMatrix4fv(depthProj_loc, 1, GL_FALSE, proj);
+            memcpy(depthProj, proj, sizeof(depthProj));
+            depthProjValid = true;
+            st.uniformUploads++;
+        }
+        bindVAO(mesh.vao);
+        glDrawElementsInstancedBaseVertexBaseInstance(mesh.type, mesh.numIndexes, GL_UNSIGNED_INT,
+                                                      (void *)(mesh.firstIndex * sizeof(GLuint)), count,
+                                                      mesh.baseVertex, instanceBase + first);
+        st.draws++;
+        st.instances += count;
+        st.unsortedVaoBinds += 2 * count;
+        st.unsortedUniformUploads += 2 * count;
+        return;
+    }
+
+    // the program specialized for this texMode
+    if (!currentMeshProgram || item.texMode != boundTexMode)
+    {
+        currentMeshProgram = &getMeshProgram(item.texMode);
+        boundTexMode = item.texMode;
+        useProgram(currentMeshProgram->program);
+    }
+    MeshProgram &mp = *currentMeshProgram;
+
+    // the clusters are laid out in the frustum of the projection they were binned for
+    if (clustersDirty || memcmp(binnedProj, proj, sizeof(binnedProj)) != 0)
+        binLights(proj);
+    syncMeshProgram(mp);
+
+    if (!mp.projValid || memcmp(mp.proj, proj, sizeof(mp.proj)) != 0)
+    {
+        glUniformMatrix4fv(mp.proj_loc, 1, GL_FALSE, proj);
+        memcpy(mp.proj, proj, sizeof(mp.proj));
+        mp.projValid = true;
+        st.uniformUploads++;
+    }
+
+    // send the material: just a range rebind when it differs from the previous draw
+    bindMaterial(item.matSlot);
+
+    // every mesh lives in the geometry pool: the VAO is bound once and each draw only offsets into it
+    bindVAO(mesh.vao);
+    glDrawElementsInstancedBaseVertexBaseInstance(mesh.type, mesh.numIndexes, GL_UNSIGNED_INT,
+                                                  (void *)(mesh.firstIndex * sizeof(GLuint)), count,
+                                                  mesh.baseVertex, instanceBase + first);
+
+    st.draws++;
+    st.instances += count;
+    // unsorted: per mesh a bind + unbind of the VAO, 3 matrices, 5 material fields and texMode on the one uber program
+    st.unsortedVaoBinds += 2 * count;
+    st.unsortedUniformUploads += 9 * count;
+}
+
+void Renderer::renderText(const TextCommand &text)
+{
+    if (!textVertices.empty() && memcmp(textPvm, text.pvm, sizeof(textPvm)) != 0)
+        flushText();
+    memcpy(textPvm, text.pvm, sizeof(textPvm));
+    layoutText(text, textVertices);
+}
+
+void Renderer::renderText(const std::vector<float> &vertices, const float *pvm)
+{
+    if (!textVertices.empty() && memcmp(textPvm, pvm, sizeof(textPvm)) != 0)
+        flushText();
+    memcpy(textPvm, pvm, sizeof(textPvm));
+    textVertices.insert(textVertices.end(), vertices.begin(), vertices.end());
+}
+
+void Renderer::layoutText(const TextCommand &text, std::vector<float> &vertices)
+{
+    float localPosition[2] = {text.position[0], text.position[1]}; // screen coordinates
+    float atlasScale = font.size / font.pixelSize, glyphScale = atlasScale * text.size;
+
+    for (size_t i = 0; i < text.str.size();)
+    {
+        uint32_t codepoint = decodeUtf8(text.str, i);
+
+        if (codepoint > 32)
+        {
+            // Retrieve the data that is used to render the glyph, rasterizing it if it is the first use
+            const Glyph &g = glyph(codepoint);
+
+            // The units of the glyph metrics are atlas pixels, scaled to font.size units
+            if (g.width > 0)
+            {
+                float glyphSize[2] = {g.width * glyphScale, g.height * glyphScale};
+                float glyphBoundingBoxBottomLeft[2] = {localPosition[0] + (g.xoff * glyphScale), (localPosition[1] - g.yoff2 * atlasScale) * text.size};
+
+                // The order of vertices of a quad goes top-right, top-left, bottom-left, bottom-right
+                // each vertex has (vec2 pos, vec2 tex), the color of the text and the atlas page
+                float corners[16] = {glyphBoundingBoxBottomLeft[0] + glyphSize[0], glyphBoundingBoxBottomLeft[1] + glyphSize[1], g.s1, g.t0,
+                                     glyphBoundingBoxBottomLeft[0], glyphBoundingBoxBottomLeft[1] + glyphSize[1], g.s0, g.t0,
+                                     glyphBoundingBoxBottomLeft[0], glyphBoundingBoxBottomLeft[1], g.s0, g.t1,
+                                     glyphBoundingBoxBottomLeft[0] + glyphSize[0], glyphBoundingBoxBottomLeft[1], g.s1, g.t1};
+                for (int v = 0; v < 4; v++)
+                {
+                    vertices.insert(vertices.end(), corners + v * 4, corners + v * 4 + 4);
+                    vertices.insert(vertices.end(), text.color, text.color + 4);
+                    vertices.push_back((float)g.page);
+                }
+            }
+
+            // Update the position to render the next glyph
+            localPosition[0] += g.xadvance * glyphScale;
+        }
+        // Handle newlines seperately.
+        else if (codepoint == '\n')
+        {
+            // advance y by fontSize, reset x-coordinate
+            localPosition[1] -= 1.0 * font.size * text.size;
+            localPosition[0] = text.position[0];
+        }
+        else if (codepoint == ' ')
+        {
+            // advance x by fontSize, keep y-coordinate
+            localPosition[0] += 0.2 * font.size * text.size;
+        }
+    }
+}
+
+void Renderer::flushText()
+{
+    if (textVertices.empty())
+        return;
+
+    size_t vertices = textVertices.size() / TEXT_VERTEX_FLOATS, quads = vertices / 4;
+
+    // into the stream after the text already drawn this frame; the draw starts at its first vertex
+    size_t offset;
+    void *mapped = textStream.map(textVertices.size() * sizeof(float), TEXT_VERTEX_FLOATS * sizeof(float), offset);
+    if (textStream.buffer() != textVBO)
+    {
+        textVBO = textStream.buffer();
+        setupTextAttribs();
+    }
+    memcpy(mapped, textVertices.data(), textVertices.size() * sizeof(float));
+    textStream.unmap();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    bindVAO(textVAO);
+
+    // the quad indices never change, only their count grows
+    if (quads > textQuadCapacity)
+    {
+        textQuadCapacity = std::max(quads, textQuadCapacity * 2);
+        std::vector<GLuint> indices(textQuadCapacity * 6);
+        static const GLuint quadFaceIndex[] = {0, 1, 2, 2, 3, 0};
+        for (size_t q = 0; q < textQuadCapacity; q++)
+            for (int i = 0; i < 6; i++)
+                indices[q * 6 + i] = (GLuint)(q * 4) + quadFaceIndex[i];
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    }
+
+    useProgram(textProgram);
+    bindTexture(FONT_UNIT, GL_TEXTURE_2D_ARRAY, font.textureId); // replaced when the glyph cache adds a page
+    glUniformMatrix4fv(fontPvm_loc, 1, GL_FALSE, textPvm);
+    passStat().uniformUploads++;
+    glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)(quads * 6), GL_UNSIGNED_INT, 0, (GLint)(offset / (TEXT_VERTEX_FLOATS * sizeof(float))));
+    passStat().draws++;
+    passStat().instances += quads;
+
+    textVertices.clear();
 }
@@ -10,13 +10,30 @@
 #include <unordered_map>
 #include "texture.h"
 #include "model.h"
+#include "renderQueue.h"
+#include "streamBuffer.h"
+#include "stb_rect_pack.h"
 #include "stb_truetype.h"
 
 struct dataMesh
 {
 	int meshID = 0;			  // mesh ID in the myMeshes array
-	float *pvm, *vm, *normal; // matrices pointers
+	float *proj, *vm;		  // matrices pointers
+	float *tint = nullptr;	  // rgba multiplied into the final color, white if null
 	int texMode = 0;		  // type of shading-> 0:no texturing; 1:modulate diffuse color with texel color; 2:diffuse color is replaced by texel color; 3: multitexturing
+	int texLayer = 0;		  // layer of the texture array sampled by texMode
+	int normalLayer = 0;	  // layer of the normal map, for normal mapped texModes
+	bool blended = false;	  // alpha blended: drawn after opaque meshes, in submission order
+	int *lod = nullptr;		  // the object's level of detail in the main view, kept for the hysteresis; null: chosen afresh
+};
+
+// how Renderer::submitBillboard turns a mesh to the camera: its +z towards the camera, about the world up
+// axis only (cylindrical) or entirely (spherical)
+enum class Billboard
+{
+	None,
+	Cylindrical,
+	Spherical
 };
 
 enum class Align
@@ -28,6 +45,116 @@ enum class Align
 	Bottom = Left,
 };
 
+// std140 image of the "Material" uniform block declared in mesh.frag
+struct MaterialBlock
+{
+	float diffuse[4];
+	float ambient[4];
+	float specular[4];
+	float emissive[4];
+	float shininess;
+	int texLayer; // layers of the texture arrays, so draws sharing a material can sample different textures
+	int normalLayer;
+	float pad;
+};
+
+// Texture units of the mesh texture arrays. Textures of a kind are layers of one GL_TEXTURE_2D_ARRAY
+enum class TexArray
+{
+	Surface,   // tiled, repeat wrap (stone, floor, window, lightwood, normal map)
+	Billboard, // clamped, alpha tested
+	Sprite,	   // particles and flares
+	Count
+};
+
+// std140 mirror of the Lights uniform block in mesh.frag (structs round up to 16 bytes).
+// Only the directional light lives here; point and spot lights go through the light clusters
+struct LightBaseBlock
+{
+	float color[4];
+	float ambient;
+	float diffuse;
+	float pad[2];
+};
+
+struct LightsBlock
+{
+	LightBaseBlock directionalBase;
+	float directionalDirection[4];
+	int directionalToggle;
+	int pad[3];
+};
+
+// a point or spot light, binned into the view clusters
+struct LocalLight
+{
+	float color[4];
+	float position[4];
+	float direction[4]; // spot lights only
+	float ambient, diffuse;
+	float constant, linear, exponential;
+	float cutoff; // cosine of the cone half angle, -2 for point lights
+	float radius; // distance where the light falls under 1/256, infinite without attenuation
+	float shadow; // spot shadow tile, -1 without
+};
+
+// GL work issued by the renderer, reset by the caller (e.g. once per second)
+struct RenderStats
+{
+	unsigned int draws = 0;
+	unsigned int instances = 0; // meshes drawn; draws is the number of (instanced) draw calls
+	unsigned int programBinds = 0;
+	unsigned int vaoBinds = 0;
+	unsigned int textureBinds = 0;
+	unsigned int uniformUploads = 0; // glUniform* calls
+	unsigned int materialBinds = 0;	 // glBindBufferRange on the material UBO
+	unsigned int lightUploads = 0;	 // uploads of the light UBO
+	unsigned int lightBytes = 0;
+	unsigned int lightBins = 0;	   // cluster rebuilds
+	unsigned int lightIndices = 0; // light references written to the clusters
+	unsigned int culled = 0;	   // submits outside the frustum of their pass, never queued
+	unsigned int spotTiles = 0;	   // spot shadow tiles in use
+	unsigned int spotTilesDrawn = 0; // of which redrawn, the others kept their cached depth
+	unsigned int prepassDraws = 0;	 // depth only draws of the depth pre-pass
+	unsigned int occluded = 0;		 // objects skipped as their occlusion group was hidden
+	unsigned int occlusionQueries = 0;
+	unsigned int lodReduced = 0; // meshes drawn with a coarser level of detail
+
+	// the same work drawn in submission order without any state caching
+	unsigned int unsortedProgramBinds = 0;
+	unsigned int unsortedVaoBinds = 0;
+	unsigned int unsortedTextureBinds = 0;
+	unsigned int unsortedUniformUploads = 0;
+	unsigned int unsortedLightUniforms = 0; // glUniform calls of the per field light setup
+
+	void add(const RenderStats &o)
+	{
+		draws += o.draws;
+		instances += o.instances;
+		programBinds += o.programBinds;
+		vaoBinds += o.vaoBinds;
+		textureBinds += o.textureBinds;
+		uniformUploads += o.uniformUploads;
+		materialBinds += o.materialBinds;
+		lightUploads += o.lightUploads;
+		lightBytes += o.lightBytes;
+		lightBins += o.lightBins;
+		lightIndices += o.lightIndices;
+		culled += o.culled;
+		spotTiles += o.spotTiles;
+		spotTilesDrawn += o.spotTilesDrawn;
+		prepassDraws += o.prepassDraws;
+		occluded += o.occluded;
+		occlusionQueries += o.occlusionQueries;
+		lodReduced += o.lodReduced;
+		unsortedProgramBinds += o.unsortedProgramBinds;
+		unsortedVaoBinds += o.unsortedVaoBinds;
+		unsortedTextureBinds += o.unsortedTextureBinds;
+		unsortedUniformUploads += o.unsortedUniformUploads;
+		unsortedLightUniforms += o.unsortedLightUniforms;
+	}
+};
+
 struct TextCommand
 {
 	std::string str{};
@@ -54,14 +181,46 @@ public:
 
 	bool setSkyboxShaderProg(const std::string &vertShaderPath, const std::string &fragShaderPath);
 
+	// position only GLSL program of the shadow map pass
+	bool setShadowShaderProg(const std::string &vertShaderPath, const std::string &fragShaderPath);
+
 	void activateRenderMeshesShaderProg();
 
-	void activateSkyboxShaderProg(float*, unsigned int, float*);
+	// the cubemap of the skybox and of the env mapped meshes (texMode 13), bound until the next call
+	void setSkybox(GLuint cubemap);
+	// draws the skybox behind what is already in the depth buffer: after the opaque meshes, so it shades only the
+	// pixels they left uncovered, and before the blended ones
+	void drawSkybox(float *projview, float *fogColor);
+
+	// queue a mesh draw for the current pass; nothing reaches GL until flush()
+	void submit(const dataMesh &data);
+	// a billboard: data.vm is the view matrix alone, and the vertex shader builds the basis facing the camera from
+	// the world position and scale, all the instance carries (packed into its view model, see mesh.vert)
+	void submitBillboard(const dataMesh &data, const float *position, const float *scale, Billboard mode);
 
-	void renderMesh(const dataMesh &data);
+	// sort the queued draws by state and execute them, skipping redundant state changes
+	void flush();
 
+	// subsequent submits and GL work are accounted to this pass
+	void beginPass(RenderPass pass) { currentPass = pass; }
+
+	// forget the cached GL bindings, for code that binds programs/VAOs/textures behind the renderer's back
+	void invalidateStateCache();
+
+	// lays out the glyph quads of text after those already queued; flushText draws them all with one buffer upload and
+	// one draw. A text with another pvm than the queued ones flushes them first
 	void renderText(const TextCommand &text);
+	// queues glyph quads laid out earlier by layoutText, so text that does not change need not be laid out again
+	void renderText(const std::vector<float> &vertices, const float *pvm);
+	void flushText();
+
+	// at the end of each frame: the streamed data (instances, text) moves to the next region of its buffers
+	void endFrame();
+	// appends the glyph quads of text, UTF-8, (pvm unused) to vertices, in the format renderText(vertices) takes.
+	// Glyphs not used before are added to the font atlas
+	void layoutText(const TextCommand &text, std::vector<float> &vertices);
 
+	// the set*Light calls take world space vectors; setLightView makes them visible to the following draws
 	void resetLights();
 
 	void setFogColor(float *color);
@@ -72,18 +231,104 @@ public:
 
 	void setSpotLight(float *color, float ambient, float diffuse, float *direction, float cutoff, float *position, float constant, float linear, float exponential);
 
-	void setTexUnit(int tuId, int texObjId);
+	// flushes the queued draws, then transforms the frame lights to this view (mirrored in Y for the floor reflection)
+	void setLightView(const float *view, bool mirrorY = false);
+
+	// The shadow map passes go between beginShadowMaps and endShadowMaps, which keep the viewport
+	void beginShadowMaps();
+	void endShadowMaps();
+
+	// Cascaded shadow maps of the directional light. fitShadowCascades splits the camera frustum (up to
+	// shadowDistance) into SHADOW_CASCADES slices and fits a light space ortho projection to each; then per
+	// cascade: beginShadowCascade, submit the casters with getShadowView/getShadowProjection, flush.
+	// Returns false (and the meshes are drawn unshadowed) when there is no directional light
+	bool fitShadowCascades(const float *cameraView, const float *cameraProj, float shadowDistance);
+	void beginShadowCascade(int cascade);
+	float *getShadowView() { return shadowView; }
+	float *getShadowProjection(int cascade) { return shadowProj[cascade]; }
+	// meshes drawn after this ignore the sun shadow maps, e.g. when the planar shadows are used instead
+	void disableSunShadows();
+
+	// Spot light shadows share one depth atlas. allocateSpotShadows gives the spot lights most visible from
+	// the camera a tile sized by their importance on screen and returns how many got one; then per tile:
+	// beginSpotShadow, submit the casters with getSpotShadowView/getSpotShadowProjection, endSpotShadow.
+	// A tile is only redrawn when its casters changed since it was drawn (the light or a caster in its cone moved)
+	int allocateSpotShadows(const float *cameraView, const float *cameraProj);
+	void beginSpotShadow(int tile);
+	void endSpotShadow();
+	float *getSpotShadowView(int tile) { return spotShadows[tile].view; }
+	float *getSpotShadowProjection(int tile) { return spotShadows[tile].proj; }
+
+	// Planar floor reflection: the mirrored scene is drawn between beginReflection and endReflection into an off
+	// screen target at 1/scale of the viewport, which the floor program then samples by window position
+	void beginReflection(int scale);
+	void endReflection();
+	void disableReflection(); // the floor is drawn without it
+	// replaces the near plane of proj with a view space clip plane (oblique near plane): geometry on the negative
+	// side of the world space plane is clipped, and culled by the passes that cull
+	static void clipProjectionToPlane(float *proj, const float *view, const float *worldPlane);
+
+	// Rear view mirror: drawn between beginMirror and endMirror into its own target of the given size, which keeps
+	// the image between updates, so the mirror can be redrawn less often than the main view. Quads with texMode
+	// TEXTURE_MIRROR show it
+	void beginMirror(int width, int height);
+	void endMirror();
+	bool hasMirror() const { return mirrorDrawn; }
+
+	// Impostors: layers of a texture array that distant groups of objects are baked into once, then drawn back as
+	// single quads with texMode TEXTURE_IMPOSTOR and the layer as texLayer. beginImpostors allocates count layers;
+	// draws between beginImpostor(layer) and the next call land in that layer, cleared to transparent first;
+	// endImpostors builds the mipmaps and returns to the screen
+	void beginImpostors(int count);
+	void beginImpostor(int layer);
+	void endImpostors();
+
+	// submits of the culled passes (shadow maps, reflection, rear view) whose bounding sphere projects smaller than
+	// this (radius, in NDC) are skipped: small views drop the detail they cannot show
+	float minProjectedSize[(int)RenderPass::Count] = {};
+
+	// Depth pre-pass: in the lit passes, every flush first draws its opaque, not alpha tested meshes depth only, with
+	// the shadow map program, then shades them with GL_EQUAL depth testing, so mesh.frag runs once per visible pixel
+	bool depthPrepass = true;
+
+	// Depth test, depth writes, depth function, blending and face culling, set through these so the renderer knows
+	// the state it draws with (flush picks the pre-pass and blending from it) and restores it, without querying GL
+	void setDepthTest(bool enable);
+	void setDepthWrite(bool enable);
+	void setDepthFunc(GLenum func);
+	void setBlend(bool enable);
+	void setCullFace(bool enable);
+	bool blending() const { return blend; }
+	bool culling() const { return cullFace; }
+
+	// Occlusion culling of the main view. An occlusion group is a world space box around objects (a building, a
+	// cluster of billboards); testOcclusionGroups, once per frame after the main view's opaque meshes, draws each
+	// box into a GL_ANY_SAMPLES_PASSED query, and the next frame skips the objects of hidden groups (occluded).
+	// Results are read a frame late, only once available, so the CPU never waits for the GPU
+	int addOcclusionGroup(const float *boxMin, const float *boxMax);
+	void testOcclusionGroups(const float *view, const float *proj);
+	bool occluded(int group); // true in the main pass when the group's box was hidden, counted in the stats
+	bool occlusionCulling = true;
+
+	// Levels of detail: a mesh registered with lods gets a chain of coarser meshes, and submit draws the one matching
+	// the projected size of its bounding sphere (radius, in NDC): level k below lodSize / 2^(k-1), times the bias of
+	// the pass, so the small views (mirror, reflection) go coarse sooner. In the main pass, with dataMesh::lod, a
+	// level only changes once the size is LOD_HYSTERESIS past its threshold, so objects do not pop back and forth
+	static constexpr float LOD_HYSTERESIS = 0.15f;
+	float lodSize = 0.1f;
+	float lodBias[(int)RenderPass::Count];
+	bool levelOfDetail = true;
+
+	// binds texture object texObjId (a 2D array) as the given mesh texture array; cached, so calling it every pass is free
+	void setTextureArray(TexArray array, int texObjId);
 
 	// Vector with meshes
 	std::unordered_map<int, MyMesh> meshRegistry;
 	int nextMeshID = 0;
 
-	int addMesh(const MyMesh &mesh)
-	{
-		int id = nextMeshID++;
-		meshRegistry[id] = mesh;
-		return id;
-	}
+	// registers the mesh and gives its material a slot in the material UBO; its lods, if any, become its level of
+	// detail chain, with the same material
+	int addMesh(const MyMesh &mesh);
 
 	MyMesh &getMesh(int id)
 	{
@@ -101,70 +346,277 @@ public:
 	bool shadow = false;
 	bool renderShadow() { return shadow; }
 
+	RenderStats passStats[(int)RenderPass::Count];
+	RenderStats getTotalStats() const;
+	void resetStats();
+
 private:
-	// Render meshes GLSL program
-	GLuint program;
+	// Mesh programs: mesh.vert/mesh.frag specialized per texMode by #defines, so unlit, alpha tested,
+	// normal mapped and env mapped draws only run their own work. Cached by feature key (texMode << 8 | features)
+#define MESH_TEX_MODES 18
+	enum MeshFeature
+	{
+		MESH_LIGHTING = 1 << 0,
+		MESH_NORMAL_MAP = 1 << 1,
+		MESH_ENV_MAP = 1 << 2,
+		MESH_ALPHA_TEST = 1 << 3,
+		MESH_FOG = 1 << 4,
+		MESH_TINT = 1 << 5,
+		MESH_REFLECTION = 1 << 6,
+	};
+	struct MeshProgram
+	{
+		GLuint program = 0;
+		GLint proj_loc = -1, fogColor_loc = -1, clusterViewport_loc = -1, clusterDepth_loc = -1;
+		GLint shadowMatrices_loc = -1, shadowsOn_loc = -1, spotShadowMatrices_loc = -1, spotShadowTiles_loc = -1, reflectionViewport_loc = -1;
+
+		// what this program was last sent
+		float proj[16];
+		bool projValid = false;
+		unsigned int fogSerial = 0, clusterSerial = 0, shadowSerial = 0, reflectionSerial = 0;
+	};
+	std::string meshVertPath, meshFragPath;
+	std::unordered_map<uint32_t, MeshProgram> meshPrograms;
+	MeshProgram *currentMeshProgram = nullptr;
+
+	// per view values shared by all the mesh programs, bumped serials mark them for re-sending
+	float fogColor[4] = {};
+	unsigned int fogSerial = 1;
+	float clusterViewport[4] = {}, clusterDepth[4] = {};
+	unsigned int clusterSerial = 1;
+
+	static uint32_t meshFeatureKey(int texMode);
+	static std::string meshDefines(uint32_t key);
+	MeshProgram &getMeshProgram(int texMode); // compiled on first use
+	bool buildMeshProgram(uint32_t key, MeshProgram &mp);
+	void syncMeshProgram(MeshProgram &mp);
 
 	// Text font rasterizer GLSL program
 	GLuint textProgram;
 
-	GLint pvm_loc, vm_loc, normal_loc, texMode_loc, fogColor_loc;
-	GLint tex_loc[MAX_TEXTURES];
-
-#define MAX_POINT_LIGHTS 10
-#define MAX_SPOT_LIGHTS 4
-
-	struct
+	// Materials are uploaded once into a std140 UBO, one aligned slot per distinct material,
+	// and selected per draw with glBindBufferRange
+#define MATERIAL_UBO_BINDING 0
+	std::vector<MaterialBlock> materialSlots;
+	GLuint materialUBO = 0;
+	GLint materialStride = 0;
+	bool materialsDirty = false;
+
+	// last state sent to the mesh programs, so unchanged state is not re-sent
+	int boundMaterial = -1;
+	int boundTexMode = -1; // selects the mesh program
+
+	int addMaterial(const Material &mat);
+	int addMaterialBlock(const MaterialBlock &block);
+	// slot of the material of slot with the given texture layers
+	int layeredMaterial(int slot, int texLayer, int normalLayer);
+	std::unordered_map<uint64_t, int> layeredSlots;
+	void uploadMaterials();
+	void bindMaterial(int slot);
+
+	RenderQueue queue;
+	RenderPass currentPass = RenderPass::Main;
+	RenderStats &passStat() { return passStats[(int)currentPass]; }
+
+	// cached GL bindings
+#define MAX_CACHED_TEXTURE_UNITS 32
+	GLuint boundProgram = 0;
+	GLuint boundVAO = 0;
+	GLuint boundTextures[MAX_CACHED_TEXTURE_UNITS] = {};
+	// as set by setDepthTest, setDepthWrite, setDepthFunc, setBlend and setCullFace; GL's initial state
+	bool depthTest = false;
+	bool depthWrite = true;
+	GLenum depthFunc = GL_LESS;
+	bool blend = false;
+	bool cullFace = false;
+
+	void useProgram(GLuint prog);
+	void bindVAO(GLuint vao);
+	void bindTexture(int unit, GLenum target, GLuint texId);
+
+	// Per instance attributes, written by every flush after those of the earlier flushes of the frame. All the mesh
+	// VAOs source them from instanceVBO, the stream's buffer; the draws offset their base instance by instanceBase
+	struct InstanceData
 	{
-		GLuint color;
-		GLuint ambient;
-		GLuint diffuse;
-		GLuint direction;
-	} directionalLight_loc;
-	GLuint directionalLightToggle_loc;
-
-	struct
+		float viewModel[16];
+		float tint[4];
+	};
+	static const size_t INSTANCE_STREAM_SIZE = 1024 * 1024; // bytes a frame, grown when exceeded
+	StreamBuffer instanceStream;
+	GLuint instanceVBO = 0;
+	GLuint instanceAttribVAO = 0; // VAO already sourcing the instance attributes
+	GLuint instanceBase = 0;	  // first instance of the last upload
+	std::vector<InstanceData> instanceData; // staging, for the occlusion query boxes
+
+	void setupInstanceAttribs(GLuint vao);
+	void uploadInstances();
+	void uploadInstanceData();
+	// room for count instances in the stream, until instanceStream.unmap(); sets instanceBase
+	InstanceData *mapInstances(size_t count);
+	void drawBatch(const DrawItem &item, int first, int count, bool depthOnly);
+	bool prepassable(const DrawItem &item) const; // drawn by the depth pre-pass
+
+	// Lights are collected once per frame in world space (lights, localLights), then transformed in
+	// one batch for each view. The directional light goes to a std140 UBO with a single call
+#define LIGHT_UBO_BINDING 1
+	LightsBlock lights{};
+	LightsBlock viewLights{};
+	GLuint lightUBO = 0;
+	bool lightsDirty = false;
+
+	void uploadLights();
+
+	// Clustered forward lighting: the view frustum is split in CLUSTER_X * CLUSTER_Y screen tiles and
+	// CLUSTER_Z depth slices (exponential in perspective). Each cluster gets the list of point/spot
+	// lights reaching it, so a fragment only shades those. Must match the constants in mesh.frag
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define LIGHT_DATA_UNIT 13	  // samplerBuffer, 5 texels per light
+#define CLUSTER_DATA_UNIT 14  // usamplerBuffer, (first index, count) per cluster
+#define LIGHT_INDEX_UNIT 15	  // usamplerBuffer, light indices of all the clusters
+	struct TextureBuffer
 	{
-		GLuint color;
-		GLuint ambient;
-		GLuint diffuse;
-		GLuint position;
-		GLuint attConstant;
-		GLuint attLinear;
-		GLuint attExp;
-	} pointLight_loc[MAX_POINT_LIGHTS];
-	GLuint pointLightNum_loc;
-	int pointLightCount = 0;
-
-	struct
+		GLuint buffer = 0, texture = 0;
+		void upload(const void *data, size_t bytes);
+		void release();
+	};
+	std::vector<LocalLight> localLights;
+	std::vector<LocalLight> viewLocalLights;
+	TextureBuffer lightData, clusterData, lightIndex;
+	std::vector<float> lightTexels;
+	std::vector<GLuint> clusterTexels;
+	std::vector<GLuint> lightIndexTexels;
+	bool clustersDirty = true;
+	float binnedProj[16];
+
+	void binLights(const float *proj);
+
+	// Shadow maps: one layer of a depth texture array per cascade, rendered with a position only program.
+	// shadowMatrices take view space positions of the current light view to shadow map coordinates
+#define SHADOW_CASCADES 3 // must match mesh.frag
+#define SHADOW_MAP_SIZE 2048
+#define SHADOW_MAP_UNIT 12 // sampler2DArrayShadow
+	GLuint depthProgram = 0;
+	GLint depthProj_loc = -1;
+	float depthProj[16];
+	bool depthProjValid = false;
+	GLuint shadowFBO = 0, shadowTexture = 0;
+	GLint savedViewport[4];
+	float shadowView[16];
+	float shadowProj[SHADOW_CASCADES][16];
+	float shadowMatrices[SHADOW_CASCADES][16];
+	bool shadowsOn = false;
+	unsigned int shadowSerial = 1;
+
+	// Spot shadow atlas: square power of two tiles, packed in Z order so descending sizes never leave holes
+#define SPOT_ATLAS_SIZE 2048
+#define SPOT_TILE_MIN 256
+#define SPOT_TILE_MAX 1024
+#define MAX_SPOT_SHADOWS 8 // must match mesh.frag
+#define SPOT_SHADOW_UNIT 11 // sampler2DShadow
+	struct SpotShadow
 	{
-		GLuint color;
-		GLuint ambient;
-		GLuint diffuse;
-		GLuint position;
-		GLuint direction;
-		GLuint cutoff;
-		GLuint attConstant;
-		GLuint attLinear;
-		GLuint attExp;
-	} spotLight_loc[MAX_SPOT_LIGHTS];
-	GLuint spotLightNum_loc;
-	int spotLightCount = 0;
+		int light = -1;	// index in localLights
+		int rect[3];	// x, y, size in texels
+		float view[16], proj[16];
+		uint64_t drawnHash = 0; // casters and rect last drawn by this tile, 0 if overwritten since
+		int drawnRect[3];
+	};
+	SpotShadow spotShadows[MAX_SPOT_SHADOWS];
+	int spotShadowCount = 0, currentSpotShadow = -1;
+	GLuint spotAtlasFBO = 0, spotAtlasTexture = 0;
+	float spotShadowMatrices[MAX_SPOT_SHADOWS][16];
+	float spotShadowTiles[MAX_SPOT_SHADOWS][4]; // atlas coordinates the PCF taps stay in: min xy, max xy
+
+	void updateShadowMatrices(const float *view);
+	// bounding sphere test; false as well when it projects smaller than minSize
+	bool inFrustum(const MyMesh &mesh, const float *vm, const float *proj, float minSize = 0.f) const;
+
+	std::unordered_map<int, std::vector<int>> lodChains; // mesh -> its coarser meshes, finest first
+	int selectLod(const dataMesh &data);
+
+	struct OcclusionGroup
+	{
+		float box[6]; // min xyz, max xyz
+		GLuint query = 0;
+		bool pending = false; // issued, result not read yet
+		bool visible = true;
+	};
+	std::vector<OcclusionGroup> occlusionGroups;
+	std::vector<int> testedGroups; // of this frame's queries, in instance order; kept for its capacity
+	int boxBaseVertex = -1; // unit cube in the geometry pool, drawn for the queries
+	GLuint boxFirstIndex = 0;
+
+	// color texture and depth renderbuffer a view is drawn into off screen
+	struct ViewTarget
+	{
+		GLuint fbo = 0, texture = 0, depth = 0;
+		int size[2] = {0, 0};
+		void release();
+	};
+	// (re)allocates the storage when the size changed; the texture is left bound to unit
+	void resizeViewTarget(ViewTarget &target, int width, int height, int unit);
+
+	// off screen reflection target, resized with the viewport
+#define REFLECTION_UNIT 10 // sampler2D
+	ViewTarget reflectionTarget;
+	float reflectionViewport[4] = {}; // where the floor finds it on screen, width 0 when there is none
+	unsigned int reflectionSerial = 1;
+
+	// off screen rear view mirror
+#define MIRROR_UNIT 9 // sampler2D
+	ViewTarget mirrorTarget;
+	bool mirrorDrawn = false;
+
+	// impostor layers, IMPOSTOR_WIDTH x IMPOSTOR_HEIGHT each, with a depth buffer for the bake
+#define IMPOSTOR_UNIT 8 // sampler2DArray
+	static const int IMPOSTOR_WIDTH = 256;
+	static const int IMPOSTOR_HEIGHT = 128;
+	GLuint impostorFBO = 0, impostorTexture = 0, impostorDepth = 0;
+	float savedClearColor[4];
 
 	// renderer variables for skybox
+#define SKYBOX_UNIT 7 // samplerCube, also of the env mapped meshes
 	GLuint skyboxProgram, skyboxVAO, skyboxVBO;
-	GLuint skyboxprojview_loc, cubemap_loc, fogColor_skyloc;
+	GLuint skyboxprojview_loc, fogColor_skyloc;
+	float skyboxFogColor[4] = {-1.f, -1.f, -1.f, -1.f}; // last sent, to skip the upload when unchanged
 
 	// render font GLSL program variable locations and VAO
-	GLint fontPvm_loc, textColor_loc;
-	GLuint textVAO, textVBO[2];
-
+	GLint fontPvm_loc;
+	GLuint textVAO = 0, textVBO = 0, textIBO = 0; // textVBO: the stream's buffer, which the VAO sources
+	static const size_t TEXT_STREAM_SIZE = 128 * 1024;
+	StreamBuffer textStream;
+	void setupTextAttribs();
+	// queued glyph quads, 4 vertices of TEXT_VERTEX_FLOATS: position xy, texture coordinates, rgba color, atlas page
+#define TEXT_VERTEX_FLOATS 9
+	std::vector<float> textVertices;
+	float textPvm[16];
+	size_t textQuadCapacity = 0; // of the index buffer
+
+	// a glyph of the font atlas; metrics in atlas pixels
+	struct Glyph
+	{
+		float xoff, yoff2, xadvance;
+		float width = 0, height = 0; // zero for glyphs with nothing to draw
+		float s0, t0, s1, t1;
+		int page = 0; // layer of the atlas texture array
+	};
+	static const int FONT_PAGE_SIZE = 512;
+#define FONT_UNIT 16 // sampler2DArray
 	struct Font
 	{
-		float size;
-		GLuint textureId; // font atlas texture object ID stored in TexObjArray
+		float size;		 // what TextCommand::size is relative to
+		float pixelSize; // of the glyphs in the signed distance field atlas
+		float scale;	 // stb_truetype scale for pixelSize
+		GLuint textureId = 0; // GL_TEXTURE_2D_ARRAY, a layer per page
 		stbtt_fontinfo info;
-		stbtt_packedchar packedChars[96];
-		stbtt_aligned_quad alignedQuads[96];
+		std::unordered_map<uint32_t, Glyph> glyphs; // by code point; one entry for all those the font lacks
+		std::vector<std::vector<uint8_t>> pages;	 // kept to fill the texture again when a page is added
+		stbrp_context packer;						 // of the last page
+		std::vector<stbrp_node> packerNodes;
 	} font{};
+
+	// the glyph of codepoint, rasterized into the atlas the first time
+	const Glyph &glyph(uint32_t codepoint);
 };
@@ -1,8 +1,22 @@
 #include "sceneObject.h"
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
 SceneObject::SceneObject(const std::vector<int> &meshes, int texMode_)
-	: meshID(meshes), texMode(texMode_), collider(this) {}
+	: meshID(meshes), texMode(texMode_), collider(this)
+{
+	switch (texMode)
+	{
+	case TEXTURE_FLOOR: texLayer = LAYER_FLOOR; break;
+	case TEXTURE_STONE: texLayer = LAYER_STONE; normalLayer = LAYER_NORMALMAP; break;
+	case TEXTURE_WINDOW: texLayer = LAYER_WINDOW; break;
+	case TEXTURE_BBGRASS: texLayer = LAYER_BBGRASS; break;
+	case TEXTURE_BBTREE: texLayer = LAYER_BBTREE; break;
+	case TEXTURE_LIGHTWOOD: texLayer = LAYER_LIGHTWOOD; break;
+	case TEXTURE_PARTICLE: texLayer = LAYER_PARTICLE; break;
+	}
+}
 
 void SceneObject::handleKeyInput(int) {}
 void SceneObject::handleSpecialKeyInput(int) {}
@@ -10,62 +24,92 @@ void SceneObject::handleKeyRelease(int) {}
 void SceneObject::handleSpecialKeyRelease(int) {}
 void SceneObject::update(float) {}
 
+void SceneObject::getBoundingSphere(Renderer &renderer, float *center, float &radius)
+{
+	float s = std::max(std::fabs(scale[0]), std::max(std::fabs(scale[1]), std::fabs(scale[2])));
+	radius = 0.f;
+	for (int mID : meshID)
+	{
+		const float *b = renderer.getMesh(mID).bounds;
+		radius = std::max(radius, (std::sqrt(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]) + b[3]) * s);
+	}
+	for (int k = 0; k < 3; k++)
+		center[k] = pos[k];
+}
+
 void SceneObject::render(Renderer &renderer, gmu &mu)
 {
-	if (!active)
+	if (!active || renderer.occluded(occlusionGroup))
 		return;
 
-	mu.pushMatrix(gmu::MODEL);
-	if (renderer.renderInverted()) {
-		mu.translate(gmu::MODEL, pos[0], -pos[1], pos[2]);
-	}
-	else if (renderer.renderShadow())
+	// billboards are turned to the camera by the vertex shader, from their position and scale; planar shadows
+	// flatten them with the model matrix, so they are turned here, about the up axis
+	bool gpuBillboard = billboard != Billboard::None && !renderer.renderShadow();
+	float position[3] = {pos[0], renderer.renderInverted() ? -pos[1] : pos[1], pos[2]};
+	float scaled[3] = {scale[0], renderer.renderInverted() ? -scale[1] : scale[1], scale[2]};
+	if (!gpuBillboard)
 	{
-		float mat[16];
-		float floor[4] = { 0,1,0,0 };
-		float sunPos[4] = { 1000,1000,0.1,0 };
-
-		mu.shadow_matrix(mat, floor, sunPos);
-		mu.multMatrix(gmu::MODEL, mat);
-		mu.translate(gmu::MODEL, pos[0], pos[1], pos[2]);
-	}
-	else {
-		mu.translate(gmu::MODEL, pos[0], pos[1], pos[2]);
-	}
-
+		mu.pushMatrix(gmu::MODEL);
+		if (renderer.renderShadow())
+		{
+			float mat[16];
+			float floor[4] = { 0,1,0,0 };
+			float sunPos[4] = { 1000,1000,0.1,0 };
+
+			mu.shadow_matrix(mat, floor, sunPos);
+			mu.multMatrix(gmu::MODEL, mat);
+		}
+		mu.translate(gmu::MODEL, position[0], position[1], position[2]);
+
+		if (billboard != Billboard::None)
+		{
+			// the camera position is -transpose(R) * t of the view matrix
+			const float *v = mu.get(gmu::VIEW);
+			float camX = -(v[0] * v[12] + v[1] * v[13] + v[2] * v[14]);
+			float camZ = -(v[8] * v[12] + v[9] * v[13] + v[10] * v[14]);
+			yaw = std::atan2(camX - pos[0], camZ - pos[2]) * (180.0f / PI_F);
+		}
+		mu.rotate(gmu::MODEL, yaw, 0.0f, 1.0f, 0.0f);
+		mu.rotate(gmu::MODEL, pitch, 1.0f, 0.0f, 0.0f);
+		mu.rotate(gmu::MODEL, roll, 0.0f, 0.0f, 1.0f);
+		mu.scale(gmu::MODEL, scaled[0], scaled[1], scaled[2]);
 
-	mu.rotate(gmu::MODEL, yaw, 0.0f, 1.0f, 0.0f);
-	mu.rotate(gmu::MODEL, pitch, 1.0f, 0.0f, 0.0f);
-	mu.rotate(gmu::MODEL, roll, 0.0f, 0.0f, 1.0f);
-	if (renderer.renderInverted()) {
-		mu.scale(gmu::MODEL, scale[0], -scale[1], scale[2]);
-	}
-	else {
-		mu.scale(gmu::MODEL, scale[0], scale[1], scale[2]);
+		mu.computeDerivedMatrix(gmu::VIEW_MODEL);
 	}
 
-	mu.computeDerivedMatrix(gmu::PROJ_VIEW_MODEL);
-	mu.computeNormalMatrix3x3();
-
-	for (int mID : meshID)
+	lodLevel.resize(meshID.size());
+	for (size_t i = 0; i < meshID.size(); i++)
 	{
 		dataMesh data;
-		data.meshID = mID;
+		data.meshID = meshID[i];
+		data.lod = &lodLevel[i];
 		data.texMode = texMode;
+		data.texLayer = texLayer;
+		data.normalLayer = normalLayer;
 		if (renderer.renderShadow() && texMode != 5) {
 			data.texMode = 0;
 		}
 		else if (renderer.renderShadow()) {
 			data.texMode = 14; // billboard shadow
 		}
-		data.vm = mu.get(gmu::VIEW_MODEL);
-		data.pvm = mu.get(gmu::PROJ_VIEW_MODEL);
-		data.normal = mu.getNormalMatrix();
-
-		renderer.renderMesh(data);
+		data.proj = mu.get(gmu::PROJECTION);
+		data.tint = tint;
+		data.blended = transparent;
+
+		if (gpuBillboard)
+		{
+			data.vm = mu.get(gmu::VIEW);
+			renderer.submitBillboard(data, position, scaled, billboard);
+		}
+		else
+		{
+			data.vm = mu.get(gmu::VIEW_MODEL);
+			renderer.submit(data);
+		}
 	}
 
-	mu.popMatrix(gmu::MODEL);
+	if (!gpuBillboard)
+		mu.popMatrix(gmu::MODEL);
 }
 
 void SceneObject::onCollision(Collider *other)
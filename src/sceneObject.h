@@ -14,7 +14,37 @@ enum TexMode
 	TEXTURE_BBGRASS,
 	TEXTURE_BBTREE,
 	TEXTURE_LIGHTWOOD,
-	TEXTURE_PARTICLE
+	TEXTURE_PARTICLE,
+	TEXTURE_FLARE, // additive, no lighting
+	TEXTURE_MIRROR = 15, // the rear view mirror image, unlit (Renderer::beginMirror)
+	TEXTURE_IMPOSTOR,	 // a layer of the impostor array (Renderer::beginImpostors), texLayer picks it
+	TEXTURE_IMPOSTOR_BAKE // billboard tree, unlit, as baked into an impostor
+};
+
+// Layers of the mesh texture arrays, in the order buildScene loads them (see Renderer::TexArray)
+enum SurfaceLayer
+{
+	LAYER_STONE,
+	LAYER_FLOOR,
+	LAYER_WINDOW,
+	LAYER_LIGHTWOOD,
+	LAYER_NORMALMAP
+};
+
+enum BillboardLayer
+{
+	LAYER_BBGRASS,
+	LAYER_BBTREE
+};
+
+enum SpriteLayer
+{
+	LAYER_PARTICLE,
+	LAYER_CRCL,
+	LAYER_FLAR,
+	LAYER_HXGN,
+	LAYER_RING,
+	LAYER_SUN
 };
 
 class SceneObject : public ICollidable
@@ -25,7 +55,14 @@ public:
 	float scale[3] = {1.0f, 1.0f, 1.0f};
 	std::vector<int> meshID;
 	int texMode = 1;
+	int texLayer = 0;	 // layer of the texture array texMode samples, defaults to texMode's own texture
+	int normalLayer = 0; // normal map layer, for the normal mapped texModes
+	float tint[4] = {1.0f, 1.0f, 1.0f, 1.0f}; // multiplies the shaded color, per instance
 	bool active = true;
+	bool transparent = false; // alpha blended, drawn after the opaque meshes of the same flush
+	int occlusionGroup = -1;  // skipped in the main view while the group is hidden (Renderer::addOcclusionGroup)
+	std::vector<int> lodLevel; // level of detail of each mesh in the main view, see Renderer::LOD_HYSTERESIS
+	Billboard billboard = Billboard::None; // turned to the camera on the GPU (Renderer::submitBillboard)
 	Collider collider;
 
 public:
@@ -48,5 +85,7 @@ public:
 	void setPosition(float x, float y, float z);
 	void setRotation(float yaw_, float pitch_, float roll_);
 	void setScale(float x, float y, float z);
+	// world space sphere around its meshes, whatever its rotation
+	void getBoundingSphere(Renderer &renderer, float *center, float &radius);
 	void toggle() { active = !active; }
 };
@@ -57,7 +57,7 @@ Shader::init()
 
 
 void 
-Shader::compileShader(Shader::ShaderType st, std::string fileName)
+Shader::compileShader(Shader::ShaderType st, std::string fileName, const std::string &defines)
 {
 	// init should always be called first
 	assert(pInited == true);
@@ -67,10 +67,20 @@ Shader::compileShader(Shader::ShaderType st, std::string fileName)
 	s = textFileRead(fileName);
 
 	if (s != NULL) {
-		const char * ss = s;
+		// the defines go right after the #version line, which must stay first;
+		// #line keeps the compiler messages on the file's own line numbers
+		std::string source = s;
+		std::string version, body = source;
+		if (source.compare(0, 8, "#version") == 0) {
+			size_t eol = source.find('\n');
+			version = source.substr(0, eol == std::string::npos ? source.size() : eol + 1);
+			body = eol == std::string::npos ? "" : source.substr(eol + 1);
+		}
+		std::string lineDirective = version.empty() ? "#line 1\n" : "#line 2\n";
+		const char *ss[4] = { version.c_str(), defines.c_str(), lineDirective.c_str(), body.c_str() };
 
 		pShader[st] = glCreateShader(spGLShaderTypes[st]);
-		glShaderSource(pShader[st], 1, &ss,NULL);
+		glShaderSource(pShader[st], 4, ss, NULL);
 		glAttachShader(pProgram, pShader[st]);
 		glCompileShader(pShader[st]);
 
@@ -30,7 +30,9 @@ public:
 		VERTEX_ATTRIB1,
 		VERTEX_ATTRIB2,
 		VERTEX_ATTRIB3,
-		VERTEX_ATTRIB4
+		VERTEX_ATTRIB4,
+		INSTANCE_TINT_ATTRIB,	  // per instance (divisor 1)
+		INSTANCE_VIEWMODEL_ATTRIB // per instance mat4, takes this location and the next 3
 	};
 
 	/// Types of Shaders
@@ -56,8 +58,9 @@ public:
 	 *
 	 * \param st one of the enum values of ShaderType
 	 *	\param filename the file where the source is to be found
+	 *	\param defines preprocessor lines (e.g. "#define LIGHTING\n") inserted after the #version line
 	 */
-	void compileShader(Shader::ShaderType st, std::string fileName);
+	void compileShader(Shader::ShaderType st, std::string fileName, const std::string &defines = "");
 
 	/// returns the program index
 	GLuint getProgramIndex();
@@ -0,0 +1,286 @@
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+#include "softwareOcclusion.h"
+
+#define TILE 8 // tileMax granularity, in depth buffer pixels
+#define TILES_X (SoftwareOcclusion::WIDTH / TILE)
+#define TILES_Y (SoftwareOcclusion::HEIGHT / TILE)
+#define MAX_BANDS 4
+
+static_assert(SoftwareOcclusion::WIDTH % 4 == 0, "rows are rasterized 4 pixels at a time");
+static_assert(SoftwareOcclusion::WIDTH % TILE == 0 && SoftwareOcclusion::HEIGHT % TILE == 0, "whole tiles");
+
+// the 12 triangles of a box, corner i is (i & 1 ? max x : min x, i & 2 ? max y : min y, i & 4 ? max z : min z)
+static const int boxTriangles[12][3] = {
+	{0, 2, 1}, {1, 2, 3}, {4, 5, 6}, {5, 7, 6}, {0, 1, 4}, {1, 5, 4},
+	{2, 6, 3}, {3, 6, 7}, {0, 4, 2}, {2, 4, 6}, {1, 3, 5}, {3, 7, 5}};
+
+// res = m * (x, y, z, 1), column major
+static void transformPoint(const float *m, float x, float y, float z, float *res)
+{
+	for (int row = 0; row < 4; row++)
+		res[row] = m[row] * x + m[4 + row] * y + m[8 + row] * z + m[12 + row];
+}
+
+SoftwareOcclusion::SoftwareOcclusion()
+{
+	depth.assign(WIDTH * HEIGHT, 1.f);
+	tileMax.assign(TILES_X * TILES_Y, 1.f);
+	bands = (int)std::min(std::max(std::thread::hardware_concurrency(), 1u), (unsigned int)MAX_BANDS);
+}
+
+SoftwareOcclusion::~SoftwareOcclusion()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	startWork.notify_all();
+	for (auto &worker : workers)
+		worker.join();
+}
+
+void SoftwareOcclusion::addOccluder(const float *boxMin, const float *boxMax)
+{
+	occluders.insert(occluders.end(), boxMin, boxMin + 3);
+	occluders.insert(occluders.end(), boxMax, boxMax + 3);
+}
+
+void SoftwareOcclusion::render(const float *view, const float *proj)
+{
+	ready = enabled;
+	if (!enabled)
+		return;
+
+	// viewProj = proj * view
+	for (int col = 0; col < 4; col++)
+		for (int row = 0; row < 4; row++)
+		{
+			float sum = 0.f;
+			for (int k = 0; k < 4; k++)
+				sum += proj[k * 4 + row] * view[col * 4 + k];
+			viewProj[col * 4 + row] = sum;
+		}
+
+	// project the occluders once; the bands only rasterize
+	triangles.clear();
+	for (size_t i = 0; i < occluders.size(); i += 6)
+	{
+		const float *lo = &occluders[i], *hi = &occluders[i + 3];
+		float clip[8][4];
+		for (int c = 0; c < 8; c++)
+			transformPoint(viewProj, c & 1 ? hi[0] : lo[0], c & 2 ? hi[1] : lo[1], c & 4 ? hi[2] : lo[2], clip[c]);
+
+		for (const auto &tri : boxTriangles)
+		{
+			// a triangle reaching in front of the near plane is dropped: the GPU clips that part away, so it hides
+			// nothing, and dropping occluders only ever keeps objects
+			bool nearClipped = false;
+			for (int v : tri)
+				nearClipped |= clip[v][3] <= 0.f || clip[v][2] < -clip[v][3];
+			if (nearClipped)
+				continue;
+
+			Triangle t;
+			for (int k = 0; k < 3; k++)
+			{
+				const float *p = clip[tri[k]];
+				t.x[k] = (p[0] / p[3] * 0.5f + 0.5f) * WIDTH;
+				t.y[k] = (p[1] / p[3] * 0.5f + 0.5f) * HEIGHT;
+				t.z[k] = p[2] / p[3];
+			}
+			triangles.push_back(t);
+		}
+	}
+	stats.occluderTriangles += (unsigned int)triangles.size();
+
+	// the workers are started on first use
+	if (workers.empty())
+		for (int band = 1; band < bands; band++)
+			workers.emplace_back(&SoftwareOcclusion::workerLoop, this, band);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		frame++;
+		busy = bands - 1;
+	}
+	startWork.notify_all();
+	rasterizeBand(0);
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		workDone.wait(lock, [this] { return busy == 0; });
+	}
+
+	buildTiles();
+}
+
+void SoftwareOcclusion::workerLoop(int band)
+{
+	unsigned int done = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			startWork.wait(lock, [&] { return quit || frame != done; });
+			if (quit)
+				return;
+			done = frame;
+		}
+		rasterizeBand(band);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busy--;
+		}
+		workDone.notify_one();
+	}
+}
+
+void SoftwareOcclusion::rasterizeBand(int band)
+{
+	int rows = HEIGHT / bands;
+	int bandY0 = band * rows, bandY1 = band == bands - 1 ? HEIGHT : bandY0 + rows;
+	std::fill(depth.begin() + bandY0 * WIDTH, depth.begin() + bandY1 * WIDTH, 1.f);
+
+	const __m128 laneOffset = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	const __m128 zero = _mm_setzero_ps();
+	for (const Triangle &t : triangles)
+	{
+		float x[3] = {t.x[0], t.x[1], t.x[2]}, y[3] = {t.y[0], t.y[1], t.y[2]}, z[3] = {t.z[0], t.z[1], t.z[2]};
+		float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+		if (std::fabs(area) < 1e-6f)
+			continue;
+		// counter-clockwise, whichever side of the box faces the camera
+		if (area < 0.f)
+		{
+			std::swap(x[1], x[2]);
+			std::swap(y[1], y[2]);
+			std::swap(z[1], z[2]);
+			area = -area;
+		}
+
+		int minX = std::max(0, (int)std::floor(std::min({x[0], x[1], x[2]})));
+		int maxX = std::min(WIDTH - 1, (int)std::ceil(std::max({x[0], x[1], x[2]})));
+		int minY = std::max(bandY0, (int)std::floor(std::min({y[0], y[1], y[2]})));
+		int maxY = std::min(bandY1 - 1, (int)std::ceil(std::max({y[0], y[1], y[2]})));
+		if (minX > maxX || minY > maxY)
+			continue;
+
+		// edge functions A x + B y + C, positive inside; edge i is opposite vertex i
+		float a[3], b[3], c[3];
+		for (int i = 0; i < 3; i++)
+		{
+			int p = (i + 1) % 3, q = (i + 2) % 3;
+			a[i] = y[p] - y[q];
+			b[i] = x[q] - x[p];
+			c[i] = x[p] * y[q] - x[q] * y[p];
+		}
+		// depth plane from the barycentric weights (edge i / area)
+		float za = (a[0] * z[0] + a[1] * z[1] + a[2] * z[2]) / area;
+		float zb = (b[0] * z[0] + b[1] * z[1] + b[2] * z[2]) / area;
+		float zc = (c[0] * z[0] + c[1] * z[1] + c[2] * z[2]) / area;
+
+		__m128 ea0 = _mm_set1_ps(a[0]), ea1 = _mm_set1_ps(a[1]), ea2 = _mm_set1_ps(a[2]), dza = _mm_set1_ps(za);
+		for (int py = minY; py <= maxY; py++)
+		{
+			float cy = py + 0.5f;
+			__m128 e0row = _mm_set1_ps(b[0] * cy + c[0]);
+			__m128 e1row = _mm_set1_ps(b[1] * cy + c[1]);
+			__m128 e2row = _mm_set1_ps(b[2] * cy + c[2]);
+			__m128 zrow = _mm_set1_ps(zb * cy + zc);
+			float *row = &depth[py * WIDTH];
+
+			// 4 pixel centers at a time, from the aligned group holding minX
+			for (int px = minX & ~3; px <= maxX; px += 4)
+			{
+				__m128 cx = _mm_add_ps(_mm_set1_ps((float)px), laneOffset);
+				__m128 e0 = _mm_add_ps(_mm_mul_ps(ea0, cx), e0row);
+				__m128 e1 = _mm_add_ps(_mm_mul_ps(ea1, cx), e1row);
+				__m128 e2 = _mm_add_ps(_mm_mul_ps(ea2, cx), e2row);
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+				if (_mm_movemask_ps(inside) == 0)
+					continue;
+
+				__m128 pz = _mm_add_ps(_mm_mul_ps(dza, cx), zrow);
+				__m128 old = _mm_loadu_ps(row + px);
+				__m128 nearest = _mm_min_ps(old, pz);
+				_mm_storeu_ps(row + px, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+			}
+		}
+	}
+}
+
+void SoftwareOcclusion::buildTiles()
+{
+	for (int ty = 0; ty < TILES_Y; ty++)
+		for (int tx = 0; tx < TILES_X; tx++)
+		{
+			__m128 farthest = _mm_set1_ps(-1.f);
+			for (int py = ty * TILE; py < (ty + 1) * TILE; py++)
+				for (int px = tx * TILE; px < (tx + 1) * TILE; px += 4)
+					farthest = _mm_max_ps(farthest, _mm_loadu_ps(&depth[py * WIDTH + px]));
+			float lanes[4];
+			_mm_storeu_ps(lanes, farthest);
+			tileMax[ty * TILES_X + tx] = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+		}
+}
+
+SoftwareOcclusion::Result SoftwareOcclusion::test(const float *center, float radius)
+{
+	stats.tested++;
+
+	// the box around the sphere: frustum test on its corners, then its screen rectangle and nearest depth
+	int outside[6] = {};
+	bool crossesNear = false;
+	float minX = INFINITY, maxX = -INFINITY, minY = INFINITY, maxY = -INFINITY, minZ = INFINITY;
+	for (int c = 0; c < 8; c++)
+	{
+		float p[4];
+		transformPoint(viewProj, center[0] + (c & 1 ? radius : -radius), center[1] + (c & 2 ? radius : -radius),
+					   center[2] + (c & 4 ? radius : -radius), p);
+		outside[0] += p[0] < -p[3];
+		outside[1] += p[0] > p[3];
+		outside[2] += p[1] < -p[3];
+		outside[3] += p[1] > p[3];
+		outside[4] += p[2] < -p[3];
+		outside[5] += p[2] > p[3];
+		if (p[3] <= 0.f || p[2] < -p[3])
+		{
+			crossesNear = true;
+			continue;
+		}
+		float sx = (p[0] / p[3] * 0.5f + 0.5f) * WIDTH, sy = (p[1] / p[3] * 0.5f + 0.5f) * HEIGHT;
+		minX = std::min(minX, sx);
+		maxX = std::max(maxX, sx);
+		minY = std::min(minY, sy);
+		maxY = std::max(maxY, sy);
+		minZ = std::min(minZ, p[2] / p[3]);
+	}
+	for (int plane = 0; plane < 6; plane++)
+		if (outside[plane] == 8)
+		{
+			stats.outsideFrustum++;
+			return OutsideFrustum;
+		}
+
+	// reaching the camera: nothing can be in front of all of it
+	if (!ready || crossesNear)
+		return Visible;
+
+	int tx0 = std::max(0, (int)std::floor(minX) / TILE), tx1 = std::min(TILES_X - 1, (int)std::floor(maxX) / TILE);
+	int ty0 = std::max(0, (int)std::floor(minY) / TILE), ty1 = std::min(TILES_Y - 1, (int)std::floor(maxY) / TILE);
+	if (tx0 > tx1 || ty0 > ty1)
+		return Visible;
+	float farthest = -1.f;
+	for (int ty = ty0; ty <= ty1; ty++)
+		for (int tx = tx0; tx <= tx1; tx++)
+			farthest = std::max(farthest, tileMax[ty * TILES_X + tx]);
+
+	// hidden when its nearest point is behind the farthest occluder pixel of every tile it covers
+	if (minZ > farthest)
+	{
+		stats.occluded++;
+		return Occluded;
+	}
+	return Visible;
+}
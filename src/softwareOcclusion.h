@@ -0,0 +1,74 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// CPU occlusion culling: a few large occluders (boxes inside the buildings) are rasterized each frame into a
+// small depth buffer, split in horizontal bands across worker threads, 4 pixels at a time with SSE. Objects are
+// then tested against it, together with the view frustum, before anything is submitted to the renderer.
+// Costs no GPU work nor any readback, for the machines where the GPU is llvmpipe.
+class SoftwareOcclusion
+{
+public:
+	// depth buffer resolution; the width is a multiple of 4 (SSE) and the height of the tile size
+	static const int WIDTH = 256;
+	static const int HEIGHT = 128;
+
+	enum Result
+	{
+		Visible,
+		OutsideFrustum,
+		Occluded
+	};
+
+	struct Stats
+	{
+		unsigned int tested = 0;
+		unsigned int outsideFrustum = 0;
+		unsigned int occluded = 0;
+		unsigned int occluderTriangles = 0; // rasterized, after near plane rejection
+	};
+
+	SoftwareOcclusion();
+	~SoftwareOcclusion();
+
+	// world space box; it must lie inside what it stands for, or objects behind it would be culled wrongly
+	void addOccluder(const float *boxMin, const float *boxMax);
+
+	// rasterizes the occluders seen from this view; the following tests are against it
+	void render(const float *view, const float *proj);
+
+	// world space bounding sphere
+	Result test(const float *center, float radius);
+
+	bool enabled = true;
+	Stats stats;
+
+private:
+	struct Triangle
+	{
+		float x[3], y[3], z[3]; // depth buffer pixels, NDC depth
+	};
+
+	std::vector<float> occluders; // 6 floats per box
+	std::vector<Triangle> triangles;
+	std::vector<float> depth;	 // NDC depth, nearest occluder per pixel
+	std::vector<float> tileMax; // farthest depth of each TILE x TILE block, what the tests read
+	float viewProj[16];
+	bool ready = false;
+
+	void rasterizeBand(int band);
+	void buildTiles();
+
+	// worker threads, each owning a band of rows; the calling thread rasterizes band 0
+	int bands = 1;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable startWork, workDone;
+	unsigned int frame = 0;
+	int busy = 0;
+	bool quit = false;
+
+	void workerLoop(int band);
+};
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include "streamBuffer.h"
+
+static const GLbitfield PERSISTENT_FLAGS = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+void StreamBuffer::init(GLenum bufferTarget, size_t size)
+{
+	target = bufferTarget;
+	persistentMapping = GLEW_ARB_buffer_storage != 0;
+	allocate(size);
+}
+
+void StreamBuffer::allocate(size_t size)
+{
+	for (GLsync &fence : fences)
+	{
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+	if (name)
+	{
+		// the draws already issued keep the old storage alive
+		glBindBuffer(target, name);
+		if (mapped)
+			glUnmapBuffer(target);
+		glDeleteBuffers(1, &name);
+	}
+
+	regionSize = size;
+	region = 0;
+	cursor = 0;
+	mapped = nullptr;
+	glGenBuffers(1, &name);
+	glBindBuffer(target, name);
+	if (persistentMapping)
+	{
+		// immutable storage: growing means a new buffer
+		glBufferStorage(target, regionSize * REGIONS, nullptr, PERSISTENT_FLAGS);
+		mapped = (char *)glMapBufferRange(target, 0, regionSize * REGIONS, PERSISTENT_FLAGS);
+	}
+	else
+		glBufferData(target, regionSize, nullptr, GL_STREAM_DRAW);
+}
+
+void *StreamBuffer::map(size_t bytes, size_t alignment, size_t &offset)
+{
+	size_t regionStart = persistentMapping ? region * regionSize : 0;
+	size_t aligned = (cursor + alignment - 1) / alignment * alignment; // of the buffer start, for base vertex / instance
+
+	if (aligned + bytes > regionStart + regionSize)
+	{
+		if (persistentMapping || bytes > regionSize)
+		{
+			// persistent: the other regions may still be read, so the frame goes on in a new, larger buffer
+			allocate(std::max(bytes, regionSize * 2));
+		}
+		else
+		{
+			// a new storage for the buffer name; the one being read by earlier draws is freed after them
+			glBindBuffer(target, name);
+			glBufferData(target, regionSize, nullptr, GL_STREAM_DRAW);
+		}
+		aligned = persistentMapping ? region * regionSize : 0;
+	}
+
+	offset = aligned;
+	cursor = aligned + bytes;
+	glBindBuffer(target, name);
+	if (persistentMapping)
+		return mapped + offset;
+	return glMapBufferRange(target, offset, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+void StreamBuffer::unmap()
+{
+	// coherent: the writes are seen by the following draws without a flush
+	if (persistentMapping)
+		return;
+	glBindBuffer(target, name);
+	glUnmapBuffer(target);
+}
+
+void StreamBuffer::endFrame()
+{
+	if (!persistentMapping || !name)
+		return;
+
+	glDeleteSync(fences[region]);
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	region = (region + 1) % REGIONS;
+	cursor = region * regionSize;
+
+	// the GPU is at most REGIONS - 1 frames behind; this only waits when it is further
+	if (fences[region])
+	{
+		while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+			;
+		glDeleteSync(fences[region]);
+		fences[region] = nullptr;
+	}
+}
+
+void StreamBuffer::release()
+{
+	for (GLsync &fence : fences)
+	{
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+	if (name && mapped)
+	{
+		glBindBuffer(target, name);
+		glUnmapBuffer(target);
+	}
+	glDeleteBuffers(1, &name);
+	name = 0;
+	mapped = nullptr;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <GL/glew.h>
+#include <cstddef>
+
+// Per frame data written by the CPU straight into buffer memory. With ARB_buffer_storage the buffer is mapped once,
+// persistently and coherently, and split into REGIONS regions used a frame each in turn: a fence at the end of each
+// frame guards its region, waited for only when that region comes round again. Otherwise each write maps its range
+// unsynchronized, and the buffer is orphaned when the writes reach its end.
+// Data is appended during the frame, so the draws of one flush never overwrite those of an earlier one.
+class StreamBuffer
+{
+public:
+	static const int REGIONS = 3;
+
+	// size: bytes a frame is expected to write; the buffer grows when a frame writes more
+	void init(GLenum target, size_t size);
+	void release();
+
+	// room for bytes, at a multiple of alignment (e.g. a vertex size, for a base vertex or instance), mapped until
+	// unmap. Leaves the buffer bound to its target; buffer() may change, the attribute pointers then need setting again
+	void *map(size_t bytes, size_t alignment, size_t &offset);
+	void unmap();
+
+	// fences what this frame wrote and moves on to the next region
+	void endFrame();
+
+	GLuint buffer() const { return name; }
+	bool persistent() const { return persistentMapping; }
+
+private:
+	GLenum target = GL_ARRAY_BUFFER;
+	GLuint name = 0;
+	size_t regionSize = 0; // persistent: bytes of each region; otherwise of the whole buffer
+	size_t cursor = 0;	   // next free byte
+	int region = 0;
+	bool persistentMapping = false;
+	char *mapped = nullptr; // persistent mapping of the whole buffer
+	GLsync fences[REGIONS] = {};
+
+	void allocate(size_t size);
+};
@@ -40,6 +40,52 @@ void Texture::texture2D_Loader(const char *strFileName, bool repeat)
 	textureArray.push_back(id);
 }
 
+unsigned int Texture::texture2DArray_Loader(const std::vector<const char *> &fileNames, int size, bool repeat)
+{
+	GLuint id;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	GLint wrap = repeat ? GL_REPEAT : GL_CLAMP_TO_EDGE;
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+
+	GLsizei layers = (GLsizei)fileNames.size();
+	glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, size, size, layers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	ilEnable(IL_ORIGIN_SET);
+	ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
+	for (GLsizei layer = 0; layer < layers; layer++) {
+		ILuint ImageId;
+		ilGenImages(1, &ImageId);
+		ilBindImage(ImageId);
+
+		if (ilLoadImage(fileNames[layer]))
+			printf("2D Texture Array: Image %s sucessfully loaded in layer %d.\n", fileNames[layer], layer);
+		else {
+			printf("2D Texture Array: ERROR loading image %s.\n", fileNames[layer]);
+			exit(0);
+		}
+
+		ilConvertImage(GL_RGBA, GL_UNSIGNED_BYTE);
+
+		// all the layers of an array share its size
+		if (ilGetInteger(IL_IMAGE_WIDTH) != size || ilGetInteger(IL_IMAGE_HEIGHT) != size) {
+			iluImageParameter(ILU_FILTER, ILU_BILINEAR);
+			iluScale(size, size, 1);
+		}
+
+		glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE, ilGetData());
+		ilDeleteImages(1, &ImageId);
+	}
+	ilDisable(IL_ORIGIN_SET);
+
+	glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+	textureArray.push_back(id);
+	return (unsigned int)textureArray.size() - 1;
+}
+
 void Texture::textureCubeMap_Loader(const char **strFileName)
 {
 	ILuint ImageName;
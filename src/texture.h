@@ -14,6 +14,10 @@ class Texture
 public:
 	void texture2D_Loader(const char *strFileName, bool repeat = true);
 
+	// Loads the images as the layers of one GL_TEXTURE_2D_ARRAY of size x size texels, in order.
+	// Images of another size are rescaled. Returns the texture object index (as getTextureId takes)
+	unsigned int texture2DArray_Loader(const std::vector<const char *> &fileNames, int size, bool repeat = true);
+
 	// Loader de uma textura apenas com um canal de cor
 	void texture2D_Loader(int width, int height, const uint8_t *data);
 